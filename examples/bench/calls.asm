@@ -0,0 +1,70 @@
+; Call and memory benchmark: hand-written subroutines that fill a 256-byte
+; table at 0x8000 and sum it back through indirect stores and loads; counters
+; live at 0x8100-0x8103
+        PUSH 40
+        STORE 0x8103        ; Rounds left
+round:
+        PUSH 250
+        STORE 0x8100        ; Passes per round left
+outer:
+        CALL fill
+        CALL sum
+        LOAD 0x8100
+        PUSH 1
+        SUB
+        DUP
+        STORE 0x8100
+        JNZ outer
+        LOAD 0x8103
+        PUSH 1
+        SUB
+        DUP
+        STORE 0x8103
+        JNZ round
+        LOAD 0x8102         ; Checksum as a digit
+        PUSH 10
+        MOD
+        PUSH 48
+        ADD
+        SYS 1
+        PUSH 10
+        SYS 1
+        HALT
+
+; table[i] = i * 3 for every i; the index wraps back to 0 after 255
+fill:
+        PUSH 0
+        STORE 0x8101
+fill_next:
+        LOAD 0x8101
+        PUSH 3
+        MUL
+        PUSH 0x80
+        LOAD 0x8101
+        STORE_IND
+        LOAD 0x8101
+        PUSH 1
+        ADD
+        DUP
+        STORE 0x8101
+        JNZ fill_next
+        RET
+
+; 0x8102 += table[i] for every i
+sum:
+        PUSH 0
+        STORE 0x8101
+sum_next:
+        PUSH 0x80
+        LOAD 0x8101
+        LOAD_IND
+        LOAD 0x8102
+        ADD
+        STORE 0x8102
+        LOAD 0x8101
+        PUSH 1
+        ADD
+        DUP
+        STORE 0x8101
+        JNZ sum_next
+        RET
@@ -0,0 +1,62 @@
+; Call and data test: subroutines fill a table at 0x8000 through indirect
+; stores and sum it back into .data; the sum is printed as two digits
+.data index 1
+.data total 1
+
+        CALL fill
+        CALL sum
+        LOAD total
+        PUSH 10
+        DIV
+        PUSH 48
+        ADD
+        SYS 1
+        LOAD total
+        PUSH 10
+        MOD
+        PUSH 48
+        ADD
+        SYS 1
+        PUSH 10
+        SYS 1
+        HALT
+
+; table[i] = i for i in 0..9
+fill:
+        PUSH 0
+        STORE index
+fill_next:
+        LOAD index
+        PUSH 0x80
+        LOAD index
+        STORE_IND
+        LOAD index
+        PUSH 1
+        ADD
+        DUP
+        STORE index
+        PUSH 10
+        LT
+        JNZ fill_next
+        RET
+
+; total = table[0] + ... + table[9]
+sum:
+        PUSH 0
+        STORE index
+sum_next:
+        PUSH 0x80
+        LOAD index
+        LOAD_IND
+        LOAD total
+        ADD
+        STORE total
+        LOAD index
+        PUSH 1
+        ADD
+        DUP
+        STORE index
+        PUSH 10
+        LT
+        JNZ sum_next
+        RET
@@ -1,34 +1,80 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "vm.h"
+#include "build_cache.h"
+#include "object.h"
+#include "debug_info.h"
 
-#define MAX_LABELS 100
-#define MAX_LINE_LEN 1024
+#define KXASM_VERSION "1.0"
+#define KXASM_BUILD_ID "kxasm " KXASM_VERSION
 
+#define LABEL_TABLE_INITIAL 64  // Hash slots to start with (power of two)
+#define MAX_NUMBER_LEN 32      // Longest numeric operand
+#define DATA_LIMIT 0xFF00   // The top page is left to the stack
+
+// A label is created by its first definition or reference, so each
+// reference resolves to a table index once and fixups are a linear pass
 typedef struct {
-    char name[64];
-    uint16_t address;
+    char* name;
+    uint32_t hash;
+    uint16_t address;       // Offset in its section
+    uint8_t section;        // KXO_SECTION_CODE, KXO_SECTION_DATA for .data, or KXO_SECTION_UNDEF
+    uint8_t flags;          // KXO_SYMBOL_GLOBAL after .global
 } label_t;
 
 typedef struct {
-    char name[64];
-    uint16_t address;
+    int label;
     uint16_t patch_location;
 } label_ref_t;
 
-static label_t labels[MAX_LABELS];
-static label_ref_t label_refs[MAX_LABELS];
+// A branch or call to a label, sized by relax_branches
+typedef struct {
+    uint32_t pos;           // Address of the opcode as first emitted
+    int label;
+    int line_num;
+    uint8_t opcode;         // Long form
+    bool is_short;
+    bool written_short;     // Spelled JMPS, JZS, JNZS or CALLS in the source
+} branch_t;
+
+static label_t* labels = NULL;
 static int label_count = 0;
+static int label_capacity = 0;
+static int* label_slots = NULL;     // Open-addressing index into labels, -1 when empty
+static int label_slot_count = 0;
+static label_ref_t* label_refs = NULL;
 static int label_ref_count = 0;
+static int label_ref_capacity = 0;
+static branch_t* branches = NULL;
+static int branch_count = 0;
+static int branch_capacity = 0;
+static int relax = 1;           // Pick short branches where they reach
+static int numeric_branch_line = 0; // First branch or call to a number, which relaxation would break
 static uint8_t output[VM_MEMORY_SIZE];
-static uint16_t output_pos = 0;
+static uint32_t output_pos = 0;
+static uint16_t data_size = 0;
+static uint16_t data_base = 0;  // Address of .data, fixed once the code is assembled
+static int error_count = 0;
+static int emit_object = 0;     // Write a .kxo module instead of a program image
+static kxo_object_t object;
+static int debug_info = 0;      // Write a .dbg symbol map and line table
+static kxd_info_t debug;
 
 void emit_byte(uint8_t byte) {
     if (output_pos < VM_MEMORY_SIZE) {
-        output[output_pos++] = byte;
+        output[output_pos] = byte;
+    } else if (output_pos == VM_MEMORY_SIZE) {
+        printf("Error: Program does not fit in %d bytes of memory\n", VM_MEMORY_SIZE);
+        error_count++;
     }
+    output_pos++;
 }
 
 void emit_word(uint16_t word) {
@@ -36,270 +82,709 @@ void emit_word(uint16_t word) {
     emit_byte((word >> 8) & 0xFF);
 }
 
-int find_label(const char* name) {
+static void out_of_memory(void) {
+    printf("Error: Out of memory\n");
+    exit(1);
+}
+
+// Grow a doubling array to hold one more element
+static void* grow(void* items, int count, int* capacity, size_t size) {
+    if (count < *capacity) {
+        return items;
+    }
+    int grown = *capacity ? *capacity * 2 : 64;
+    items = realloc(items, grown * size);
+    if (!items) {
+        out_of_memory();
+    }
+    *capacity = grown;
+    return items;
+}
+
+static uint32_t hash_name(const char* name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Slot holding name, or the empty slot where it belongs
+static int* label_slot(const char* name, size_t len, uint32_t hash) {
+    uint32_t mask = (uint32_t)label_slot_count - 1;
+    for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+        int* slot = &label_slots[i];
+        if (*slot < 0) {
+            return slot;
+        }
+        const char* other = labels[*slot].name;
+        if (labels[*slot].hash == hash && memcmp(other, name, len) == 0 && other[len] == '\0') {
+            return slot;
+        }
+    }
+}
+
+// Double the hash index, keeping it at most half full
+static void grow_label_slots(void) {
+    int count = label_slot_count ? label_slot_count * 2 : LABEL_TABLE_INITIAL;
+    int* slots = malloc(count * sizeof(int));
+    if (!slots) {
+        out_of_memory();
+    }
+    memset(slots, 0xFF, count * sizeof(int));
+
+    free(label_slots);
+    label_slots = slots;
+    label_slot_count = count;
+    for (int i = 0; i < label_count; i++) {
+        *label_slot(labels[i].name, strlen(labels[i].name), labels[i].hash) = i;
+    }
+}
+
+// Index of the label called name, created undefined if it is new
+int intern_label(const char* name, size_t len) {
+    if ((label_count + 1) * 2 > label_slot_count) {
+        grow_label_slots();
+    }
+
+    uint32_t hash = hash_name(name, len);
+    int* slot = label_slot(name, len, hash);
+    if (*slot >= 0) {
+        return *slot;
+    }
+
+    labels = grow(labels, label_count, &label_capacity, sizeof(label_t));
+    label_t* label = &labels[label_count];
+    label->name = malloc(len + 1);
+    if (!label->name) {
+        out_of_memory();
+    }
+    memcpy(label->name, name, len);
+    label->name[len] = '\0';
+    label->hash = hash;
+    label->address = 0;
+    label->section = KXO_SECTION_UNDEF;
+    label->flags = 0;
+    *slot = label_count;
+    return label_count++;
+}
+
+void add_label(const char* name, size_t len, uint16_t address, uint8_t section, int line_num) {
+    int index = intern_label(name, len);
+    label_t* label = &labels[index];
+    if (label->section != KXO_SECTION_UNDEF) {
+        printf("Error: Duplicate label '%s' at line %d\n", label->name, line_num);
+        error_count++;
+        return;
+    }
+    label->address = address;
+    label->section = section;
+}
+
+uint16_t label_address(const label_t* label) {
+    return label->section == KXO_SECTION_DATA ? (uint16_t)(data_base + label->address) : label->address;
+}
+
+void add_ref(int label, uint16_t patch_location) {
+    label_refs = grow(label_refs, label_ref_count, &label_ref_capacity, sizeof(label_ref_t));
+    label_refs[label_ref_count].label = label;
+    label_refs[label_ref_count].patch_location = patch_location;
+    label_ref_count++;
+}
+
+void add_label_ref(const char* name, size_t len, uint16_t patch_location) {
+    add_ref(intern_label(name, len), patch_location);
+}
+
+// Record a branch whose opcode was just emitted and leave room for its operand
+void add_branch(const char* name, size_t len, uint8_t opcode, int line_num) {
+    branches = grow(branches, branch_count, &branch_capacity, sizeof(branch_t));
+    branch_t* branch = &branches[branch_count++];
+    branch->pos = output_pos - 1;
+    branch->label = intern_label(name, len);
+    branch->line_num = line_num;
+    branch->written_short = opcode >= OP_JMPS;
+    branch->opcode = branch->written_short ? (uint8_t)(opcode - VM_SHORT_BRANCH_DELTA) : opcode;
+    branch->is_short = branch->written_short;
+    if (branch->written_short) {
+        emit_byte(0);
+    } else {
+        emit_word(0);
+    }
+}
+
+/*
+ * Branch relaxation. Branches are first emitted long (3 bytes) unless
+ * written short. Every branch to a code label then starts short, and the
+ * ones whose target lies out of reach once the code closes up go back to
+ * long, until no branch changes. Lengthening only moves code apart, so
+ * this ends after a few sweeps. The code is then compacted in place and
+ * labels and fixups move with it.
+ */
+
+// shrunk[i]: bytes saved by the first i branches
+static uint32_t* shrunk = NULL;
+
+static uint32_t relaxed_address(uint32_t old) {
+    int lo = 0, hi = branch_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (branches[mid].pos < old) lo = mid + 1; else hi = mid;
+    }
+    return old - shrunk[lo];
+}
+
+static void count_shrunk(void) {
+    shrunk[0] = 0;
+    for (int i = 0; i < branch_count; i++) {
+        shrunk[i + 1] = shrunk[i] + (branches[i].is_short && !branches[i].written_short);
+    }
+}
+
+static bool reaches(const branch_t* branch, uint32_t from) {
+    int32_t offset = (int32_t)relaxed_address(labels[branch->label].address) - (int32_t)from;
+    return offset >= VM_SHORT_BRANCH_MIN && offset <= VM_SHORT_BRANCH_MAX;
+}
+
+void relax_branches(void) {
+    if (output_pos > VM_MEMORY_SIZE) {
+        return;
+    }
+    if (relax && numeric_branch_line > 0) {
+        printf("Note: Branch to a numeric address at line %d; keeping all branches long\n", numeric_branch_line);
+        relax = 0;
+    }
+    shrunk = malloc((branch_count + 1) * sizeof(uint32_t));
+    if (!shrunk) {
+        out_of_memory();
+    }
+
+    for (int i = 0; i < branch_count; i++) {
+        branch_t* branch = &branches[i];
+        bool local = labels[branch->label].section == KXO_SECTION_CODE;
+        if (branch->written_short && !local) {
+            printf("Error: Short branch to '%s' at line %d needs a code label\n", labels[branch->label].name, branch->line_num);
+            error_count++;
+        }
+        branch->is_short = branch->written_short || (relax && local);
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        count_shrunk();
+        for (int i = 0; i < branch_count; i++) {
+            branch_t* branch = &branches[i];
+            if (branch->is_short && !branch->written_short && !reaches(branch, relaxed_address(branch->pos) + 2)) {
+                branch->is_short = false;
+                changed = true;
+            }
+        }
+    }
+
+    // Move labels and existing fixups to their final addresses
     for (int i = 0; i < label_count; i++) {
-        if (strcmp(labels[i].name, name) == 0) {
-            return i;
+        if (labels[i].section == KXO_SECTION_CODE) {
+            labels[i].address = (uint16_t)relaxed_address(labels[i].address);
+        }
+    }
+    for (int i = 0; i < label_ref_count; i++) {
+        label_refs[i].patch_location = (uint16_t)relaxed_address(label_refs[i].patch_location);
+    }
+    for (int i = 0; i < debug.line_count; i++) {
+        debug.lines[i].pc = (uint16_t)relaxed_address(debug.lines[i].pc);
+    }
+
+    uint32_t src = 0, dst = 0;
+    int relaxed = 0;
+    for (int i = 0; i < branch_count; i++) {
+        const branch_t* branch = &branches[i];
+        memmove(output + dst, output + src, branch->pos - src);
+        dst += branch->pos - src;
+        src = branch->pos + (branch->written_short ? 2 : 3);
+
+        if (branch->is_short) {
+            int32_t offset = (int32_t)labels[branch->label].address - (int32_t)(dst + 2);
+            if (labels[branch->label].section == KXO_SECTION_CODE &&
+                (offset < VM_SHORT_BRANCH_MIN || offset > VM_SHORT_BRANCH_MAX)) {
+                printf("Error: Short branch to '%s' at line %d is out of range\n", labels[branch->label].name, branch->line_num);
+                error_count++;
+            }
+            output[dst] = branch->opcode + VM_SHORT_BRANCH_DELTA;
+            output[dst + 1] = (uint8_t)offset;
+            dst += 2;
+            relaxed += !branch->written_short;
+        } else {
+            output[dst] = branch->opcode;
+            add_ref(branch->label, (uint16_t)(dst + 1));
+            output[dst + 1] = output[dst + 2] = 0;
+            dst += 3;
         }
     }
-    return -1;
+    memmove(output + dst, output + src, output_pos - src);
+    output_pos = dst + (output_pos - src);
+
+    if (relaxed > 0) {
+        printf("Relaxed %d of %d branches to short form, saving %u bytes\n", relaxed, branch_count, shrunk[branch_count]);
+    }
+    free(shrunk);
+    shrunk = NULL;
 }
 
-void add_label(const char* name, uint16_t address) {
-    if (label_count < MAX_LABELS) {
-        strcpy(labels[label_count].name, name);
-        labels[label_count].address = address;
-        label_count++;
+void free_labels(void) {
+    for (int i = 0; i < label_count; i++) {
+        free(labels[i].name);
+    }
+    free(labels);
+    free(label_slots);
+    free(label_refs);
+    free(branches);
+}
+
+// Data follows the code in a program image; in an object kxld places it
+void place_data() {
+    data_base = emit_object ? 0 : output_pos;
+    if (!emit_object && output_pos + data_size > DATA_LIMIT) {
+        printf("Error: Data ends past the stack page at 0x%04X\n", DATA_LIMIT);
+        error_count++;
     }
 }
 
-void add_label_ref(const char* name, uint16_t patch_location) {
-    if (label_ref_count < MAX_LABELS) {
-        strcpy(label_refs[label_ref_count].name, name);
-        label_refs[label_ref_count].patch_location = patch_location;
-        label_ref_count++;
+// In an object every label reference becomes a relocation. Labels are the
+// object's symbols in the same order, so an undefined one is its own index.
+void add_reloc(int label_idx, uint16_t patch_pos) {
+    uint8_t kind = KXO_RELOC_SYMBOL;
+    if (labels[label_idx].section == KXO_SECTION_DATA) {
+        kind = KXO_RELOC_DATA;
+    } else if (labels[label_idx].section == KXO_SECTION_CODE) {
+        kind = KXO_RELOC_CODE;
+    }
+    if (!kxo_add_reloc(&object, patch_pos, kind, kind == KXO_RELOC_SYMBOL ? (uint16_t)label_idx : 0)) {
+        out_of_memory();
     }
 }
 
 void patch_labels() {
+    place_data();
+    if (output_pos > VM_MEMORY_SIZE) {
+        return;
+    }
+
     for (int i = 0; i < label_ref_count; i++) {
-        int label_idx = find_label(label_refs[i].name);
-        if (label_idx >= 0) {
-            uint16_t addr = labels[label_idx].address;
-            uint16_t patch_pos = label_refs[i].patch_location;
+        const label_t* label = &labels[label_refs[i].label];
+        uint16_t patch_pos = label_refs[i].patch_location;
+        if (emit_object) {
+            add_reloc(label_refs[i].label, patch_pos);
+        }
+        if (label->section != KXO_SECTION_UNDEF) {
+            uint16_t addr = label_address(label);
             output[patch_pos] = addr & 0xFF;
             output[patch_pos + 1] = (addr >> 8) & 0xFF;
-        } else {
-            printf("Error: Undefined label '%s'\n", label_refs[i].name);
+        } else if (!emit_object) {
+            printf("Error: Undefined label '%s'\n", label->name);
+            error_count++;
         }
     }
 }
 
-int parse_number(const char* str) {
-    if (str[0] == '0' && str[1] == 'x') {
-        return (int)strtol(str, NULL, 16);
+// Opcode table and a perfect hash of its mnemonics, built by init_opcodes
+static const vm_opcode_info_t opcodes[] = {
+#define OPCODE_INFO(name, value, mnemonic, operand) { mnemonic, OP_##name, operand },
+    VM_OPCODES(OPCODE_INFO)
+#undef OPCODE_INFO
+};
+#define OPCODE_COUNT (int)(sizeof(opcodes) / sizeof(opcodes[0]))
+#define OPCODE_SLOTS 128        // Power of two, a few times OPCODE_COUNT
+#define OPCODE_MAX_SEED 100000
+
+static int8_t opcode_slots[OPCODE_SLOTS];  // Index into opcodes, or -1
+static uint32_t opcode_seed = 0;
+
+// Case-insensitive, so source text is looked up without copying it
+static uint32_t hash_mnemonic(const char* text, size_t len, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)toupper((unsigned char)text[i]);
+        hash *= 16777619u;
     }
-    return (int)strtol(str, NULL, 10);
+    return hash ^ (hash >> 16);
 }
 
-void trim_whitespace(char* str) {
-    
-    char* start = str;
-    while (isspace(*start)) start++;
-    
-    
-    char* end = start + strlen(start) - 1;
-    while (end > start && isspace(*end)) end--;
-    
-    
-    size_t len = end - start + 1;
-    memmove(str, start, len);
-    str[len] = '\0';
+// Search for a seed under which every mnemonic hashes to a slot of its own
+int init_opcodes(void) {
+    for (opcode_seed = 0; opcode_seed < OPCODE_MAX_SEED; opcode_seed++) {
+        memset(opcode_slots, -1, sizeof(opcode_slots));
+        int i = 0;
+        for (; i < OPCODE_COUNT; i++) {
+            const char* mnemonic = opcodes[i].mnemonic;
+            uint32_t slot = hash_mnemonic(mnemonic, strlen(mnemonic), opcode_seed) & (OPCODE_SLOTS - 1);
+            if (opcode_slots[slot] >= 0) break;
+            opcode_slots[slot] = (int8_t)i;
+        }
+        if (i == OPCODE_COUNT) {
+            return 1;
+        }
+    }
+    printf("Error: No perfect hash for the opcode table (duplicate mnemonic?)\n");
+    return 0;
 }
 
-int assemble_file(const char* filename) {
-    FILE* file = fopen(filename, "r");
-    if (!file) {
-        printf("Error: Cannot open file '%s'\n", filename);
-        return 1;
+// One hash and one comparison per mnemonic
+const vm_opcode_info_t* find_opcode(const char* text, size_t len) {
+    int index = opcode_slots[hash_mnemonic(text, len, opcode_seed) & (OPCODE_SLOTS - 1)];
+    if (index < 0) {
+        return NULL;
     }
-    
-    char line[MAX_LINE_LEN];
-    int line_num = 0;
-    
-    
-    while (fgets(line, sizeof(line), file)) {
-        line_num++;
-        trim_whitespace(line);
-        
-        
-        if (line[0] == '\0' || line[0] == ';') continue;
-        
-        
-        char* colon = strchr(line, ':');
-        if (colon) {
-            *colon = '\0';
-            trim_whitespace(line);
-            add_label(line, output_pos);
-            
-            
-            char* instruction = colon + 1;
-            trim_whitespace(instruction);
-            if (instruction[0] != '\0' && instruction[0] != ';') {
-                strcpy(line, instruction);
-            } else {
-                continue;
-            }
+
+    const char* mnemonic = opcodes[index].mnemonic;
+    for (size_t i = 0; i < len; i++) {
+        if (mnemonic[i] != toupper((unsigned char)text[i])) {
+            return NULL;
         }
-        
-        
-        char* token = strtok(line, " \t");
-        if (!token) continue;
-        
-        
-        for (char* p = token; *p; p++) *p = toupper(*p);
-        
-        if (strcmp(token, "NOP") == 0) {
-            emit_byte(OP_NOP);
-        } else if (strcmp(token, "HALT") == 0) {
-            emit_byte(OP_HALT);
-        } else if (strcmp(token, "PUSH") == 0) {
-            emit_byte(OP_PUSH);
-            token = strtok(NULL, " \t");
-            if (token) {
-                emit_byte(parse_number(token));
-            }
-        } else if (strcmp(token, "POP") == 0) {
-            emit_byte(OP_POP);
-        } else if (strcmp(token, "DUP") == 0) {
-            emit_byte(OP_DUP);
-        } else if (strcmp(token, "SWAP") == 0) {
-            emit_byte(OP_SWAP);
-        } else if (strcmp(token, "ADD") == 0) {
-            emit_byte(OP_ADD);
-        } else if (strcmp(token, "SUB") == 0) {
-            emit_byte(OP_SUB);
-        } else if (strcmp(token, "MUL") == 0) {
-            emit_byte(OP_MUL);
-        } else if (strcmp(token, "DIV") == 0) {
-            emit_byte(OP_DIV);
-        } else if (strcmp(token, "MOD") == 0) {
-            emit_byte(OP_MOD);
-        } else if (strcmp(token, "NEG") == 0) {
-            emit_byte(OP_NEG);
-        } else if (strcmp(token, "AND") == 0) {
-            emit_byte(OP_AND);
-        } else if (strcmp(token, "OR") == 0) {
-            emit_byte(OP_OR);
-        } else if (strcmp(token, "XOR") == 0) {
-            emit_byte(OP_XOR);
-        } else if (strcmp(token, "NOT") == 0) {
-            emit_byte(OP_NOT);
-        } else if (strcmp(token, "SHL") == 0) {
-            emit_byte(OP_SHL);
-        } else if (strcmp(token, "SHR") == 0) {
-            emit_byte(OP_SHR);
-        } else if (strcmp(token, "EQ") == 0) {
-            emit_byte(OP_EQ);
-        } else if (strcmp(token, "NEQ") == 0) {
-            emit_byte(OP_NEQ);
-        } else if (strcmp(token, "GT") == 0) {
-            emit_byte(OP_GT);
-        } else if (strcmp(token, "LT") == 0) {
-            emit_byte(OP_LT);
-        } else if (strcmp(token, "GTE") == 0) {
-            emit_byte(OP_GTE);
-        } else if (strcmp(token, "LTE") == 0) {
-            emit_byte(OP_LTE);
-        } else if (strcmp(token, "LOAD") == 0) {
-            emit_byte(OP_LOAD);
-            token = strtok(NULL, " \t");
-            if (token) {
-                if (isalpha(token[0])) {
-                    add_label_ref(token, output_pos);
-                    emit_word(0); 
-                } else {
-                    emit_word(parse_number(token));
-                }
-            }
-        } else if (strcmp(token, "STORE") == 0) {
-            emit_byte(OP_STORE);
-            token = strtok(NULL, " \t");
-            if (token) {
-                if (isalpha(token[0])) {
-                    add_label_ref(token, output_pos);
-                    emit_word(0); 
-                } else {
-                    emit_word(parse_number(token));
-                }
-            }
-        } else if (strcmp(token, "LOAD_IND") == 0) {
-            emit_byte(OP_LOAD_IND);
-        } else if (strcmp(token, "STORE_IND") == 0) {
-            emit_byte(OP_STORE_IND);
-        } else if (strcmp(token, "JMP") == 0) {
-            emit_byte(OP_JMP);
-            token = strtok(NULL, " \t");
-            if (token) {
-                if (isalpha(token[0])) {
-                    add_label_ref(token, output_pos);
-                    emit_word(0); 
-                } else {
-                    emit_word(parse_number(token));
-                }
-            }
-        } else if (strcmp(token, "JZ") == 0) {
-            emit_byte(OP_JZ);
-            token = strtok(NULL, " \t");
-            if (token) {
-                if (isalpha(token[0])) {
-                    add_label_ref(token, output_pos);
-                    emit_word(0); 
-                } else {
-                    emit_word(parse_number(token));
-                }
-            }
-        } else if (strcmp(token, "JNZ") == 0) {
-            emit_byte(OP_JNZ);
-            token = strtok(NULL, " \t");
-            if (token) {
-                if (isalpha(token[0])) {
-                    add_label_ref(token, output_pos);
-                    emit_word(0); 
-                } else {
-                    emit_word(parse_number(token));
-                }
-            }
-        } else if (strcmp(token, "CALL") == 0) {
-            emit_byte(OP_CALL);
-            token = strtok(NULL, " \t");
-            if (token) {
-                if (isalpha(token[0])) {
-                    add_label_ref(token, output_pos);
-                    emit_word(0); 
-                } else {
-                    emit_word(parse_number(token));
-                }
-            }
-        } else if (strcmp(token, "RET") == 0) {
-            emit_byte(OP_RET);
-        } else if (strcmp(token, "SYS") == 0) {
-            emit_byte(OP_IO);
-            token = strtok(NULL, " \t");
-            if (token) {
-                emit_byte(parse_number(token));
-            }
+    }
+    return mnemonic[len] == '\0' ? &opcodes[index] : NULL;
+}
+
+// A word of the current line, pointing into the mapped source
+typedef struct {
+    const char* start;
+    size_t len;
+} token_t;
+
+static bool is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// Next blank-separated word before end; len is 0 once the line is used up
+static token_t next_token(const char** p, const char* end) {
+    const char* s = *p;
+    while (s < end && is_blank(*s)) s++;
+    const char* e = s;
+    while (e < end && !is_blank(*e)) e++;
+    *p = e;
+    token_t token = { s, (size_t)(e - s) };
+    return token;
+}
+
+static bool token_is(token_t token, const char* word) {
+    size_t i = 0;
+    for (; i < token.len; i++) {
+        if (word[i] == '\0' || toupper((unsigned char)token.start[i]) != word[i]) return false;
+    }
+    return word[i] == '\0';
+}
+
+// Decimal or 0x-prefixed hex; the token is copied since the map has no terminator
+int parse_number(token_t token) {
+    char text[MAX_NUMBER_LEN];
+    size_t len = token.len < MAX_NUMBER_LEN - 1 ? token.len : MAX_NUMBER_LEN - 1;
+    memcpy(text, token.start, len);
+    text[len] = '\0';
+    if (text[0] == '0' && text[1] == 'x') {
+        return (int)strtol(text, NULL, 16);
+    }
+    return (int)strtol(text, NULL, 10);
+}
+
+void assemble_line(const char* p, const char* end, int line_num) {
+    // A ';' starts a comment that runs to the end of the line
+    const char* comment = memchr(p, ';', (size_t)(end - p));
+    if (comment) end = comment;
+
+    const char* colon = memchr(p, ':', (size_t)(end - p));
+    if (colon) {
+        const char* name = p;
+        const char* name_end = colon;
+        while (name < name_end && is_blank(*name)) name++;
+        while (name_end > name && is_blank(name_end[-1])) name_end--;
+        add_label(name, (size_t)(name_end - name), (uint16_t)output_pos, KXO_SECTION_CODE, line_num);
+        p = colon + 1;
+    }
+
+    token_t token = next_token(&p, end);
+    if (token.len == 0) return;
+
+    const vm_opcode_info_t* info;
+    if (token_is(token, ".GLOBAL")) {
+        // Export a label from an object module
+        token = next_token(&p, end);
+        if (token.len > 0) {
+            int index = intern_label(token.start, token.len);
+            labels[index].flags |= KXO_SYMBOL_GLOBAL;
+        }
+    } else if (token_is(token, ".DATA")) {
+        // .data NAME SIZE reserves SIZE bytes of zeroed data
+        token_t name = next_token(&p, end);
+        token = next_token(&p, end);
+        int size = token.len > 0 ? parse_number(token) : 0;
+        if (name.len == 0 || size <= 0 || data_size + size > DATA_LIMIT) {
+            printf("Error: Invalid .data directive at line %d\n", line_num);
+            error_count++;
         } else {
-            printf("Warning: Unknown instruction '%s' at line %d\n", token, line_num);
+            add_label(name.start, name.len, data_size, KXO_SECTION_DATA, line_num);
+            data_size += size;
         }
+    } else if ((info = find_opcode(token.start, token.len)) != NULL) {
+        if (debug_info && output_pos < VM_MEMORY_SIZE && !kxd_add_line(&debug, (uint16_t)output_pos, (uint32_t)line_num)) {
+            out_of_memory();
+        }
+        emit_byte(info->opcode);
+        token = info->operand != VM_OPERAND_NONE ? next_token(&p, end) : (token_t){ NULL, 0 };
+        bool is_label = token.len > 0 && isalpha((unsigned char)token.start[0]);
+        bool is_branch = info->operand == VM_OPERAND_REL8 || info->opcode == OP_JMP || info->opcode == OP_JZ ||
+                         info->opcode == OP_JNZ || info->opcode == OP_CALL;
+        if (is_branch && token.len > 0 && !is_label && numeric_branch_line == 0) {
+            numeric_branch_line = line_num;
+        }
+        if (is_label && is_branch) {
+            add_branch(token.start, token.len, info->opcode, line_num);
+        } else if (token.len > 0 && info->operand != VM_OPERAND_ADDR16) {
+            emit_byte(parse_number(token));
+        } else if (is_label) {
+            add_label_ref(token.start, token.len, (uint16_t)output_pos);
+            emit_word(0);
+        } else if (token.len > 0) {
+            emit_word(parse_number(token));
+        }
+    } else {
+        printf("Warning: Unknown instruction '%.*s' at line %d\n", (int)token.len, token.start, line_num);
     }
-    
-    fclose(file);
-    
+}
+
+// One pass over the source: memchr finds each line end, the lexer
+// walks the line with pointers and nothing is copied
+void assemble_source(const char* source, size_t size) {
+    const char* p = source;
+    const char* end = source + size;
+    int line_num = 0;
+    while (p < end) {
+        const char* line_end = memchr(p, '\n', (size_t)(end - p));
+        if (!line_end) line_end = end;
+        assemble_line(p, line_end, ++line_num);
+        p = line_end + 1;
+    }
+    relax_branches();
     patch_labels();
-    
-    return 0;
+}
+
+// Map a source file read-only; an empty file maps to an empty string
+const char* map_source(const char* filename, size_t* size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    const char* source = NULL;
+    if (fstat(fd, &st) == 0) {
+        *size = (size_t)st.st_size;
+        if (*size == 0) {
+            source = "";
+        } else {
+            void* map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+            source = map == MAP_FAILED ? NULL : map;
+        }
+    }
+    close(fd);
+    return source;
+}
+
+void unmap_source(const char* source, size_t size) {
+    if (size > 0) {
+        munmap((void*)source, size);
+    }
+}
+
+// Add the code and the labels to the object and encode it; NULL on failure
+uint8_t* build_object(uint32_t* size) {
+    for (int i = 0; i < label_count; i++) {
+        if ((labels[i].flags & KXO_SYMBOL_GLOBAL) && labels[i].section == KXO_SECTION_UNDEF) {
+            printf("Error: Global '%s' is not defined\n", labels[i].name);
+            error_count++;
+        }
+    }
+    if (error_count > 0) {
+        return NULL;
+    }
+
+    int ok = kxo_set_code(&object, output, (uint16_t)output_pos);
+    object.data_size = data_size;
+    for (int i = 0; ok && i < label_count; i++) {
+        ok = kxo_add_symbol(&object, labels[i].name, strlen(labels[i].name), labels[i].section,
+                            labels[i].address, labels[i].flags) >= 0;
+    }
+    uint8_t* encoded = ok ? kxo_encode(&object, size) : NULL;
+    if (!encoded) {
+        printf("Error: Out of memory for object file\n");
+    }
+    return encoded;
+}
+
+// Write an image assembled earlier from the same source, and its .dbg for
+// -g; false on a miss
+int write_cached(uint64_t key, uint64_t source_size, const char* filename) {
+    build_cache_entry_t entry;
+    if (!build_cache_lookup(key, source_size, &entry)) {
+        return 0;
+    }
+
+    char debug_path[BUILD_CACHE_MAX_PATH];
+    int ok = !debug_info || (entry.debug && kxd_path(filename, debug_path, sizeof(debug_path)));
+    FILE* output_file = ok ? fopen(filename, "wb") : NULL;
+    ok = output_file && fwrite(entry.image, 1, entry.image_size, output_file) == entry.image_size;
+    if (output_file && fclose(output_file) != 0) {
+        ok = 0;
+    }
+    if (ok && debug_info) {
+        ok = kxd_write_encoded(entry.debug, entry.debug_size, debug_path);
+    }
+    if (ok) {
+        printf("Assembly complete (cached): %u bytes written to '%s'\n", entry.image_size, filename);
+    }
+    build_cache_release(&entry);
+    return ok;
+}
+
+// Write the label map and line table next to the image; returns the
+// encoded .dbg for the build cache, or NULL on failure
+uint8_t* write_debug_info(const char* input_path, const char* output_path, const uint8_t* image, uint32_t size,
+                          uint32_t* debug_size) {
+    char path[BUILD_CACHE_MAX_PATH];
+    int ok = kxd_path(output_path, path, sizeof(path)) && kxd_set_source(&debug, input_path);
+    kxd_set_image(&debug, image, size);
+    for (int i = 0; ok && i < label_count; i++) {
+        if (labels[i].section == KXO_SECTION_UNDEF) continue;
+        uint8_t kind = labels[i].section == KXO_SECTION_CODE ? KXD_SYMBOL_CODE : KXD_SYMBOL_DATA;
+        ok = kxd_add_symbol(&debug, labels[i].name, strlen(labels[i].name), label_address(&labels[i]), kind);
+    }
+
+    uint8_t* encoded = ok ? kxd_encode(&debug, debug_size) : NULL;
+    if (encoded && kxd_write_encoded(encoded, *debug_size, path)) {
+        printf("Debug info: %d symbols, %d line entries written to '%s'\n", debug.symbol_count, debug.line_count, path);
+    } else {
+        printf("Error: Cannot write debug info '%s'\n", path);
+        free(encoded);
+        encoded = NULL;
+    }
+    return encoded;
+}
+
+// Objects are written for -c, or an output ending in .kxo
+int wants_object(const char* filename) {
+    size_t len = strlen(filename);
+    return len >= 4 && strcmp(filename + len - 4, ".kxo") == 0;
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 3) {
-        printf("Usage: %s <input.asm> <output.bin>\n", argv[0]);
+    int argi = 1;
+    for (; argi < argc && argv[argi][0] == '-'; argi++) {
+        if (strcmp(argv[argi], "-c") == 0) {
+            emit_object = 1;
+        } else if (strcmp(argv[argi], "-L") == 0) {
+            relax = 0;
+        } else if (strcmp(argv[argi], "-g") == 0) {
+            debug_info = 1;
+        } else {
+            break;
+        }
+    }
+    if (argc - argi != 2) {
+        printf("Usage: %s [-c] [-g] [-L] <input.asm> <output.bin|output.kxo>\n", argv[0]);
+        printf("  -c  Write an object module for kxld (implied by a .kxo output)\n");
+        printf("  -g  Write a .dbg file with labels and line numbers for kxn\n");
+        printf("  -L  Keep branches long; automatic when a branch targets a number\n");
+        return 1;
+    }
+    const char* input_path = argv[argi];
+    const char* output_path = argv[argi + 1];
+    emit_object = emit_object || wants_object(output_path);
+    if (debug_info && emit_object) {
+        printf("Error: -g needs a program image; objects have no final addresses\n");
+        return 1;
+    }
+
+    size_t source_size = 0;
+    const char* source = map_source(input_path, &source_size);
+    if (!source) {
+        printf("Error: Cannot open file '%s'\n", input_path);
         return 1;
     }
+
+    // The .dbg names the source file, so -g builds also key on its path
+    struct {
+        int settings[3];
+        char source_path[BUILD_CACHE_MAX_PATH];
+    } key_options;
+    memset(&key_options, 0, sizeof(key_options));
+    key_options.settings[0] = emit_object;
+    key_options.settings[1] = relax;
+    key_options.settings[2] = debug_info;
+    if (debug_info) {
+        snprintf(key_options.source_path, sizeof(key_options.source_path), "%s", input_path);
+    }
+    uint64_t cache_key = build_cache_key(KXASM_BUILD_ID, &key_options, sizeof(key_options), source, source_size);
+    if (write_cached(cache_key, source_size, output_path)) {
+        unmap_source(source, source_size);
+        return 0;
+    }
     
-    if (assemble_file(argv[1]) != 0) {
+    if (!init_opcodes()) {
+        unmap_source(source, source_size);
+        return 1;
+    }
+    assemble_source(source, source_size);
+    unmap_source(source, source_size);
+    if (error_count > 0) {
+        printf("Assembly failed: %d errors\n", error_count);
+        kxd_free(&debug);
+        free_labels();
+        return 1;
+    }
+
+    uint8_t* image = output;
+    uint32_t size = output_pos;
+    if (emit_object && !(image = build_object(&size))) {
+        kxo_free(&object);
+        free_labels();
         return 1;
     }
     
-    FILE* output_file = fopen(argv[2], "wb");
+    FILE* output_file = fopen(output_path, "wb");
     if (!output_file) {
-        printf("Error: Cannot create output file '%s'\n", argv[2]);
+        printf("Error: Cannot create output file '%s'\n", output_path);
+        if (emit_object) {
+            free(image);
+            kxo_free(&object);
+        }
+        kxd_free(&debug);
+        free_labels();
         return 1;
     }
     
-    fwrite(output, 1, output_pos, output_file);
+    fwrite(image, 1, size, output_file);
     fclose(output_file);
-    
-    printf("Assembly complete: %d bytes written to '%s'\n", output_pos, argv[2]);
+
+    uint8_t* encoded_debug = NULL;
+    uint32_t debug_size = 0;
+    if (debug_info) {
+        encoded_debug = write_debug_info(input_path, output_path, image, size, &debug_size);
+        kxd_free(&debug);
+        if (!encoded_debug) {
+            free_labels();
+            return 1;
+        }
+    }
+    build_cache_store(cache_key, source_size, image, size, encoded_debug, debug_size);
+    free(encoded_debug);
+    if (emit_object) {
+        printf("Object complete: %u bytes of code, %d bytes of data, %d relocations written to '%s'\n",
+               output_pos, data_size, object.reloc_count, output_path);
+        free(image);
+        kxo_free(&object);
+    } else {
+        printf("Assembly complete: %u bytes written to '%s'\n", output_pos, output_path);
+    }
+    free_labels();
     return 0;
 }
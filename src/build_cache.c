@@ -0,0 +1,192 @@
+/**
+ * Content-addressed build cache for the KXN toolchain
+ * Maps a hash of (tool version, options, source) to the program image
+ * built from it, and for -g builds its .dbg, so an unchanged source costs
+ * a hash and an mmap instead of a full compile.
+ *
+ * Entry layout (native byte order, one file per key): header, image bytes,
+ * debug info bytes
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include "build_cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC "KXC3"
+#define CACHE_BUILD_STAMP CACHE_MAGIC " " KXN_SOURCE_HASH
+
+typedef struct {
+    char magic[4];
+    uint32_t image_size;
+    uint32_t debug_size;
+    uint32_t reserved;      // Keeps the 64-bit fields aligned
+    uint64_t key;
+    uint64_t source_size;
+} cache_header_t;
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME  1099511628211ULL
+
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t size) {
+    const uint8_t* bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+uint64_t build_cache_key(const char* tool_version, const void* options, size_t options_size,
+                         const char* source, size_t source_size) {
+    // Lengths go in first so fields cannot run into each other
+    uint64_t sizes[4] = { strlen(CACHE_BUILD_STAMP), strlen(tool_version), options_size, source_size };
+    uint64_t hash = hash_bytes(FNV_OFFSET, sizes, sizeof(sizes));
+    hash = hash_bytes(hash, CACHE_BUILD_STAMP, sizes[0]);
+    hash = hash_bytes(hash, tool_version, sizes[1]);
+    hash = hash_bytes(hash, options, options_size);
+    return hash_bytes(hash, source, source_size);
+}
+
+/**
+ * Directory holding the cache entries, or false if the cache is disabled
+ */
+static bool cache_dir(char* dir, size_t size) {
+    const char* mode = getenv("KXN_CACHE");
+    if ((mode && strcmp(mode, "off") == 0) || KXN_SOURCE_HASH[0] == '\0') {
+        return false;
+    }
+
+    const char* base = getenv("KXN_CACHE_DIR");
+    int len;
+    if (base && base[0]) {
+        len = snprintf(dir, size, "%s", base);
+    } else if ((base = getenv("XDG_CACHE_HOME")) && base[0]) {
+        len = snprintf(dir, size, "%s/kxn", base);
+    } else if ((base = getenv("HOME")) && base[0]) {
+        len = snprintf(dir, size, "%s/.cache/kxn", base);
+    } else {
+        return false;
+    }
+    return len > 0 && (size_t)len < size;
+}
+
+static bool entry_path(uint64_t key, char* path, size_t size) {
+    char dir[BUILD_CACHE_MAX_PATH];
+    if (!cache_dir(dir, sizeof(dir))) {
+        return false;
+    }
+
+    int len = snprintf(path, size, "%s/%016llx.kxc", dir, (unsigned long long)key);
+    return len > 0 && (size_t)len < size;
+}
+
+/**
+ * Create a directory and any missing parents
+ */
+static bool make_dirs(char* path) {
+    for (char* p = path + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        bool ok = mkdir(path, 0755) == 0 || errno == EEXIST;
+        *p = '/';
+        if (!ok) return false;
+    }
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+bool build_cache_lookup(uint64_t key, uint64_t source_size, build_cache_entry_t* entry) {
+    memset(entry, 0, sizeof(build_cache_entry_t));
+
+    char path[BUILD_CACHE_MAX_PATH];
+    if (!entry_path(key, path, sizeof(path))) {
+        return false;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(cache_header_t)) {
+        close(fd);
+        return false;
+    }
+
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    // Reject entries from another key, source or format, or cut short
+    const cache_header_t* header = map;
+    size_t expected = sizeof(cache_header_t) + (size_t)header->image_size + header->debug_size;
+    if (memcmp(header->magic, CACHE_MAGIC, 4) != 0 || header->key != key ||
+        header->source_size != source_size || expected != (size_t)st.st_size) {
+        munmap(map, (size_t)st.st_size);
+        return false;
+    }
+
+    entry->map = map;
+    entry->map_size = (size_t)st.st_size;
+    entry->image = (const uint8_t*)map + sizeof(cache_header_t);
+    entry->image_size = header->image_size;
+    if (header->debug_size > 0) {
+        entry->debug = entry->image + header->image_size;
+        entry->debug_size = header->debug_size;
+    }
+    return true;
+}
+
+void build_cache_release(build_cache_entry_t* entry) {
+    if (entry->map) {
+        munmap(entry->map, entry->map_size);
+    }
+    memset(entry, 0, sizeof(build_cache_entry_t));
+}
+
+bool build_cache_store(uint64_t key, uint64_t source_size, const uint8_t* image, uint32_t image_size,
+                       const uint8_t* debug, uint32_t debug_size) {
+    char dir[BUILD_CACHE_MAX_PATH];
+    char path[BUILD_CACHE_MAX_PATH];
+    char temp[BUILD_CACHE_MAX_PATH + 32];
+    if (!cache_dir(dir, sizeof(dir)) || !entry_path(key, path, sizeof(path)) || !make_dirs(dir)) {
+        return false;
+    }
+    snprintf(temp, sizeof(temp), "%s.%ld.tmp", path, (long)getpid());
+
+    cache_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, 4);
+    header.image_size = image_size;
+    header.debug_size = debug ? debug_size : 0;
+    header.key = key;
+    header.source_size = source_size;
+
+    FILE* out = fopen(temp, "wb");
+    if (!out) {
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+              fwrite(image, 1, image_size, out) == image_size &&
+              (header.debug_size == 0 || fwrite(debug, 1, header.debug_size, out) == header.debug_size);
+
+    if (fclose(out) != 0) {
+        ok = false;
+    }
+    if (!ok || rename(temp, path) != 0) {
+        remove(temp);
+        return false;
+    }
+    return true;
+}
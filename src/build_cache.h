@@ -0,0 +1,74 @@
+#ifndef BUILD_CACHE_H
+#define BUILD_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define BUILD_CACHE_MAX_PATH 1024 // Longest cache entry path
+
+// Hash of the toolchain sources, passed in by the Makefile so a changed
+// tool never serves entries built by its previous version. Builds without
+// it cannot tell tool versions apart and leave the cache alone.
+#ifndef KXN_SOURCE_HASH
+#define KXN_SOURCE_HASH ""
+#endif
+
+// Cache entry mapped into memory by build_cache_lookup
+typedef struct {
+    const uint8_t* image;
+    uint32_t image_size;
+    const uint8_t* debug;   // Encoded .dbg for -g builds, NULL otherwise
+    uint32_t debug_size;
+
+    void* map;
+    size_t map_size;
+} build_cache_entry_t;
+
+/**
+ * Compute the cache key of a build: a 64-bit content hash of the tool's
+ * version, the options that affect its output, and the source text. The
+ * toolchain source hash and the entry format are mixed in, so a rebuilt
+ * tool never reads entries from another version of its code.
+ * @param tool_version: Tool name and version
+ * @param options: Options that affect the output, including the source path for -g
+ * @param options_size: Size of options in bytes
+ * @param source: Source text
+ * @param source_size: Size of the source text in bytes
+ * @return: Cache key
+ */
+uint64_t build_cache_key(const char* tool_version, const void* options, size_t options_size,
+                         const char* source, size_t source_size);
+
+/**
+ * Map the cached image for a key. Entries live in $KXN_CACHE_DIR, or
+ * kxn under $XDG_CACHE_HOME or ~/.cache; KXN_CACHE=off disables the cache,
+ * as does a build without KXN_SOURCE_HASH.
+ * @param key: Key from build_cache_key
+ * @param source_size: Size of the source, checked against the entry
+ * @param entry: Filled in on a hit; release with build_cache_release
+ * @return: true on a hit, false if there is no valid entry
+ */
+bool build_cache_lookup(uint64_t key, uint64_t source_size, build_cache_entry_t* entry);
+
+/**
+ * Unmap an entry returned by build_cache_lookup
+ * @param entry: Entry to release
+ */
+void build_cache_release(build_cache_entry_t* entry);
+
+/**
+ * Store an image and its debug info. The entry is written to a temporary
+ * file and renamed into place, so concurrent builds never see half an entry.
+ * @param key: Key from build_cache_key
+ * @param source_size: Size of the source the image was built from
+ * @param image: Program image
+ * @param image_size: Size of the image in bytes
+ * @param debug: Encoded .dbg written with the image, or NULL
+ * @param debug_size: Size of the debug info in bytes
+ * @return: true if the entry was written
+ */
+bool build_cache_store(uint64_t key, uint64_t source_size, const uint8_t* image, uint32_t image_size,
+                       const uint8_t* debug, uint32_t debug_size);
+
+#endif // BUILD_CACHE_H
@@ -4,24 +4,28 @@
 #include <ctype.h>
 #include <stdbool.h>
 #include <stdint.h>
-
-#define MAX_TOKENS 10000
-#define MAX_SYMBOLS 256
-#define MAX_CODE_LINES 10000
+#include <time.h>
+#include "vm.h"
+#include "platform_io.h"
+#include "build_cache.h"
+#include "object.h"
+#include "debug_info.h"
+
+#define TINYC_VERSION "1.0"
+// Cached images are keyed by the build too, so a rebuilt compiler never
+// reuses output from an older one
+#define TINYC_BUILD_ID "tinyc " TINYC_VERSION
+
+#define TOKEN_LOOKAHEAD 2     // Tokens buffered ahead of the parser (power of two)
+#define SYMBOL_TABLE_INITIAL 64
 #define MAX_IDENTIFIER_LEN 64
 #define MAX_LINE_LEN 1024
 
-#define SYS_EXIT        0x00
-#define SYS_PRINT_CHAR  0x01
-#define SYS_READ_CHAR   0x02
-#define SYS_DRAW_PIXEL  0x10
-#define SYS_DRAW_LINE   0x11
-#define SYS_FILL_RECT   0x12
-#define SYS_REFRESH     0x13
-#define SYS_POLL_KEY    0x20
-#define SYS_GET_KEY     0x21
 
-#define VAR_START_ADDR 0x0100
+#define VAR_START_ADDR 0x0100  // Variables are numbered from here, then placed after the code
+#define VAR_END_ADDR   0xFF00  // Leaves the top page for the stack
+#define UNROLL_DEFAULT   4     // Copies of a counted loop body per iteration
+#define UNROLL_MAX_BYTES 64    // Largest unrolled loop body in bytes
 
 // Token types
 typedef enum {
@@ -38,6 +42,7 @@ typedef enum {
 	TOKEN_MINUS,         // -
 	TOKEN_MULTIPLY,      // *
 	TOKEN_DIVIDE,        // /
+	TOKEN_MODULO,        // %
 	TOKEN_EQUALS,        // ==
 	TOKEN_NOT_EQUALS,    // !=
 	TOKEN_LESS,          // <
@@ -53,470 +58,3142 @@ typedef enum {
 	TOKEN_UNKNOWN
 } token_type_t;
 
+// Tokens refer to their text in the source buffer rather than copying it
 typedef struct {
 	token_type_t type;
-	char value[MAX_IDENTIFIER_LEN];
+	const char* start;
+	int length;
 	int line;
 	int column;
 } token_t;
 
+// Lexer state: scans one token at a time as the parser asks for it
+typedef struct {
+	const char* cursor;
+	int line;
+	int column;
+	token_t window[TOKEN_LOOKAHEAD];
+	int window_start;
+	int window_count;
+	int token_count;        // Tokens scanned so far
+} lexer_t;
+
 typedef struct {
-	char name[MAX_IDENTIFIER_LEN];
+	const char* name;       // Interned with the symbol, never moves
+	uint8_t length;         // strlen(name), checked before comparing names
+	uint32_t hash;
 	uint16_t address;
 	bool initialized;
 } symbol_t;
 
+// Open-addressing hash table of symbols (linear probing, power-of-two size)
 typedef struct {
-	token_t tokens[MAX_TOKENS];
-	int token_count;
-	int current_token;
+	symbol_t** slots;
+	int capacity;
+	int count;
+} symbol_table_t;
 
-	symbol_t symbols[MAX_SYMBOLS];
-	int symbol_count;
-	uint16_t next_var_addr;
+// Pseudo-opcode marking a label position in the IR
+#define IR_LABEL 0xFF
+#define IR_NO_LABEL -1
+
+// One IR instruction: a VM opcode with its operand, or a label definition.
+// Branches refer to their target by label id instead of address.
+typedef struct {
+	uint8_t op;
+	uint16_t operand;
+	int label;
+	int line;               // Source line, 0 if unknown
+} ir_insn_t;
+
+typedef struct {
+	ir_insn_t* insns;
+	int count;
+	int capacity;
+} ir_buffer_t;
+
+// Expression and statement trees hold the whole program; the passes below
+// lower them to SSA form and generate code from that.
+typedef enum {
+	EXPR_CONST,
+	EXPR_VAR,
+	EXPR_BINARY,
+	EXPR_CALL
+} expr_kind_t;
+
+typedef struct expr_t {
+	expr_kind_t kind;
+	uint8_t op;             // EXPR_BINARY: OP_* opcode; EXPR_CALL: I/O id
+	uint8_t value;          // EXPR_CONST
+	uint16_t address;       // EXPR_VAR
+	bool halts;             // EXPR_CALL: halt() also emits HALT
+	struct expr_t* left;    // EXPR_BINARY operands
+	struct expr_t* right;
+	struct expr_t* args;    // EXPR_CALL arguments, linked through next
+	struct expr_t* next;
+} expr_t;
+
+typedef enum {
+	STMT_EXPR,
+	STMT_STORE,
+	STMT_IF,
+	STMT_WHILE,
+	STMT_BLOCK
+} stmt_kind_t;
+
+typedef struct stmt_t {
+	stmt_kind_t kind;
+	expr_t* expr;           // Value, or condition of STMT_IF/STMT_WHILE
+	uint16_t address;       // STMT_STORE target
+	struct stmt_t* body;    // Then-branch, loop body, or first statement of a block
+	struct stmt_t* else_body;
+	struct stmt_t* next;    // Next statement in the enclosing block
+	int line;               // Source line, 0 for blocks made by the optimizer
+} stmt_t;
+
+typedef struct arena_chunk_t {
+	struct arena_chunk_t* next;
+	size_t used;
+	size_t size;
+	uint8_t data[];
+} arena_chunk_t;
+
+typedef struct {
+	arena_chunk_t* head;
+	arena_chunk_t* current;
+} arena_t;
+
+#define ARENA_CHUNK_SIZE 16384
+
+typedef struct {
+	bool emit_assembly;   // Write kxasm source instead of a binary image
+	bool emit_object;     // Write a relocatable module for kxld
+	int unroll_factor;    // Max body copies in a counted loop (1 disables unrolling)
+	int opt_level;        // 0-2, see pass_pipeline
+	bool time_passes;     // Print how long each pass took
+	bool debug_info;      // Write a .dbg line table and symbol map next to the output
+} compile_options_t;
+
+// Variables holding known constants ahead of a loop, tracked across a
+// straight run of constant stores
+#define KNOWN_VALUES 8
+
+typedef struct {
+	int count;
+	struct {
+		uint16_t address;
+		uint8_t value;
+	} vars[KNOWN_VALUES];
+} known_values_t;
+
+// SSA form: values are VM operations on earlier values, grouped into basic
+// blocks that end in a jump, a two-way branch or a halt
+#define SSA_NONE -1
+#define SSA_TERM -2           // User id of a block's branch condition
+#define SSA_OP_PHI 0xFF       // Not a VM opcode; phis are never emitted
+
+typedef struct {
+	uint8_t op;             // OP_PUSH, OP_LOAD, OP_STORE, OP_IO, SSA_OP_PHI or an arithmetic opcode
+	uint8_t imm;            // OP_PUSH constant, OP_IO id
+	uint16_t address;       // OP_LOAD/OP_STORE/SSA_OP_PHI variable
+	int nargs;
+	int* args;              // Operand value ids; a phi's are definitions, one per predecessor
+	int def;                // OP_LOAD: reaching definition (OP_STORE or phi), SSA_NONE if unknown
+	int block;              // Owning block, SSA_NONE once removed
+	int alias;              // Value this one was replaced by, or SSA_NONE
+	bool has_result;
+	int uses;               // Filled in by ssa_count_uses
+	int user;               // First user, or SSA_TERM
+	bool cross_block;       // Used outside its own block
+	uint16_t slot;          // Temporary holding a spilled result
+	int line;               // Source line of the statement it came from
+} ssa_value_t;
+
+typedef enum {
+	TERM_JUMP,
+	TERM_BRANCH,
+	TERM_HALT
+} ssa_term_t;
+
+typedef struct {
+	int* values;            // Value ids in execution order
+	int count;
+	int capacity;
+	ssa_term_t term;
+	int cond;               // TERM_BRANCH condition value
+	int succ[2];            // Jump target (SSA_NONE falls off the end), or branch targets if true / false
+	bool reachable;
+	int label;
+} ssa_block_t;
+
+// Blocks first..last form a rotated loop entered from preheader
+typedef struct {
+	int preheader;
+	int first;
+	int last;
+} ssa_loop_t;
+
+typedef struct {
+	ssa_value_t* values;
+	int value_count;
+	int value_capacity;
+	ssa_block_t* blocks;
+	int block_count;
+	int block_capacity;
+	ssa_loop_t* loops;      // Innermost loops first
+	int loop_count;
+	int loop_capacity;
+	int current;            // Block being lowered into
+} ssa_program_t;
+
+typedef struct {
+	lexer_t lexer;
 
-	char output[MAX_CODE_LINES][MAX_LINE_LEN];
-	int output_count;
+	symbol_table_t symbols;
+	arena_t symbol_arena;
+	uint16_t next_var_addr;
+	uint16_t data_base;     // Output address of VAR_START_ADDR
+	bool emit_object;
+
+	stmt_t* program;
+	arena_t expr_arena;
+	ssa_program_t ssa;
+	int opt_level;
+	bool time_passes;
+	int unroll_factor;
+
+	ir_buffer_t code;
+	int peephole_hits[32];
+	int hoisted_count;
+	int unrolled_count;
+	int phi_count;
+	int cse_count;
+	int reduced_count;
+	int dead_store_count;
+	int relaxed_count;
+	int branch_count;
 
 	int label_counter;
 	int current_line;
 } compiler_t;
 
 void error(compiler_t* comp, const char* message);
-void emit(compiler_t* comp, const char* code);
-void emit_label(compiler_t* comp, const char* label);
-char* new_label(compiler_t* comp);
+void emit(compiler_t* comp, uint8_t op, uint16_t operand);
+void emit_jump(compiler_t* comp, uint8_t op, int label);
+void emit_label(compiler_t* comp, int label);
+int new_label(compiler_t* comp);
+void write_assembly(compiler_t* comp, FILE* out);
+uint8_t* build_image(compiler_t* comp, uint32_t* size, kxo_object_t* obj);
+void optimize_peephole(compiler_t* comp);
+static void* arena_alloc(compiler_t* comp, arena_t* arena, size_t size);
+static void arena_free(arena_t* arena);
 token_t* current_token(compiler_t* comp);
 token_t* peek_token(compiler_t* comp);
 void consume_token(compiler_t* comp);
 bool match_token(compiler_t* comp, token_type_t type);
 void expect_token(compiler_t* comp, token_type_t type);
 
-bool is_keyword(const char* str, token_type_t* type);
-void tokenize(compiler_t* comp, const char* source);
+bool is_keyword(const char* str, size_t len, token_type_t* type);
+void init_lexer(compiler_t* comp, const char* source);
+
+expr_t* parse_multiplicative(compiler_t* comp);
+stmt_t* parse_statement(compiler_t* comp);
+stmt_t* parse_var_declaration(compiler_t* comp);
+stmt_t* parse_assignment(compiler_t* comp);
+stmt_t* parse_if_statement(compiler_t* comp);
+stmt_t* parse_while_statement(compiler_t* comp);
+stmt_t* parse_expression_statement(compiler_t* comp);
+expr_t* parse_expression(compiler_t* comp);
+expr_t* parse_comparison(compiler_t* comp);
+expr_t* parse_term(compiler_t* comp);
+expr_t* parse_factor(compiler_t* comp);
+expr_t* parse_function_call(compiler_t* comp, const token_t* func_name);
+
+symbol_t* find_symbol(compiler_t* comp, const char* name, size_t len);
+symbol_t* add_symbol(compiler_t* comp, const char* name, size_t len);
+
+bool is_builtin_function(const char* name, size_t len);
+int get_builtin_syscall(const char* name, size_t len);
+
+void error(compiler_t* comp, const char* message) {
+	token_t* tok = current_token(comp);
+	fprintf(stderr, "Error at line %d: %s\n", tok->line, message);
+	exit(1);
+}
+
+static ir_insn_t* ir_append_to(compiler_t* comp, ir_buffer_t* code) {
+	if (code->count == code->capacity) {
+		int capacity = code->capacity ? code->capacity * 2 : 256;
+		ir_insn_t* insns = realloc(code->insns, capacity * sizeof(ir_insn_t));
+		if (!insns) {
+			error(comp, "Out of memory for generated code");
+		}
+		code->insns = insns;
+		code->capacity = capacity;
+	}
+	return &code->insns[code->count++];
+}
+
+static ir_insn_t* ir_append(compiler_t* comp) {
+	return ir_append_to(comp, &comp->code);
+}
+
+void emit(compiler_t* comp, uint8_t op, uint16_t operand) {
+	ir_insn_t* insn = ir_append(comp);
+	insn->op = op;
+	insn->operand = operand;
+	insn->label = IR_NO_LABEL;
+	insn->line = comp->current_line;
+}
+
+void emit_jump(compiler_t* comp, uint8_t op, int label) {
+	ir_insn_t* insn = ir_append(comp);
+	insn->op = op;
+	insn->operand = 0;
+	insn->label = label;
+	insn->line = comp->current_line;
+}
+
+void emit_label(compiler_t* comp, int label) {
+	emit_jump(comp, IR_LABEL, label);
+}
+
+int new_label(compiler_t* comp) {
+	return comp->label_counter++;
+}
+
+static const char* opcode_name(uint8_t op) {
+	switch (op) {
+#define OPCODE_NAME(name, value, mnemonic, operand) case OP_##name: return mnemonic;
+		VM_OPCODES(OPCODE_NAME)
+#undef OPCODE_NAME
+		default: return NULL;
+	}
+}
+
+// Encoded size of an IR instruction in bytes
+static int insn_size(uint8_t op) {
+	switch (op) {
+		case IR_LABEL:
+			return 0;
+#define OPCODE_SIZE(name, value, mnemonic, operand) \
+		case OP_##name: return operand == VM_OPERAND_ADDR16 ? 3 : operand == VM_OPERAND_NONE ? 1 : 2;
+		VM_OPCODES(OPCODE_SIZE)
+#undef OPCODE_SIZE
+		default:
+			return 1;
+	}
+}
+
+// Variables follow the code: each one's address is its number plus data_base
+static bool place_data(compiler_t* comp) {
+	uint32_t size = 0;
+	for (int i = 0; i < comp->code.count; i++) {
+		size += insn_size(comp->code.insns[i].op);
+	}
+
+	uint32_t data_end = size + (comp->next_var_addr - VAR_START_ADDR);
+	if (comp->emit_object) {
+		// kxld places the data; operands hold offsets into it
+		comp->data_base = 0;
+		data_end = size;
+	} else {
+		comp->data_base = (uint16_t)size;
+	}
+	if (data_end > VAR_END_ADDR) {
+		fprintf(stderr, "Error: Program ends at 0x%04X, past the stack page at 0x%04X\n", data_end, VAR_END_ADDR);
+		return false;
+	}
+	return true;
+}
+
+static uint16_t var_address(const compiler_t* comp, uint16_t var) {
+	return (uint16_t)(comp->data_base + (var - VAR_START_ADDR));
+}
+
+// Print the IR as kxasm source
+void write_assembly(compiler_t* comp, FILE* out) {
+	for (int i = 0; i < comp->code.count; i++) {
+		ir_insn_t* insn = &comp->code.insns[i];
+		const char* name = opcode_name(insn->op);
+
+		if (insn->op == IR_LABEL) {
+			fprintf(out, "L%d:\n", insn->label);
+		} else if (insn->label != IR_NO_LABEL) {
+			fprintf(out, "%s L%d\n", name, insn->label);
+		} else if (insn->op == OP_PUSH) {
+			fprintf(out, "%s %d\n", name, insn->operand);
+		} else if (insn->op == OP_IO) {
+			fprintf(out, "%s 0x%02X\n", name, insn->operand);
+		} else if (insn->op == OP_LOAD || insn->op == OP_STORE) {
+			fprintf(out, "%s 0x%04X\n", name, var_address(comp, insn->operand));
+		} else {
+			fprintf(out, "%s\n", name);
+		}
+	}
+}
+
+// Resolve labels and encode the program; returns NULL on failure. With an
+// object, address operands are recorded as relocations instead.
+uint8_t* build_image(compiler_t* comp, uint32_t* image_size, kxo_object_t* obj) {
+	uint16_t* label_addr = calloc(comp->label_counter ? comp->label_counter : 1, sizeof(uint16_t));
+	if (!label_addr) {
+		fprintf(stderr, "Error: Out of memory for labels\n");
+		return NULL;
+	}
+
+	uint32_t size = 0;
+	for (int i = 0; i < comp->code.count; i++) {
+		ir_insn_t* insn = &comp->code.insns[i];
+		if (insn->op == IR_LABEL) {
+			label_addr[insn->label] = (uint16_t)size;
+		}
+		size += insn_size(insn->op);
+	}
+	uint8_t* image = malloc(size ? size : 1);
+	if (!image) {
+		fprintf(stderr, "Error: Out of memory for program image\n");
+		free(label_addr);
+		return NULL;
+	}
+
+	uint32_t pos = 0;
+	for (int i = 0; i < comp->code.count; i++) {
+		ir_insn_t* insn = &comp->code.insns[i];
+		if (insn->op == IR_LABEL) continue;
+
+		image[pos++] = insn->op;
+		uint16_t operand = insn->operand;
+		uint8_t reloc = 0;
+		if (insn->label != IR_NO_LABEL && insn_size(insn->op) == 2) {
+			// Short branches are relative and need no relocation
+			operand = (uint16_t)(label_addr[insn->label] - (pos + 1));
+		} else if (insn->label != IR_NO_LABEL) {
+			operand = label_addr[insn->label];
+			reloc = KXO_RELOC_CODE;
+		} else if (insn->op == OP_LOAD || insn->op == OP_STORE) {
+			operand = var_address(comp, insn->operand);
+			reloc = KXO_RELOC_DATA;
+		}
+		if (obj && reloc && !kxo_add_reloc(obj, (uint16_t)pos, reloc, 0)) {
+			fprintf(stderr, "Error: Out of memory for relocations\n");
+			free(label_addr);
+			free(image);
+			return NULL;
+		}
+
+		switch (insn_size(insn->op)) {
+			case 2:
+				image[pos++] = operand & 0xFF;
+				break;
+			case 3:
+				image[pos++] = operand & 0xFF;
+				image[pos++] = (operand >> 8) & 0xFF;
+				break;
+		}
+	}
+
+	free(label_addr);
+	*image_size = size;
+	return image;
+}
+
+// Encode the program as a .kxo module; its variables become local data symbols
+static uint8_t* build_object(compiler_t* comp, uint32_t* object_size) {
+	kxo_object_t obj;
+	kxo_init(&obj);
+
+	uint32_t size = 0;
+	uint8_t* code = build_image(comp, &size, &obj);
+	bool ok = code && kxo_set_code(&obj, code, (uint16_t)size);
+	free(code);
+	obj.data_size = comp->next_var_addr - VAR_START_ADDR;
+
+	for (int i = 0; ok && i < comp->symbols.capacity; i++) {
+		const symbol_t* sym = comp->symbols.slots[i];
+		if (!sym) continue;
+		ok = kxo_add_symbol(&obj, sym->name, strlen(sym->name), KXO_SECTION_DATA,
+		                    sym->address - VAR_START_ADDR, 0) >= 0;
+	}
+
+	uint8_t* encoded = ok ? kxo_encode(&obj, object_size) : NULL;
+	if (code && !encoded) {
+		fprintf(stderr, "Error: Out of memory for object file\n");
+	}
+	kxo_free(&obj);
+	return encoded;
+}
+
+// Copy a cached image, and its .dbg for -g, to the output; false if there
+// is no usable entry
+static bool write_cached_image(uint64_t key, uint64_t source_size, const char* output_file, bool debug_info) {
+	build_cache_entry_t entry;
+	if (!build_cache_lookup(key, source_size, &entry)) {
+		return false;
+	}
+
+	char debug_path[BUILD_CACHE_MAX_PATH];
+	bool ok = !debug_info || (entry.debug && kxd_path(output_file, debug_path, sizeof(debug_path)));
+	FILE* out = ok ? fopen(output_file, "wb") : NULL;
+	ok = out && fwrite(entry.image, 1, entry.image_size, out) == entry.image_size;
+	if (out && fclose(out) != 0) {
+		ok = false;
+	}
+	if (ok && debug_info) {
+		ok = kxd_write_encoded(entry.debug, entry.debug_size, debug_path);
+	}
+	if (ok) {
+		printf("Cache hit: %u bytes%s\n", entry.image_size, debug_info ? " with debug info" : "");
+	}
+	build_cache_release(&entry);
+	return ok;
+}
+
+// Write the pc-to-line table and variable map next to the image; returns
+// the encoded .dbg for the build cache, or NULL on failure
+static uint8_t* write_debug_info(compiler_t* comp, const char* input_file, const char* output_file,
+                                 const uint8_t* image, uint32_t size, uint32_t* debug_size) {
+	char path[BUILD_CACHE_MAX_PATH];
+	if (!kxd_path(output_file, path, sizeof(path))) {
+		return NULL;
+	}
+
+	kxd_info_t info;
+	kxd_init(&info);
+	kxd_set_image(&info, image, size);
+	bool ok = kxd_set_source(&info, input_file);
+
+	uint32_t pc = 0;
+	for (int i = 0; ok && i < comp->code.count; i++) {
+		const ir_insn_t* insn = &comp->code.insns[i];
+		if (insn->op == IR_LABEL) continue;
+		if (insn->line > 0) {
+			ok = kxd_add_line(&info, (uint16_t)pc, (uint32_t)insn->line);
+		}
+		pc += insn_size(insn->op);
+	}
+
+	for (int i = 0; ok && i < comp->symbols.capacity; i++) {
+		const symbol_t* sym = comp->symbols.slots[i];
+		if (!sym) continue;
+		ok = kxd_add_symbol(&info, sym->name, strlen(sym->name), var_address(comp, sym->address), KXD_SYMBOL_DATA);
+	}
+
+	uint8_t* encoded = ok ? kxd_encode(&info, debug_size) : NULL;
+	if (encoded && kxd_write_encoded(encoded, *debug_size, path)) {
+		printf("Debug info: %d line entries, %d symbols -> %s\n", info.line_count, info.symbol_count, path);
+	} else {
+		fprintf(stderr, "Error: Cannot write debug info '%s'\n", path);
+		free(encoded);
+		encoded = NULL;
+	}
+	kxd_free(&info);
+	return encoded;
+}
+
+/*
+ * Peephole optimizer
+ *
+ * Rules are matched against a window of consecutive IR instructions. Each
+ * pattern element names an opcode (or PP_ANY) and can require a specific
+ * operand, a non-zero operand, or the same operand and label as an earlier
+ * element. A match is replaced by the rule's emit list, where each entry
+ * is an opcode plus the element whose operand and label it reuses. Rules
+ * that need to look beyond the window add a "where" predicate, and the one
+ * rule that invents an operand (jump threading) supplies a rewrite hook.
+ */
+
+#define PP_ANY 0xFE
+#define PP_MAX_PASSES 8
+
+#define PP_MATCH_VALUE   0x01
+#define PP_MATCH_NONZERO 0x02
+
+typedef struct {
+	uint8_t op;
+	uint8_t flags;
+	uint16_t operand;
+	int same_as;            // 1-based index of an earlier element, 0 for none
+} pp_match_t;
+
+typedef struct {
+	uint8_t op;             // PP_ANY reuses the opcode of the source element
+	int from;               // 1-based source element for operand/label, 0 for none
+} pp_emit_t;
+
+typedef struct {
+	int* label_pos;         // Index of each label in the code being scanned
+	int* label_refs;        // Branches referring to each label
+} pp_state_t;
+
+typedef struct {
+	const char* name;
+	int match_len;
+	pp_match_t match[3];
+	bool (*where)(const pp_state_t* pp, const ir_buffer_t* code, int at);
+	int emit_len;
+	pp_emit_t emit[2];
+	void (*rewrite)(compiler_t* comp, const pp_state_t* pp, const ir_buffer_t* code, int at, ir_buffer_t* out);
+} pp_rule_t;
+
+#define M(op)          { op, 0, 0, 0 }
+#define M_IMM(op, v)   { op, PP_MATCH_VALUE, v, 0 }
+#define M_NONZERO(op)  { op, PP_MATCH_NONZERO, 0, 0 }
+#define M_SAME(op, k)  { op, 0, 0, (k) + 1 }
+#define E(op, k)       { op, (k) + 1 }
+#define E_OP(op)       { op, 0 }
+
+static bool is_branch(uint8_t op) {
+	return op == OP_JMP || op == OP_JZ || op == OP_JNZ;
+}
+
+// First real instruction at or after index, skipping labels
+static int skip_labels(const ir_buffer_t* code, int index) {
+	while (index < code->count && code->insns[index].op == IR_LABEL) {
+		index++;
+	}
+	return index;
+}
+
+static bool pp_jumps_to_next(const pp_state_t* pp, const ir_buffer_t* code, int at) {
+	(void)pp;
+	for (int i = at + 1; i < code->count && code->insns[i].op == IR_LABEL; i++) {
+		if (code->insns[i].label == code->insns[at].label) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool pp_targets_jump(const pp_state_t* pp, const ir_buffer_t* code, int at) {
+	const ir_insn_t* insn = &code->insns[at];
+	if (!is_branch(insn->op)) return false;
+
+	int target = skip_labels(code, pp->label_pos[insn->label]);
+	return target < code->count && code->insns[target].op == OP_JMP &&
+		code->insns[target].label != insn->label;
+}
+
+static void pp_thread_jump(compiler_t* comp, const pp_state_t* pp, const ir_buffer_t* code, int at, ir_buffer_t* out) {
+	ir_insn_t* insn = ir_append_to(comp, out);
+	*insn = code->insns[at];
+	insn->label = code->insns[skip_labels(code, pp->label_pos[insn->label])].label;
+}
+
+static bool pp_unreachable(const pp_state_t* pp, const ir_buffer_t* code, int at) {
+	(void)pp;
+	uint8_t op = code->insns[at].op;
+	return (op == OP_JMP || op == OP_HALT) && code->insns[at + 1].op != IR_LABEL;
+}
+
+static bool pp_unused_label(const pp_state_t* pp, const ir_buffer_t* code, int at) {
+	return pp->label_refs[code->insns[at].label] == 0;
+}
+
+static const pp_rule_t peephole_rules[] = {
+	// STORE a; LOAD a -> DUP; STORE a
+	{ "store-load-to-dup", 2, { M(OP_STORE), M_SAME(OP_LOAD, 0) }, NULL,
+	  2, { E_OP(OP_DUP), E(OP_STORE, 0) }, NULL },
+	// Values computed only to be discarded
+	{ "push-pop", 2, { M(OP_PUSH), M(OP_POP) }, NULL, 0, { E_OP(0) }, NULL },
+	{ "load-pop", 2, { M(OP_LOAD), M(OP_POP) }, NULL, 0, { E_OP(0) }, NULL },
+	{ "dup-pop", 2, { M(OP_DUP), M(OP_POP) }, NULL, 0, { E_OP(0) }, NULL },
+	// Comparisons against zero folded into the branch
+	{ "eq0-jz-to-jnz", 3, { M_IMM(OP_PUSH, 0), M(OP_EQ), M(OP_JZ) }, NULL,
+	  1, { E(OP_JNZ, 2) }, NULL },
+	{ "eq0-jnz-to-jz", 3, { M_IMM(OP_PUSH, 0), M(OP_EQ), M(OP_JNZ) }, NULL,
+	  1, { E(OP_JZ, 2) }, NULL },
+	{ "neq0-jz", 3, { M_IMM(OP_PUSH, 0), M(OP_NEQ), M(OP_JZ) }, NULL,
+	  1, { E(OP_JZ, 2) }, NULL },
+	{ "neq0-jnz", 3, { M_IMM(OP_PUSH, 0), M(OP_NEQ), M(OP_JNZ) }, NULL,
+	  1, { E(OP_JNZ, 2) }, NULL },
+	// Branches on constants
+	{ "const-jz-taken", 2, { M_IMM(OP_PUSH, 0), M(OP_JZ) }, NULL, 1, { E(OP_JMP, 1) }, NULL },
+	{ "const-jz-not-taken", 2, { M_NONZERO(OP_PUSH), M(OP_JZ) }, NULL, 0, { E_OP(0) }, NULL },
+	{ "const-jnz-taken", 2, { M_NONZERO(OP_PUSH), M(OP_JNZ) }, NULL, 1, { E(OP_JMP, 1) }, NULL },
+	{ "const-jnz-not-taken", 2, { M_IMM(OP_PUSH, 0), M(OP_JNZ) }, NULL, 0, { E_OP(0) }, NULL },
+	// JZ a; JMP b; a: -> JNZ b; a:
+	{ "invert-branch", 3, { M(OP_JZ), M(OP_JMP), M_SAME(IR_LABEL, 0) }, NULL,
+	  2, { E(OP_JNZ, 1), E(IR_LABEL, 2) }, NULL },
+	{ "invert-branch", 3, { M(OP_JNZ), M(OP_JMP), M_SAME(IR_LABEL, 0) }, NULL,
+	  2, { E(OP_JZ, 1), E(IR_LABEL, 2) }, NULL },
+	// Control flow cleanup
+	{ "jump-to-next", 1, { M(OP_JMP) }, pp_jumps_to_next, 0, { E_OP(0) }, NULL },
+	{ "thread-jump", 1, { M(PP_ANY) }, pp_targets_jump, 0, { E_OP(0) }, pp_thread_jump },
+	{ "unreachable-code", 2, { M(PP_ANY), M(PP_ANY) }, pp_unreachable, 1, { E(PP_ANY, 0) }, NULL },
+	{ "unused-label", 1, { M(IR_LABEL) }, pp_unused_label, 0, { E_OP(0) }, NULL },
+};
+
+#define PEEPHOLE_RULE_COUNT ((int)(sizeof(peephole_rules) / sizeof(peephole_rules[0])))
+
+static bool pp_matches(const pp_rule_t* rule, const pp_state_t* pp, const ir_buffer_t* code, int at) {
+	if (at + rule->match_len > code->count) return false;
+
+	for (int k = 0; k < rule->match_len; k++) {
+		const pp_match_t* m = &rule->match[k];
+		const ir_insn_t* insn = &code->insns[at + k];
+
+		if (m->op != PP_ANY && insn->op != m->op) return false;
+		if ((m->flags & PP_MATCH_VALUE) && (insn->label != IR_NO_LABEL || insn->operand != m->operand)) return false;
+		if ((m->flags & PP_MATCH_NONZERO) && (insn->label != IR_NO_LABEL || insn->operand == 0)) return false;
+		if (m->same_as) {
+			const ir_insn_t* other = &code->insns[at + m->same_as - 1];
+			if (insn->operand != other->operand || insn->label != other->label) return false;
+		}
+	}
+	return !rule->where || rule->where(pp, code, at);
+}
+
+// Rewrite the IR until no rule applies, counting how often each rule fires
+void optimize_peephole(compiler_t* comp) {
+	int labels = comp->label_counter ? comp->label_counter : 1;
+	pp_state_t pp;
+	pp.label_pos = malloc(labels * sizeof(int));
+	pp.label_refs = malloc(labels * sizeof(int));
+	if (!pp.label_pos || !pp.label_refs) {
+		error(comp, "Out of memory in peephole optimizer");
+	}
+
+	for (int pass = 0; pass < PP_MAX_PASSES; pass++) {
+		ir_buffer_t* code = &comp->code;
+		memset(pp.label_refs, 0, labels * sizeof(int));
+		for (int i = 0; i < code->count; i++) {
+			const ir_insn_t* insn = &code->insns[i];
+			if (insn->op == IR_LABEL) {
+				pp.label_pos[insn->label] = i;
+			} else if (insn->label != IR_NO_LABEL) {
+				pp.label_refs[insn->label]++;
+			}
+		}
+
+		ir_buffer_t out = {0};
+		bool changed = false;
+		int i = 0;
+		while (i < code->count) {
+			int r;
+			for (r = 0; r < PEEPHOLE_RULE_COUNT; r++) {
+				if (pp_matches(&peephole_rules[r], &pp, code, i)) break;
+			}
+
+			if (r == PEEPHOLE_RULE_COUNT) {
+				*ir_append_to(comp, &out) = code->insns[i++];
+				continue;
+			}
+
+			const pp_rule_t* rule = &peephole_rules[r];
+			if (rule->rewrite) {
+				rule->rewrite(comp, &pp, code, i, &out);
+			} else {
+				for (int k = 0; k < rule->emit_len; k++) {
+					const pp_emit_t* e = &rule->emit[k];
+					ir_insn_t* insn = ir_append_to(comp, &out);
+					if (e->from) {
+						*insn = code->insns[i + e->from - 1];
+					} else {
+						insn->operand = 0;
+						insn->label = IR_NO_LABEL;
+						insn->line = code->insns[i].line;
+					}
+					if (e->op != PP_ANY) {
+						insn->op = e->op;
+					}
+				}
+			}
+			comp->peephole_hits[r]++;
+			i += rule->match_len;
+			changed = true;
+		}
+
+		free(code->insns);
+		*code = out;
+		if (!changed) break;
+	}
+
+	free(pp.label_pos);
+	free(pp.label_refs);
+}
+
+static bool is_long_branch(uint8_t op) {
+	return op == OP_JMP || op == OP_JZ || op == OP_JNZ || op == OP_CALL;
+}
+
+/*
+ * Branch relaxation: every branch starts in its 2-byte relative form, and
+ * any whose target is out of reach once the code is laid out goes back to
+ * the 3-byte absolute form. Lengthening a branch only moves code apart, so
+ * the loop ends after a few sweeps.
+ */
+static void pass_relax(compiler_t* comp) {
+	ir_buffer_t* code = &comp->code;
+	uint32_t* label_addr = calloc(comp->label_counter ? comp->label_counter : 1, sizeof(uint32_t));
+	if (!label_addr) {
+		error(comp, "Out of memory in branch relaxation");
+	}
+
+	for (int i = 0; i < code->count; i++) {
+		ir_insn_t* insn = &code->insns[i];
+		if (insn->label != IR_NO_LABEL && is_long_branch(insn->op)) {
+			insn->op += VM_SHORT_BRANCH_DELTA;
+			comp->branch_count++;
+		}
+	}
+
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		uint32_t addr = 0;
+		for (int i = 0; i < code->count; i++) {
+			if (code->insns[i].op == IR_LABEL) {
+				label_addr[code->insns[i].label] = addr;
+			}
+			addr += insn_size(code->insns[i].op);
+		}
+
+		addr = 0;
+		for (int i = 0; i < code->count; i++) {
+			ir_insn_t* insn = &code->insns[i];
+			addr += insn_size(insn->op);
+			if (insn->op == IR_LABEL || insn->label == IR_NO_LABEL || insn_size(insn->op) != 2) continue;
+
+			int32_t offset = (int32_t)label_addr[insn->label] - (int32_t)addr;
+			if (offset < VM_SHORT_BRANCH_MIN || offset > VM_SHORT_BRANCH_MAX) {
+				insn->op -= VM_SHORT_BRANCH_DELTA;
+				changed = true;
+			}
+		}
+	}
+
+	for (int i = 0; i < code->count; i++) {
+		const ir_insn_t* insn = &code->insns[i];
+		if (insn->label != IR_NO_LABEL && insn->op != IR_LABEL && insn_size(insn->op) == 2) {
+			comp->relaxed_count++;
+		}
+	}
+	free(label_addr);
+}
+
+static void print_peephole_stats(compiler_t* comp) {
+	for (int r = 0; r < PEEPHOLE_RULE_COUNT; r++) {
+		if (comp->peephole_hits[r] > 0) {
+			printf("  %-20s %d\n", peephole_rules[r].name, comp->peephole_hits[r]);
+		}
+	}
+}
+
+/*
+ * Keywords and builtin functions share one perfect hash table. The hash
+ * only looks at the length and the first and last characters; the slot
+ * numbers below were chosen so that no two reserved words collide, so a
+ * lookup is one hash, one length check and one memcmp.
+ */
+#define RESERVED_HASH_SIZE 32
+#define RESERVED_MIN_LEN 2
+#define RESERVED_MAX_LEN 10
+
+typedef struct {
+	const char* name;
+	size_t length;
+	token_type_t type;      // TOKEN_IDENTIFIER for builtin functions
+	int syscall;            // IO_* id for builtins, -1 for keywords
+} reserved_word_t;
+
+static const reserved_word_t reserved_words[RESERVED_HASH_SIZE] = {
+	[9]  = { "var",         3, TOKEN_VAR,        -1 },
+	[27] = { "if",          2, TOKEN_IF,         -1 },
+	[17] = { "else",        4, TOKEN_ELSE,       -1 },
+	[4]  = { "while",       5, TOKEN_WHILE,      -1 },
+	[8]  = { "return",      6, TOKEN_RETURN,     -1 },
+	[14] = { "draw_pixel", 10, TOKEN_IDENTIFIER, IO_DRAW_PIXEL },
+	[21] = { "draw_line",   9, TOKEN_IDENTIFIER, IO_DRAW_LINE },
+	[15] = { "fill_rect",   9, TOKEN_IDENTIFIER, IO_FILL_RECT },
+	[25] = { "refresh",     7, TOKEN_IDENTIFIER, IO_REFRESH },
+	[10] = { "print_char", 10, TOKEN_IDENTIFIER, IO_PRINT_CHAR },
+	[11] = { "read_char",   9, TOKEN_IDENTIFIER, IO_READ_CHAR },
+	[12] = { "halt",        4, TOKEN_IDENTIFIER, IO_EXIT },
+};
+
+static const reserved_word_t* find_reserved(const char* str, size_t len) {
+	if (len < RESERVED_MIN_LEN || len > RESERVED_MAX_LEN) return NULL;
+
+	unsigned hash = (unsigned)len + (unsigned char)str[0] + 8u * (unsigned char)str[len - 1];
+	const reserved_word_t* word = &reserved_words[hash & (RESERVED_HASH_SIZE - 1)];
+	if (word->name && word->length == len && memcmp(word->name, str, len) == 0) {
+		return word;
+	}
+	return NULL;
+}
+
+bool is_keyword(const char* str, size_t len, token_type_t* type) {
+	const reserved_word_t* word = find_reserved(str, len);
+	if (!word || word->syscall >= 0) return false;
+	*type = word->type;
+	return true;
+}
+
+void init_lexer(compiler_t* comp, const char* source) {
+	lexer_t* lex = &comp->lexer;
+	lex->cursor = source;
+	lex->line = 1;
+	lex->column = 1;
+	lex->window_start = 0;
+	lex->window_count = 0;
+	lex->token_count = 0;
+}
+
+// Scan the token at the cursor; at the end of the source this keeps
+// returning TOKEN_EOF
+static void lex_token(lexer_t* lex, token_t* token) {
+	const char* p = lex->cursor;
+
+	for (;;) {
+		while (isspace((unsigned char)*p)) {
+			if (*p == '\n') {
+				lex->line++;
+				lex->column = 1;
+			} else {
+				lex->column++;
+			}
+			p++;
+		}
+
+		if (p[0] == '/' && p[1] == '/') {
+			while (*p && *p != '\n') p++;
+			continue;
+		}
+		break;
+	}
+
+	token->start = p;
+	token->line = lex->line;
+	token->column = lex->column;
+
+	if (!*p) {
+		token->type = TOKEN_EOF;
+	}
+	else if (isdigit((unsigned char)*p)) {
+		while (isdigit((unsigned char)*p)) p++;
+		token->type = TOKEN_NUMBER;
+	}
+	else if (isalpha((unsigned char)*p) || *p == '_') {
+		while (isalnum((unsigned char)*p) || *p == '_') p++;
+		if (!is_keyword(token->start, (size_t)(p - token->start), &token->type)) {
+			token->type = TOKEN_IDENTIFIER;
+		}
+	}
+	else if (p[1] == '=' && (*p == '=' || *p == '!' || *p == '<' || *p == '>')) {
+		switch (*p) {
+			case '=': token->type = TOKEN_EQUALS; break;
+			case '!': token->type = TOKEN_NOT_EQUALS; break;
+			case '<': token->type = TOKEN_LESS_EQUAL; break;
+			default:  token->type = TOKEN_GREATER_EQUAL; break;
+		}
+		p += 2;
+	}
+	else {
+		switch (*p) {
+			case '=': token->type = TOKEN_ASSIGN; break;
+			case '+': token->type = TOKEN_PLUS; break;
+			case '-': token->type = TOKEN_MINUS; break;
+			case '*': token->type = TOKEN_MULTIPLY; break;
+			case '/': token->type = TOKEN_DIVIDE; break;
+			case '%': token->type = TOKEN_MODULO; break;
+			case '<': token->type = TOKEN_LESS; break;
+			case '>': token->type = TOKEN_GREATER; break;
+			case ';': token->type = TOKEN_SEMICOLON; break;
+			case ',': token->type = TOKEN_COMMA; break;
+			case '(': token->type = TOKEN_LPAREN; break;
+			case ')': token->type = TOKEN_RPAREN; break;
+			case '{': token->type = TOKEN_LBRACE; break;
+			case '}': token->type = TOKEN_RBRACE; break;
+			default: token->type = TOKEN_UNKNOWN; break;
+		}
+		p++;
+	}
+
+	token->length = (int)(p - token->start);
+	lex->column += token->length;
+	lex->cursor = p;
+	if (token->type != TOKEN_EOF) {
+		lex->token_count++;
+	}
+}
+
+// Token `ahead` positions past the current one, scanning as needed
+static token_t* lookahead_token(compiler_t* comp, int ahead) {
+	lexer_t* lex = &comp->lexer;
+	while (lex->window_count <= ahead) {
+		int slot = (lex->window_start + lex->window_count) & (TOKEN_LOOKAHEAD - 1);
+		lex_token(lex, &lex->window[slot]);
+		lex->window_count++;
+	}
+	return &lex->window[(lex->window_start + ahead) & (TOKEN_LOOKAHEAD - 1)];
+}
+
+token_t* current_token(compiler_t* comp) {
+	return lookahead_token(comp, 0);
+}
+
+token_t* peek_token(compiler_t* comp) {
+	return lookahead_token(comp, 1);
+}
+
+void consume_token(compiler_t* comp) {
+	lexer_t* lex = &comp->lexer;
+	if (lookahead_token(comp, 0)->type == TOKEN_EOF) return;
+	lex->window_start = (lex->window_start + 1) & (TOKEN_LOOKAHEAD - 1);
+	lex->window_count--;
+}
+
+bool match_token(compiler_t* comp, token_type_t type) {
+	if (current_token(comp)->type == type) {
+		consume_token(comp);
+		return true;
+	}
+	return false;
+}
+
+void expect_token(compiler_t* comp, token_type_t type) {
+	if (current_token(comp)->type != type) {
+		char error_msg[MAX_LINE_LEN];
+		snprintf(error_msg, sizeof(error_msg), "Expected token type %d, got %d", type, current_token(comp)->type);
+		error(comp, error_msg);
+	}
+	consume_token(comp);
+}
+
+// FNV-1a
+static uint32_t hash_name(const char* name, size_t len) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static symbol_t** symbol_slot(symbol_table_t* table, const char* name, size_t len, uint32_t hash) {
+	uint32_t mask = (uint32_t)table->capacity - 1;
+	uint32_t index = hash & mask;
+	while (table->slots[index]) {
+		symbol_t* sym = table->slots[index];
+		if (sym->hash == hash && sym->length == len && memcmp(sym->name, name, len) == 0) {
+			break;
+		}
+		index = (index + 1) & mask;
+	}
+	return &table->slots[index];
+}
+
+static void grow_symbol_table(compiler_t* comp) {
+	symbol_table_t* table = &comp->symbols;
+	int capacity = table->capacity ? table->capacity * 2 : SYMBOL_TABLE_INITIAL;
+	symbol_t** slots = calloc(capacity, sizeof(symbol_t*));
+	if (!slots) {
+		error(comp, "Out of memory for symbols");
+	}
+
+	symbol_table_t grown = { slots, capacity, table->count };
+	for (int i = 0; i < table->capacity; i++) {
+		symbol_t* sym = table->slots[i];
+		if (sym) {
+			*symbol_slot(&grown, sym->name, sym->length, sym->hash) = sym;
+		}
+	}
+
+	free(table->slots);
+	*table = grown;
+}
+
+symbol_t* find_symbol(compiler_t* comp, const char* name, size_t len) {
+	if (comp->symbols.count == 0) return NULL;
+	return *symbol_slot(&comp->symbols, name, len, hash_name(name, len));
+}
+
+symbol_t* add_symbol(compiler_t* comp, const char* name, size_t len) {
+	if (len >= MAX_IDENTIFIER_LEN) {
+		error(comp, "Variable name too long");
+	}
+
+	if (comp->next_var_addr >= VAR_END_ADDR) {
+		error(comp, "Out of variable memory");
+	}
+
+	// Keep the load factor below 3/4
+	symbol_table_t* table = &comp->symbols;
+	if ((table->count + 1) * 4 > table->capacity * 3) {
+		grow_symbol_table(comp);
+	}
+
+	uint32_t hash = hash_name(name, len);
+	symbol_t** slot = symbol_slot(table, name, len, hash);
+
+	// The symbol and its name live in one arena block for the whole compile
+	symbol_t* sym = arena_alloc(comp, &comp->symbol_arena, sizeof(symbol_t) + len + 1);
+	char* interned = (char*)(sym + 1);
+	memcpy(interned, name, len);
+	interned[len] = '\0';
+	sym->name = interned;
+	sym->length = (uint8_t)len;
+	sym->hash = hash;
+	sym->address = comp->next_var_addr++;
+	sym->initialized = false;
+
+	*slot = sym;
+	table->count++;
+	return sym;
+}
+
+static void free_symbols(compiler_t* comp) {
+	free(comp->symbols.slots);
+	arena_free(&comp->symbol_arena);
+}
+
+bool is_builtin_function(const char* name, size_t len) {
+	const reserved_word_t* word = find_reserved(name, len);
+	return word && word->syscall >= 0;
+}
+
+int get_builtin_syscall(const char* name, size_t len) {
+	const reserved_word_t* word = find_reserved(name, len);
+	return word ? word->syscall : -1;
+}
+
+void parse_program(compiler_t* comp) {
+	stmt_t** tail = &comp->program;
+	while (current_token(comp)->type != TOKEN_EOF) {
+		stmt_t* stmt = parse_statement(comp);
+		if (stmt) {
+			*tail = stmt;
+			tail = &stmt->next;
+		}
+	}
+}
+
+static stmt_t* new_stmt(compiler_t* comp, stmt_kind_t kind) {
+	stmt_t* stmt = arena_alloc(comp, &comp->expr_arena, sizeof(stmt_t));
+	memset(stmt, 0, sizeof(stmt_t));
+	stmt->kind = kind;
+	return stmt;
+}
+
+static stmt_t* parse_statement_kind(compiler_t* comp) {
+	token_t* tok = current_token(comp);
+
+	switch (tok->type) {
+		case TOKEN_VAR:
+			return parse_var_declaration(comp);
+		case TOKEN_IF:
+			return parse_if_statement(comp);
+		case TOKEN_WHILE:
+			return parse_while_statement(comp);
+		case TOKEN_IDENTIFIER:
+			if (peek_token(comp)->type == TOKEN_ASSIGN) {
+				return parse_assignment(comp);
+			}
+			return parse_expression_statement(comp);
+		case TOKEN_LBRACE: {
+			consume_token(comp); 
+			stmt_t* block = new_stmt(comp, STMT_BLOCK);
+			stmt_t** tail = &block->body;
+			while (current_token(comp)->type != TOKEN_RBRACE && 
+				current_token(comp)->type != TOKEN_EOF) {
+				stmt_t* stmt = parse_statement(comp);
+				if (stmt) {
+					*tail = stmt;
+					tail = &stmt->next;
+				}
+			}
+			expect_token(comp, TOKEN_RBRACE);
+			return block;
+		}
+		default:
+			return parse_expression_statement(comp);
+	}
+}
+
+// Returns NULL for statements that generate no code
+stmt_t* parse_statement(compiler_t* comp) {
+	int line = current_token(comp)->line;
+	stmt_t* stmt = parse_statement_kind(comp);
+	if (stmt) {
+		stmt->line = line;
+	}
+	return stmt;
+}
+
+stmt_t* parse_var_declaration(compiler_t* comp) {
+	expect_token(comp, TOKEN_VAR);
+
+	if (current_token(comp)->type != TOKEN_IDENTIFIER) {
+		error(comp, "Expected variable name");
+	}
+
+	token_t name = *current_token(comp);
+	consume_token(comp);
+
+	symbol_t* sym = find_symbol(comp, name.start, name.length);
+	if (sym) {
+		error(comp, "Variable already declared");
+	}
+
+	sym = add_symbol(comp, name.start, name.length);
+
+	stmt_t* stmt = NULL;
+	if (match_token(comp, TOKEN_ASSIGN)) {
+		stmt = new_stmt(comp, STMT_STORE);
+		stmt->expr = parse_expression(comp);
+		stmt->address = sym->address;
+		sym->initialized = true;
+	}
+
+	expect_token(comp, TOKEN_SEMICOLON);
+	return stmt;
+}
+
+stmt_t* parse_assignment(compiler_t* comp) {
+	if (current_token(comp)->type != TOKEN_IDENTIFIER) {
+		error(comp, "Expected variable name");
+	}
+
+	token_t name = *current_token(comp);
+	consume_token(comp);
+
+	symbol_t* sym = find_symbol(comp, name.start, name.length);
+	if (!sym) {
+		error(comp, "Undefined variable");
+	}
+
+	expect_token(comp, TOKEN_ASSIGN);
+	stmt_t* stmt = new_stmt(comp, STMT_STORE);
+	stmt->expr = parse_expression(comp);
+	stmt->address = sym->address;
+	sym->initialized = true;
+
+	expect_token(comp, TOKEN_SEMICOLON);
+	return stmt;
+}
+
+stmt_t* parse_if_statement(compiler_t* comp) {
+	expect_token(comp, TOKEN_IF);
+	expect_token(comp, TOKEN_LPAREN);
+
+	stmt_t* stmt = new_stmt(comp, STMT_IF);
+	stmt->expr = parse_expression(comp);
+
+	expect_token(comp, TOKEN_RPAREN);
+
+	stmt->body = parse_statement(comp);
+
+	if (current_token(comp)->type == TOKEN_ELSE) {
+		consume_token(comp);
+		stmt->else_body = parse_statement(comp);
+	}
+	return stmt;
+}
+
+stmt_t* parse_while_statement(compiler_t* comp) {
+	expect_token(comp, TOKEN_WHILE);
+	expect_token(comp, TOKEN_LPAREN);
+
+	stmt_t* stmt = new_stmt(comp, STMT_WHILE);
+	stmt->expr = parse_expression(comp);
+
+	expect_token(comp, TOKEN_RPAREN);
+
+	stmt->body = parse_statement(comp);
+	return stmt;
+}
+
+stmt_t* parse_expression_statement(compiler_t* comp) {
+	stmt_t* stmt = NULL;
+	if (current_token(comp)->type != TOKEN_SEMICOLON) {
+		stmt = new_stmt(comp, STMT_EXPR);
+		stmt->expr = parse_expression(comp);
+	}
+	expect_token(comp, TOKEN_SEMICOLON);
+	return stmt;
+}
+
+static void* arena_alloc(compiler_t* comp, arena_t* arena, size_t size) {
+	size = (size + 7) & ~(size_t)7;
+
+	while (arena->current && arena->current->used + size > arena->current->size) {
+		arena->current = arena->current->next;
+		if (arena->current) {
+			arena->current->used = 0;
+		}
+	}
+
+	if (!arena->current) {
+		size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+		arena_chunk_t* chunk = malloc(sizeof(arena_chunk_t) + chunk_size);
+		if (!chunk) {
+			error(comp, "Out of memory");
+		}
+		chunk->used = 0;
+		chunk->size = chunk_size;
+		chunk->next = NULL;
+
+		// Keep every chunk on the list so a reset can reuse it
+		arena_chunk_t** link = &arena->head;
+		while (*link) link = &(*link)->next;
+		*link = chunk;
+		arena->current = chunk;
+	}
+
+	void* ptr = arena->current->data + arena->current->used;
+	arena->current->used += size;
+	return ptr;
+}
+
+static void arena_free(arena_t* arena) {
+	arena_chunk_t* chunk = arena->head;
+	while (chunk) {
+		arena_chunk_t* next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	arena->head = NULL;
+	arena->current = NULL;
+}
+
+static expr_t* new_expr(compiler_t* comp, expr_kind_t kind) {
+	expr_t* expr = arena_alloc(comp, &comp->expr_arena, sizeof(expr_t));
+	memset(expr, 0, sizeof(expr_t));
+	expr->kind = kind;
+	return expr;
+}
+
+static expr_t* make_const(compiler_t* comp, uint8_t value) {
+	expr_t* expr = new_expr(comp, EXPR_CONST);
+	expr->value = value;
+	return expr;
+}
+
+static expr_t* make_binary(compiler_t* comp, uint8_t op, expr_t* left, expr_t* right) {
+	expr_t* expr = new_expr(comp, EXPR_BINARY);
+	expr->op = op;
+	expr->left = left;
+	expr->right = right;
+	return expr;
+}
+
+// Evaluate op on two bytes exactly as run_vm does. Returns false when the
+// operation must be left to run time (division by zero is a VM error).
+static bool fold_binary(uint8_t op, uint8_t a, uint8_t b, uint8_t* result) {
+	switch (op) {
+		case OP_ADD: *result = (uint8_t)(a + b); return true;
+		case OP_SUB: *result = (uint8_t)(a - b); return true;
+		case OP_MUL: *result = (uint8_t)(a * b); return true;
+		case OP_DIV:
+			if (b == 0) return false;
+			*result = a / b;
+			return true;
+		case OP_MOD:
+			if (b == 0) return false;
+			*result = a % b;
+			return true;
+		case OP_AND: *result = a & b; return true;
+		case OP_OR:  *result = a | b; return true;
+		case OP_XOR: *result = a ^ b; return true;
+		case OP_SHL: *result = b >= 8 ? 0 : (uint8_t)(a << b); return true;
+		case OP_SHR: *result = b >= 8 ? 0 : (uint8_t)(a >> b); return true;
+		case OP_EQ:  *result = a == b; return true;
+		case OP_NEQ: *result = a != b; return true;
+		case OP_GT:  *result = a > b; return true;
+		case OP_LT:  *result = a < b; return true;
+		case OP_GTE: *result = a >= b; return true;
+		case OP_LTE: *result = a <= b; return true;
+		default: return false;
+	}
+}
+
+static bool is_commutative(uint8_t op) {
+	return op == OP_ADD || op == OP_MUL || op == OP_AND || op == OP_OR ||
+		op == OP_XOR || op == OP_EQ || op == OP_NEQ;
+}
+
+// log2 of c if it is a power of two, otherwise -1
+static int log2_exact(uint8_t c) {
+	for (int k = 0; k < 8; k++) {
+		if (c == (1u << k)) return k;
+	}
+	return -1;
+}
+
+static uint16_t alloc_temp(compiler_t* comp) {
+	if (comp->next_var_addr >= VAR_END_ADDR) {
+		error(comp, "Out of variable memory");
+	}
+	return comp->next_var_addr++;
+}
+
+// Make room for one more element in a doubling array
+static void* grow_array(compiler_t* comp, void* items, int count, int* capacity, size_t size) {
+	if (count < *capacity) return items;
+
+	int grown = *capacity ? *capacity * 2 : 16;
+	void* resized = realloc(items, grown * size);
+	if (!resized) {
+		error(comp, "Out of memory");
+	}
+	*capacity = grown;
+	return resized;
+}
+
+/*
+ * Loop unrolling (statement tree pass)
+ *
+ * A while loop has a compile-time trip count when the statements just
+ * before it store a constant to v, its condition compares v with a
+ * constant, and its body changes v only through one top-level
+ * "v = v + c" or "v = v - c". The trip count is found by running the
+ * counter in 8 bits. Loops that never run are dropped. Counted loops
+ * without nested loops are rewritten into peeled copies of the body
+ * followed by a loop over up to unroll_factor copies; the SSA passes
+ * later fold the copies' counter updates and the loop guard.
+ */
+
+static void set_known_value(known_values_t* known, uint16_t address, const expr_t* value) {
+	int i = 0;
+	while (i < known->count && known->vars[i].address != address) i++;
+	if (i < known->count) {
+		known->vars[i] = known->vars[--known->count];
+	}
+
+	if (value->kind != EXPR_CONST) return;
+	if (known->count == KNOWN_VALUES) {
+		memmove(&known->vars[0], &known->vars[1], (KNOWN_VALUES - 1) * sizeof(known->vars[0]));
+		known->count--;
+	}
+	known->vars[known->count].address = address;
+	known->vars[known->count].value = value->value;
+	known->count++;
+}
+
+static bool get_known_value(const known_values_t* known, uint16_t address, uint8_t* value) {
+	for (int i = 0; i < known->count; i++) {
+		if (known->vars[i].address == address) {
+			*value = known->vars[i].value;
+			return true;
+		}
+	}
+	return false;
+}
+
+static int count_stores(const stmt_t* stmt, uint16_t address) {
+	int count = 0;
+	for (; stmt; stmt = stmt->next) {
+		if (stmt->kind == STMT_STORE && stmt->address == address) {
+			count++;
+		}
+		count += count_stores(stmt->body, address);
+		count += count_stores(stmt->else_body, address);
+	}
+	return count;
+}
+
+static bool has_loop(const stmt_t* stmt) {
+	for (; stmt; stmt = stmt->next) {
+		if (stmt->kind == STMT_WHILE || has_loop(stmt->body) || has_loop(stmt->else_body)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Step c of a top-level "v = v + c" or "v = v - c" in the loop body
+static bool find_step(const stmt_t* body, uint16_t address, uint8_t* step) {
+	const stmt_t* stmt = body->kind == STMT_BLOCK ? body->body : body;
+	for (; stmt; stmt = stmt->next) {
+		const expr_t* value = stmt->expr;
+		if (stmt->kind != STMT_STORE || stmt->address != address || value->kind != EXPR_BINARY) {
+			continue;
+		}
+
+		const expr_t* left = value->left;
+		const expr_t* right = value->right;
+		if (value->op == OP_ADD && left->kind == EXPR_CONST) {
+			left = value->right;
+			right = value->left;
+		}
+		if ((value->op == OP_ADD || value->op == OP_SUB) &&
+			left->kind == EXPR_VAR && left->address == address && right->kind == EXPR_CONST) {
+			*step = value->op == OP_ADD ? right->value : (uint8_t)-right->value;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Number of iterations of a counted loop, or -1 if it is not known
+static int loop_trip_count(const stmt_t* loop, const known_values_t* entry) {
+	const expr_t* cond = loop->expr;
+	if (!loop->body || cond->kind != EXPR_BINARY) return -1;
+
+	bool var_left = cond->left->kind == EXPR_VAR && cond->right->kind == EXPR_CONST;
+	bool var_right = cond->right->kind == EXPR_VAR && cond->left->kind == EXPR_CONST;
+	if (!var_left && !var_right) return -1;
+
+	uint16_t address = var_left ? cond->left->address : cond->right->address;
+	uint8_t v;
+	uint8_t step;
+	if (!get_known_value(entry, address, &v) ||
+		count_stores(loop->body, address) != 1 || !find_step(loop->body, address, &step)) {
+		return -1;
+	}
+
+	// Run the counter in 8 bits; a loop that outlasts every value never ends
+	uint8_t limit = var_left ? cond->right->value : cond->left->value;
+	for (int trips = 0; trips <= 256; trips++) {
+		uint8_t taken;
+		if (!fold_binary(cond->op, var_left ? v : limit, var_left ? limit : v, &taken)) return -1;
+		if (!taken) return trips;
+		v = (uint8_t)(v + step);
+	}
+	return -1;
+}
+
+// Rough encoded size of the code for a statement or expression
+static int expr_cost(const expr_t* expr) {
+	switch (expr->kind) {
+		case EXPR_CONST:
+			return 2;
+		case EXPR_VAR:
+			return 3;
+		case EXPR_BINARY:
+			return expr_cost(expr->left) + expr_cost(expr->right) + 1;
+		case EXPR_CALL: {
+			int cost = expr->halts ? 3 : 2;
+			for (const expr_t* arg = expr->args; arg; arg = arg->next) {
+				cost += expr_cost(arg);
+			}
+			return cost;
+		}
+	}
+	return 0;
+}
+
+static int stmt_cost(const stmt_t* stmt) {
+	int cost = 0;
+	for (; stmt; stmt = stmt->next) {
+		switch (stmt->kind) {
+			case STMT_EXPR:
+				cost += expr_cost(stmt->expr);
+				break;
+			case STMT_STORE:
+				cost += expr_cost(stmt->expr) + 3;
+				break;
+			case STMT_IF:
+				cost += expr_cost(stmt->expr) + 3 + stmt_cost(stmt->body);
+				if (stmt->else_body) cost += 3 + stmt_cost(stmt->else_body);
+				break;
+			case STMT_WHILE:
+				cost += 2 * (expr_cost(stmt->expr) + 3) + stmt_cost(stmt->body);
+				break;
+			case STMT_BLOCK:
+				cost += stmt_cost(stmt->body);
+				break;
+		}
+	}
+	return cost;
+}
+
+// A block that runs the (shared) loop body once
+static stmt_t* body_copy(compiler_t* comp, stmt_t* body) {
+	stmt_t* copy = new_stmt(comp, STMT_BLOCK);
+	copy->body = body;
+	return copy;
+}
+
+static void unroll_loop(compiler_t* comp, stmt_t* loop, int trips) {
+	int body_bytes = stmt_cost(loop->body);
+	int factor = comp->unroll_factor;
+	if (body_bytes > 0 && factor * body_bytes > UNROLL_MAX_BYTES) {
+		factor = UNROLL_MAX_BYTES / body_bytes;
+	}
+	if (factor < 1) factor = 1;
+	if (factor > trips) factor = trips;
+	if (factor > 1) comp->unrolled_count++;
+
+	// Peel the iterations that do not fill a whole unrolled pass
+	stmt_t* copies = NULL;
+	stmt_t** tail = &copies;
+	for (int i = 0; i < trips % factor; i++) {
+		*tail = body_copy(comp, loop->body);
+		tail = &(*tail)->next;
+	}
+
+	stmt_t* pass = new_stmt(comp, STMT_BLOCK);
+	stmt_t** pass_tail = &pass->body;
+	for (int i = 0; i < factor; i++) {
+		*pass_tail = body_copy(comp, loop->body);
+		pass_tail = &(*pass_tail)->next;
+	}
+
+	if (trips / factor > 1) {
+		stmt_t* rolled = new_stmt(comp, STMT_WHILE);
+		rolled->expr = loop->expr;
+		rolled->line = loop->line;
+		rolled->body = pass;
+		*tail = rolled;
+	} else {
+		*tail = pass;
+	}
+
+	// Rewrite in place so the enclosing statement list stays linked
+	loop->kind = STMT_BLOCK;
+	loop->expr = NULL;
+	loop->body = copies;
+}
+
+static void unroll_stmt(compiler_t* comp, stmt_t* stmt, known_values_t* known) {
+	if (!stmt) return;
+
+	switch (stmt->kind) {
+		case STMT_EXPR:
+			break;
+		case STMT_STORE:
+			set_known_value(known, stmt->address, stmt->expr);
+			break;
+		case STMT_IF: {
+			known_values_t entry = *known;
+			unroll_stmt(comp, stmt->body, known);
+			*known = entry;
+			unroll_stmt(comp, stmt->else_body, known);
+			known->count = 0;
+			break;
+		}
+		case STMT_WHILE: {
+			int trips = loop_trip_count(stmt, known);
+
+			// Nothing is known at the loop head, which the back-edge also reaches
+			known->count = 0;
+			if (trips == 0) {
+				stmt->kind = STMT_BLOCK;
+				stmt->expr = NULL;
+				stmt->body = NULL;
+			} else if (trips > 0 && !has_loop(stmt->body)) {
+				unroll_loop(comp, stmt, trips);
+			} else {
+				unroll_stmt(comp, stmt->body, known);
+			}
+			known->count = 0;
+			break;
+		}
+		case STMT_BLOCK:
+			for (stmt_t* child = stmt->body; child; child = child->next) {
+				unroll_stmt(comp, child, known);
+			}
+			break;
+	}
+}
+
+static void pass_unroll(compiler_t* comp) {
+	known_values_t known = {0};
+	for (stmt_t* stmt = comp->program; stmt; stmt = stmt->next) {
+		unroll_stmt(comp, stmt, &known);
+	}
+}
+
+/*
+ * SSA middle end
+ *
+ * The statement tree is lowered to a control flow graph of basic blocks.
+ * Each block holds a sequence of values in SSA form: a value is one VM
+ * operation whose operands are earlier values, and it is defined exactly
+ * once. Blocks are laid out in id order, which follows the source; while
+ * loops are lowered rotated, with a guard in the block before the loop
+ * and the test repeated at the bottom of the loop.
+ *
+ * Variables are lowered to explicit OP_LOAD and OP_STORE values. From -O1
+ * the "promote" pass puts them in SSA form as well: every load is linked
+ * to the definition that reaches it, which is a store or a phi placed at
+ * the block join where different definitions meet. Memory stays the home
+ * of each variable, so phis generate no code and live outside the block
+ * value lists; the passes use the links to see the value a load reads
+ * across blocks, replacing it by a constant or hoisting it out of a loop.
+ */
+
+static int ssa_new_block(compiler_t* comp) {
+	ssa_program_t* ssa = &comp->ssa;
+	ssa->blocks = grow_array(comp, ssa->blocks, ssa->block_count, &ssa->block_capacity, sizeof(ssa_block_t));
+
+	int id = ssa->block_count++;
+	ssa_block_t* block = &ssa->blocks[id];
+	memset(block, 0, sizeof(ssa_block_t));
+	block->term = TERM_JUMP;
+	block->cond = SSA_NONE;
+	block->succ[0] = SSA_NONE;
+	block->succ[1] = SSA_NONE;
+	block->reachable = true;
+	return id;
+}
+
+static void ssa_append(compiler_t* comp, int block_id, int value) {
+	ssa_block_t* block = &comp->ssa.blocks[block_id];
+	block->values = grow_array(comp, block->values, block->count, &block->capacity, sizeof(int));
+	block->values[block->count++] = value;
+	comp->ssa.values[value].block = block_id;
+}
+
+// Create a value in the given block; args (if any) are copied
+static int ssa_new_value(compiler_t* comp, int block, uint8_t op, int nargs, const int* args) {
+	ssa_program_t* ssa = &comp->ssa;
+	ssa->values = grow_array(comp, ssa->values, ssa->value_count, &ssa->value_capacity, sizeof(ssa_value_t));
+
+	int id = ssa->value_count++;
+	ssa_value_t* value = &ssa->values[id];
+	memset(value, 0, sizeof(ssa_value_t));
+	value->op = op;
+	value->nargs = nargs;
+	value->alias = SSA_NONE;
+	value->def = SSA_NONE;
+	value->has_result = op != OP_STORE;
+	value->line = comp->current_line;
+	if (nargs > 0) {
+		value->args = arena_alloc(comp, &comp->expr_arena, nargs * sizeof(int));
+		memcpy(value->args, args, nargs * sizeof(int));
+	}
+
+	ssa_append(comp, block, id);
+	return id;
+}
+
+// Constants are emitted where they are used, so their position is free
+static int ssa_new_const(compiler_t* comp, int block, uint8_t constant) {
+	int id = ssa_new_value(comp, block, OP_PUSH, 0, NULL);
+	comp->ssa.values[id].imm = constant;
+	return id;
+}
+
+static bool ssa_live(const ssa_program_t* ssa, int block, int value) {
+	return ssa->values[value].block == block;
+}
+
+static int ssa_resolve(const ssa_program_t* ssa, int value) {
+	while (ssa->values[value].alias != SSA_NONE) {
+		value = ssa->values[value].alias;
+	}
+	return value;
+}
+
+// Operand i of a value, following replacements
+static int ssa_arg(ssa_program_t* ssa, int value, int i) {
+	int arg = ssa_resolve(ssa, ssa->values[value].args[i]);
+	ssa->values[value].args[i] = arg;
+	return arg;
+}
+
+static bool ssa_const(const ssa_program_t* ssa, int value, uint8_t* constant) {
+	if (ssa->values[value].op != OP_PUSH) return false;
+	*constant = ssa->values[value].imm;
+	return true;
+}
+
+static void ssa_set_const(ssa_program_t* ssa, int value, uint8_t constant) {
+	ssa->values[value].op = OP_PUSH;
+	ssa->values[value].imm = constant;
+	ssa->values[value].nargs = 0;
+}
+
+static void ssa_delete(ssa_program_t* ssa, int value) {
+	ssa->values[value].block = SSA_NONE;
+}
+
+static void ssa_replace(ssa_program_t* ssa, int value, int with) {
+	ssa->values[value].alias = with;
+	ssa->values[value].block = SSA_NONE;
+}
+
+// Values that only compute a result and can be moved, merged or dropped
+static bool ssa_is_pure(uint8_t op) {
+	return op != OP_STORE && op != OP_IO;
+}
+
+static bool ssa_is_binary(const ssa_value_t* value) {
+	return value->nargs == 2 && ssa_is_pure(value->op);
+}
+
+// Drop deleted values from the block lists
+static void ssa_compact(ssa_program_t* ssa) {
+	for (int b = 0; b < ssa->block_count; b++) {
+		ssa_block_t* block = &ssa->blocks[b];
+		int kept = 0;
+		for (int i = 0; i < block->count; i++) {
+			if (ssa_live(ssa, b, block->values[i])) {
+				block->values[kept++] = block->values[i];
+			}
+		}
+		block->count = kept;
+		if (block->cond != SSA_NONE) {
+			block->cond = ssa_resolve(ssa, block->cond);
+		}
+	}
+}
+
+// Count the uses of every live value and note where they are
+static void ssa_count_uses(ssa_program_t* ssa) {
+	for (int v = 0; v < ssa->value_count; v++) {
+		ssa->values[v].uses = 0;
+		ssa->values[v].user = SSA_NONE;
+		ssa->values[v].cross_block = false;
+	}
+
+	for (int b = 0; b < ssa->block_count; b++) {
+		ssa_block_t* block = &ssa->blocks[b];
+		for (int i = 0; i <= block->count; i++) {
+			int user;
+			int nargs;
+			if (i < block->count) {
+				user = block->values[i];
+				if (!ssa_live(ssa, b, user)) continue;
+				nargs = ssa->values[user].nargs;
+			} else {
+				if (block->term != TERM_BRANCH) break;
+				user = SSA_TERM;
+				nargs = 1;
+			}
+
+			for (int k = 0; k < nargs; k++) {
+				int arg = user == SSA_TERM ? block->cond : ssa_arg(ssa, user, k);
+				ssa_value_t* value = &ssa->values[arg];
+				if (value->uses++ == 0) {
+					value->user = user;
+				}
+				if (value->block != b) {
+					value->cross_block = true;
+				}
+			}
+		}
+	}
+}
+
+static int lower_value(compiler_t* comp, const expr_t* expr);
+
+static int lower_expr(compiler_t* comp, const expr_t* expr) {
+	ssa_program_t* ssa = &comp->ssa;
+
+	switch (expr->kind) {
+		case EXPR_CONST:
+			return ssa_new_const(comp, ssa->current, expr->value);
+		case EXPR_VAR: {
+			int value = ssa_new_value(comp, ssa->current, OP_LOAD, 0, NULL);
+			ssa->values[value].address = expr->address;
+			return value;
+		}
+		case EXPR_BINARY: {
+			int args[2];
+			args[0] = lower_value(comp, expr->left);
+			args[1] = lower_value(comp, expr->right);
+			return ssa_new_value(comp, ssa->current, expr->op, 2, args);
+		}
+		case EXPR_CALL: {
+			int nargs = 0;
+			for (const expr_t* arg = expr->args; arg; arg = arg->next) {
+				nargs++;
+			}
+
+			int* args = arena_alloc(comp, &comp->expr_arena, (nargs ? nargs : 1) * sizeof(int));
+			nargs = 0;
+			for (const expr_t* arg = expr->args; arg; arg = arg->next) {
+				args[nargs++] = lower_value(comp, arg);
+			}
+
+			// read_char pushes the character read; the other calls only
+			// consume their arguments
+			int value = ssa_new_value(comp, ssa->current, OP_IO, 0, NULL);
+			ssa->values[value].nargs = nargs;
+			ssa->values[value].args = args;
+			ssa->values[value].imm = expr->op;
+			ssa->values[value].has_result = expr->op == IO_READ_CHAR;
+
+			if (expr->halts) {
+				ssa->blocks[ssa->current].term = TERM_HALT;
+				ssa->current = ssa_new_block(comp);
+			}
+			return value;
+		}
+	}
+	return SSA_NONE;
+}
+
+// Lower an expression whose result is used
+static int lower_value(compiler_t* comp, const expr_t* expr) {
+	int value = lower_expr(comp, expr);
+	if (!comp->ssa.values[value].has_result) {
+		error(comp, "Function used as a value does not return one");
+	}
+	return value;
+}
+
+static void set_jump(compiler_t* comp, int from, int to) {
+	ssa_block_t* block = &comp->ssa.blocks[from];
+	if (block->term == TERM_HALT) return;
+	block->term = TERM_JUMP;
+	block->succ[0] = to;
+}
+
+static void set_branch(compiler_t* comp, int from, int cond, int taken, int not_taken) {
+	ssa_block_t* block = &comp->ssa.blocks[from];
+	if (block->term == TERM_HALT) return;
+	block->term = TERM_BRANCH;
+	block->cond = cond;
+	block->succ[0] = taken;
+	block->succ[1] = not_taken;
+}
+
+static void lower_stmt(compiler_t* comp, const stmt_t* stmt) {
+	ssa_program_t* ssa = &comp->ssa;
+	if (!stmt) return;
+
+	int outer_line = comp->current_line;
+	if (stmt->line) {
+		comp->current_line = stmt->line;
+	}
+
+	switch (stmt->kind) {
+		case STMT_EXPR:
+			lower_expr(comp, stmt->expr);
+			break;
+		case STMT_STORE: {
+			int arg = lower_value(comp, stmt->expr);
+			int value = ssa_new_value(comp, ssa->current, OP_STORE, 1, &arg);
+			ssa->values[value].address = stmt->address;
+			break;
+		}
+		case STMT_IF: {
+			int cond = lower_value(comp, stmt->expr);
+			int head = ssa->current;
+
+			int then_block = ssa_new_block(comp);
+			ssa->current = then_block;
+			lower_stmt(comp, stmt->body);
+			int then_end = ssa->current;
+
+			int else_block = SSA_NONE;
+			int else_end = SSA_NONE;
+			if (stmt->else_body) {
+				else_block = ssa_new_block(comp);
+				ssa->current = else_block;
+				lower_stmt(comp, stmt->else_body);
+				else_end = ssa->current;
+			}
+
+			int join = ssa_new_block(comp);
+			set_branch(comp, head, cond, then_block, else_block != SSA_NONE ? else_block : join);
+			set_jump(comp, then_end, join);
+			if (else_end != SSA_NONE) {
+				set_jump(comp, else_end, join);
+			}
+			ssa->current = join;
+			break;
+		}
+		case STMT_WHILE: {
+			int guard = lower_value(comp, stmt->expr);
+			int preheader = ssa->current;
+
+			int body = ssa_new_block(comp);
+			ssa->current = body;
+			lower_stmt(comp, stmt->body);
+			comp->current_line = stmt->line ? stmt->line : outer_line;
+			int test = lower_value(comp, stmt->expr);
+			int latch = ssa->current;
+
+			int exit = ssa_new_block(comp);
+			set_branch(comp, preheader, guard, body, exit);
+			set_branch(comp, latch, test, body, exit);
+
+			ssa->loops = grow_array(comp, ssa->loops, ssa->loop_count, &ssa->loop_capacity, sizeof(ssa_loop_t));
+			ssa_loop_t* loop = &ssa->loops[ssa->loop_count++];
+			loop->preheader = preheader;
+			loop->first = body;
+			loop->last = latch;
+
+			ssa->current = exit;
+			break;
+		}
+		case STMT_BLOCK:
+			for (const stmt_t* child = stmt->body; child; child = child->next) {
+				lower_stmt(comp, child);
+			}
+			break;
+	}
+	comp->current_line = outer_line;
+}
+
+static void pass_lower(compiler_t* comp) {
+	ssa_program_t* ssa = &comp->ssa;
+	ssa->current = ssa_new_block(comp);
+	for (const stmt_t* stmt = comp->program; stmt; stmt = stmt->next) {
+		lower_stmt(comp, stmt);
+	}
+	// A module ends by falling through into the next one; kxld adds the HALT
+	if (!comp->emit_object) {
+		ssa->blocks[ssa->current].term = TERM_HALT;
+	}
+}
+
+// Promotion of variables to SSA form, after Braun et al., "Simple and
+// Efficient Construction of Static Single Assignment Form". The CFG is
+// complete, so the definition entering a block is looked up on demand:
+// it is the one leaving the only predecessor, or a phi over the ones
+// leaving each predecessor. A phi whose operands are all one definition
+// (or the phi itself, around a loop) is trivial and replaced by it.
+typedef struct {
+	int block;              // SSA_NONE for a free slot
+	uint16_t address;
+	bool entry;             // Definition entering the block, else leaving it
+	int def;
+} promote_entry_t;
+
+typedef struct {
+	promote_entry_t* entries;
+	int capacity;           // Power of two
+	int count;
+	int* pred_start;        // Predecessors of b are preds[pred_start[b]..pred_start[b + 1])
+	int* preds;
+} promote_t;
+
+static int promote_slot(const promote_t* pr, int block, uint16_t address, bool entry) {
+	uint32_t hash = ((uint32_t)block * 2654435761u) ^ ((uint32_t)address * 40503u) ^ (uint32_t)entry;
+	int slot = (int)(hash & (uint32_t)(pr->capacity - 1));
+	while (pr->entries[slot].block != SSA_NONE &&
+		(pr->entries[slot].block != block || pr->entries[slot].address != address || pr->entries[slot].entry != entry)) {
+		slot = (slot + 1) & (pr->capacity - 1);
+	}
+	return slot;
+}
+
+static void promote_alloc(compiler_t* comp, promote_t* pr, int capacity) {
+	pr->entries = malloc(capacity * sizeof(promote_entry_t));
+	if (!pr->entries) {
+		error(comp, "Out of memory in variable promotion");
+	}
+	pr->capacity = capacity;
+	for (int i = 0; i < capacity; i++) {
+		pr->entries[i].block = SSA_NONE;
+	}
+}
+
+static bool promote_find(const promote_t* pr, int block, uint16_t address, bool entry, int* def) {
+	const promote_entry_t* found = &pr->entries[promote_slot(pr, block, address, entry)];
+	if (found->block == SSA_NONE) return false;
+	*def = found->def;
+	return true;
+}
+
+static void promote_set(compiler_t* comp, promote_t* pr, int block, uint16_t address, bool entry, int def) {
+	if (2 * (pr->count + 1) > pr->capacity) {
+		promote_entry_t* old = pr->entries;
+		int old_capacity = pr->capacity;
+		promote_alloc(comp, pr, old_capacity * 2);
+		for (int i = 0; i < old_capacity; i++) {
+			if (old[i].block != SSA_NONE) {
+				pr->entries[promote_slot(pr, old[i].block, old[i].address, old[i].entry)] = old[i];
+			}
+		}
+		free(old);
+	}
+
+	promote_entry_t* slot = &pr->entries[promote_slot(pr, block, address, entry)];
+	if (slot->block == SSA_NONE) {
+		pr->count++;
+	}
+	slot->block = block;
+	slot->address = address;
+	slot->entry = entry;
+	slot->def = def;
+}
+
+// Phis generate no code, so they are kept out of the block value lists
+static int ssa_new_phi(compiler_t* comp, int block, uint16_t address, int nargs) {
+	ssa_program_t* ssa = &comp->ssa;
+	ssa->values = grow_array(comp, ssa->values, ssa->value_count, &ssa->value_capacity, sizeof(ssa_value_t));
+
+	int id = ssa->value_count++;
+	ssa_value_t* value = &ssa->values[id];
+	memset(value, 0, sizeof(ssa_value_t));
+	value->op = SSA_OP_PHI;
+	value->address = address;
+	value->nargs = nargs;
+	value->args = arena_alloc(comp, &comp->expr_arena, nargs * sizeof(int));
+	value->block = block;
+	value->alias = SSA_NONE;
+	value->def = SSA_NONE;
+	value->has_result = true;
+	comp->phi_count++;
+	return id;
+}
+
+static int promote_read_entry(compiler_t* comp, promote_t* pr, int block, uint16_t address);
+
+static int promote_read_exit(compiler_t* comp, promote_t* pr, int block, uint16_t address) {
+	int def;
+	if (promote_find(pr, block, address, false, &def)) {
+		return def;
+	}
+	return promote_read_entry(comp, pr, block, address);
+}
+
+static int promote_read_entry(compiler_t* comp, promote_t* pr, int block, uint16_t address) {
+	ssa_program_t* ssa = &comp->ssa;
+	int def;
+	if (promote_find(pr, block, address, true, &def)) {
+		return def == SSA_NONE ? def : ssa_resolve(ssa, def);
+	}
+
+	int first = pr->pred_start[block];
+	int count = pr->pred_start[block + 1] - first;
+	if (count <= 1) {
+		// Recorded first, so a cycle of unreachable blocks ends here
+		promote_set(comp, pr, block, address, true, SSA_NONE);
+		def = count == 1 ? promote_read_exit(comp, pr, pr->preds[first], address) : SSA_NONE;
+		promote_set(comp, pr, block, address, true, def);
+		return def;
+	}
+
+	// Likewise, a read coming back around a loop finds the phi
+	int phi = ssa_new_phi(comp, block, address, count);
+	promote_set(comp, pr, block, address, true, phi);
+
+	int same = SSA_NONE;
+	bool seen = false;
+	bool trivial = true;
+	for (int i = 0; i < count; i++) {
+		int arg = promote_read_exit(comp, pr, pr->preds[first + i], address);
+		ssa->values[phi].args[i] = arg;
+		if (arg == phi || (seen && arg == same)) continue;
+		if (seen) trivial = false;
+		same = arg;
+		seen = true;
+	}
+
+	if (trivial && same != SSA_NONE) {
+		ssa_replace(ssa, phi, same);
+		comp->phi_count--;
+		promote_set(comp, pr, block, address, true, same);
+		return same;
+	}
+	return phi;
+}
+
+static void pass_promote(compiler_t* comp) {
+	ssa_program_t* ssa = &comp->ssa;
+	int blocks = ssa->block_count;
+	promote_t pr = { NULL, 0, 0, calloc(blocks + 1, sizeof(int)), malloc(2 * blocks * sizeof(int)) };
+	int* next = malloc(blocks * sizeof(int));
+	int* local = malloc(comp->next_var_addr * sizeof(int));
+	int* touched = malloc(comp->next_var_addr * sizeof(int));
+	if (!pr.pred_start || !pr.preds || !next || !local || !touched) {
+		error(comp, "Out of memory in variable promotion");
+	}
+	int capacity = 64;
+	while (capacity < 4 * blocks) capacity *= 2;
+	promote_alloc(comp, &pr, capacity);
+	for (int i = 0; i < comp->next_var_addr; i++) {
+		local[i] = SSA_NONE;
+	}
+
+	for (int b = 0; b < blocks; b++) {
+		const ssa_block_t* block = &ssa->blocks[b];
+		int succs = block->term == TERM_BRANCH ? 2 : block->term == TERM_JUMP ? 1 : 0;
+		for (int s = 0; s < succs; s++) {
+			if (block->succ[s] != SSA_NONE) {
+				pr.pred_start[block->succ[s] + 1]++;
+			}
+		}
+	}
+	for (int b = 0; b < blocks; b++) {
+		pr.pred_start[b + 1] += pr.pred_start[b];
+		next[b] = pr.pred_start[b];
+	}
+	for (int b = 0; b < blocks; b++) {
+		const ssa_block_t* block = &ssa->blocks[b];
+		int succs = block->term == TERM_BRANCH ? 2 : block->term == TERM_JUMP ? 1 : 0;
+		for (int s = 0; s < succs; s++) {
+			if (block->succ[s] != SSA_NONE) {
+				pr.preds[next[block->succ[s]]++] = b;
+			}
+		}
+	}
+
+	// The definition leaving a block is its last store to the variable
+	for (int b = 0; b < blocks; b++) {
+		for (int i = 0; i < ssa->blocks[b].count; i++) {
+			int v = ssa->blocks[b].values[i];
+			if (ssa_live(ssa, b, v) && ssa->values[v].op == OP_STORE) {
+				promote_set(comp, &pr, b, ssa->values[v].address, false, v);
+			}
+		}
+	}
+
+	// A load reads the store before it in its block, or what enters the block
+	for (int b = 0; b < blocks; b++) {
+		int touched_count = 0;
+		for (int i = 0; i < ssa->blocks[b].count; i++) {
+			int v = ssa->blocks[b].values[i];
+			if (!ssa_live(ssa, b, v)) continue;
+
+			uint16_t address = ssa->values[v].address;
+			if (ssa->values[v].op == OP_STORE) {
+				if (local[address] == SSA_NONE) {
+					touched[touched_count++] = address;
+				}
+				local[address] = v;
+			} else if (ssa->values[v].op == OP_LOAD) {
+				int def = local[address];
+				if (def == SSA_NONE) {
+					def = promote_read_entry(comp, &pr, b, address);
+				}
+				ssa->values[v].def = def;
+			}
+		}
+		for (int i = 0; i < touched_count; i++) {
+			local[touched[i]] = SSA_NONE;
+		}
+	}
+
+	free(pr.entries);
+	free(pr.pred_start);
+	free(pr.preds);
+	free(next);
+	free(local);
+	free(touched);
+}
+
+// x-x, x^x, x!=x, x>x, x<x -> 0; x==x, x>=x, x<=x -> 1; x&x, x|x -> x
+static bool fold_same_operands(ssa_program_t* ssa, int v, int operand) {
+	switch (ssa->values[v].op) {
+		case OP_SUB: case OP_XOR: case OP_NEQ: case OP_GT: case OP_LT:
+			ssa_set_const(ssa, v, 0);
+			return true;
+		case OP_EQ: case OP_GTE: case OP_LTE:
+			ssa_set_const(ssa, v, 1);
+			return true;
+		case OP_AND: case OP_OR:
+			ssa_replace(ssa, v, operand);
+			return true;
+		default:
+			return false;
+	}
+}
+
+// Simplify one arithmetic value: fold constants, normalize constants to
+// the right, turn x-c into x+(-c), merge (x+c1)+c2 and (x*c1)*c2, and
+// apply identities such as x+0, x*1, x*0, x%1, x-x and x==x.
+static void fold_value(compiler_t* comp, int block, int v) {
+	ssa_program_t* ssa = &comp->ssa;
+	ssa_value_t* value = &ssa->values[v];
+	uint8_t ca;
+	uint8_t cb;
+	uint8_t folded;
+
+	if (value->op == OP_NEG && value->nargs == 1) {
+		if (ssa_const(ssa, ssa_arg(ssa, v, 0), &ca)) {
+			ssa_set_const(ssa, v, (uint8_t)-ca);
+		}
+		return;
+	}
+	if (!ssa_is_binary(value)) return;
+
+	int a = ssa_arg(ssa, v, 0);
+	int b = ssa_arg(ssa, v, 1);
+	bool ka = ssa_const(ssa, a, &ca);
+	bool kb = ssa_const(ssa, b, &cb);
+	uint8_t op = value->op;
+
+	if (ka && kb && fold_binary(op, ca, cb, &folded)) {
+		ssa_set_const(ssa, v, folded);
+		return;
+	}
+
+	if (ka && !kb && is_commutative(op)) {
+		value->args[0] = b;
+		value->args[1] = a;
+		a = value->args[0];
+		b = value->args[1];
+		kb = true;
+		cb = ca;
+	}
+
+	if (op == OP_SUB && kb) {
+		cb = (uint8_t)-cb;
+		b = ssa_new_const(comp, block, cb);
+		value = &ssa->values[v];
+		value->op = op = OP_ADD;
+		value->args[1] = b;
+	}
+
+	if (a == b && fold_same_operands(ssa, v, a)) return;
+	if (!kb) return;
+
+	// Left operand of a chain such as (x+c1)+c2
+	const ssa_value_t* inner = &ssa->values[a];
+	uint8_t c1 = 0;
+	bool chain = inner->op == op && inner->nargs == 2 &&
+		ssa_const(ssa, ssa_resolve(ssa, inner->args[1]), &c1);
+
+	switch (op) {
+		case OP_ADD:
+			if (cb == 0) {
+				ssa_replace(ssa, v, a);
+			} else if (chain) {
+				int x = ssa_resolve(ssa, inner->args[0]);
+				int c = ssa_new_const(comp, block, (uint8_t)(c1 + cb));
+				ssa->values[v].args[0] = x;
+				ssa->values[v].args[1] = c;
+			}
+			break;
+		case OP_MUL:
+			if (cb == 1) {
+				ssa_replace(ssa, v, a);
+			} else if (cb == 0) {
+				ssa_set_const(ssa, v, 0);
+			} else if (chain) {
+				int x = ssa_resolve(ssa, inner->args[0]);
+				int c = ssa_new_const(comp, block, (uint8_t)(c1 * cb));
+				ssa->values[v].args[0] = x;
+				ssa->values[v].args[1] = c;
+			}
+			break;
+		case OP_DIV:
+			if (cb == 1) ssa_replace(ssa, v, a);
+			break;
+		case OP_MOD:
+			if (cb == 1) ssa_set_const(ssa, v, 0);
+			break;
+		case OP_AND:
+			if (cb == 0) ssa_set_const(ssa, v, 0);
+			else if (cb == 255) ssa_replace(ssa, v, a);
+			break;
+		case OP_OR:
+		case OP_XOR:
+		case OP_SHL:
+		case OP_SHR:
+			if (cb == 0) ssa_replace(ssa, v, a);
+			break;
+		default:
+			break;
+	}
+}
 
-void parse_multiplicative(compiler_t* comp);
-void parse_statement(compiler_t* comp);
-void parse_var_declaration(compiler_t* comp);
-void parse_assignment(compiler_t* comp);
-void parse_if_statement(compiler_t* comp);
-void parse_while_statement(compiler_t* comp);
-void parse_expression_statement(compiler_t* comp);
-void parse_expression(compiler_t* comp);
-void parse_comparison(compiler_t* comp);
-void parse_term(compiler_t* comp);
-void parse_factor(compiler_t* comp);
-void parse_function_call(compiler_t* comp, const char* func_name);
+// Constant a definition gives its variable: a store of a constant, or a
+// phi whose operands all give the same one; a load gives its definition's.
+// Whatever turns out to be constant is made so. state marks values
+// being tried (1) or known not to be constant (2), so loops end.
+static bool ssa_def_const(ssa_program_t* ssa, int def, uint8_t* state, int state_size, uint8_t* constant) {
+	if (def == SSA_NONE) return false;
+	def = ssa_resolve(ssa, def);
+	if (ssa->values[def].op == OP_STORE) {
+		def = ssa_arg(ssa, def, 0);
+	}
+	if (ssa_const(ssa, def, constant)) return true;
 
-symbol_t* find_symbol(compiler_t* comp, const char* name);
-symbol_t* add_symbol(compiler_t* comp, const char* name);
+	const ssa_value_t* value = &ssa->values[def];
+	if ((value->op != OP_LOAD && value->op != SSA_OP_PHI) || def >= state_size || state[def] != 0) {
+		return false;
+	}
 
-bool is_builtin_function(const char* name);
-int get_builtin_syscall(const char* name);
+	state[def] = 1;
+	bool known;
+	if (value->op == OP_LOAD) {
+		known = ssa_def_const(ssa, value->def, state, state_size, constant);
+	} else {
+		known = true;
+		for (int i = 0; known && i < value->nargs; i++) {
+			uint8_t incoming;
+			known = ssa_def_const(ssa, value->args[i], state, state_size, &incoming) &&
+				(i == 0 || incoming == *constant);
+			*constant = incoming;
+		}
+	}
 
-void error(compiler_t* comp, const char* message) {
-	token_t* tok = current_token(comp);
-	fprintf(stderr, "Error at line %d: %s\n", tok->line, message);
-	exit(1);
+	state[def] = known ? 0 : 2;
+	if (known) {
+		ssa_set_const(ssa, def, *constant);
+	}
+	return known;
 }
 
-void emit(compiler_t* comp, const char* code) {
-	if (comp->output_count >= MAX_CODE_LINES) {
-		error(comp, "Too many output lines - program too complex");
+// Constant propagation and folding. A load whose reaching definition gives
+// a constant, through stores and phis in any block, becomes that constant;
+// every arithmetic value is then simplified, and branches on constants
+// become jumps.
+static void pass_constprop(compiler_t* comp) {
+	ssa_program_t* ssa = &comp->ssa;
+	int state_size = ssa->value_count;
+	uint8_t* state = calloc(state_size ? state_size : 1, sizeof(uint8_t));
+	if (!state) {
+		error(comp, "Out of memory in constant propagation");
 	}
-	if (strlen(code) >= MAX_LINE_LEN) {
-		error(comp, "Output line too long");
-	}
-	strcpy(comp->output[comp->output_count++], code);
-}
 
-void emit_label(compiler_t* comp, const char* label) {
-	char line[MAX_LINE_LEN];
-	snprintf(line, sizeof(line), "%s:", label);
-	emit(comp, line);
-}
+	for (int b = 0; b < ssa->block_count; b++) {
+		for (int i = 0; i < ssa->blocks[b].count; i++) {
+			int v = ssa->blocks[b].values[i];
+			if (!ssa_live(ssa, b, v)) continue;
 
-char* new_label(compiler_t* comp) {
-	static char labels[10][32];
-	static int current_label_slot = 0;
-	
-	char* label = labels[current_label_slot];
-	snprintf(label, 32, "L%d", comp->label_counter++);
-	
-	current_label_slot = (current_label_slot + 1) % 10;
-	return label;
-}
+			uint8_t constant;
+			if (ssa->values[v].op == OP_LOAD) {
+				ssa_def_const(ssa, v, state, state_size, &constant);
+			} else if (ssa->values[v].op != OP_STORE) {
+				fold_value(comp, b, v);
+			}
+		}
 
-token_t* current_token(compiler_t* comp) {
-	if (comp->current_token >= comp->token_count) {
-		static token_t eof_token = {TOKEN_EOF, "", 0, 0};
-		return &eof_token;
+		ssa_block_t* block = &ssa->blocks[b];
+		uint8_t constant;
+		if (block->term == TERM_BRANCH) {
+			block->cond = ssa_resolve(ssa, block->cond);
+			if (ssa_const(ssa, block->cond, &constant)) {
+				block->term = TERM_JUMP;
+				block->succ[0] = constant ? block->succ[0] : block->succ[1];
+				block->cond = SSA_NONE;
+			} else if (block->succ[0] == block->succ[1]) {
+				block->term = TERM_JUMP;
+				block->cond = SSA_NONE;
+			}
+		}
 	}
-	return &comp->tokens[comp->current_token];
+
+	free(state);
 }
 
-token_t* peek_token(compiler_t* comp) {
-	if (comp->current_token + 1 >= comp->token_count) {
-		static token_t eof_token = {TOKEN_EOF, "", 0, 0};
-		return &eof_token;
+// Cost of recomputing a value and the operands only it uses
+static int ssa_cost(const ssa_program_t* ssa, int v) {
+	const ssa_value_t* value = &ssa->values[v];
+	if (value->op == OP_PUSH) return 2;
+	if (value->op == OP_LOAD) return 3;
+
+	int cost = 1;
+	for (int i = 0; i < value->nargs; i++) {
+		cost += ssa_cost(ssa, ssa_resolve(ssa, value->args[i]));
 	}
-	return &comp->tokens[comp->current_token + 1];
+	return cost;
 }
 
-void consume_token(compiler_t* comp) {
-	if (comp->current_token < comp->token_count) {
-		comp->current_token++;
+typedef struct {
+	uint8_t op;
+	int k1;
+	int k2;
+	int value;
+} cse_entry_t;
+
+// Common subexpression elimination by value numbering within a block.
+// Loads of a variable share a number until it is stored to. A repeated
+// computation is replaced by the earlier one when recomputing it costs
+// more than keeping the earlier result in a temporary.
+static void pass_cse(compiler_t* comp) {
+	ssa_program_t* ssa = &comp->ssa;
+	int* number = malloc((ssa->value_count ? ssa->value_count : 1) * sizeof(int));
+	int* generation = calloc(comp->next_var_addr, sizeof(int));
+	if (!number || !generation) {
+		error(comp, "Out of memory in CSE");
+	}
+	int stores = 0;
+	for (int v = 0; v < ssa->value_count; v++) {
+		number[v] = v;
 	}
-}
 
-bool match_token(compiler_t* comp, token_type_t type) {
-	if (current_token(comp)->type == type) {
-		consume_token(comp);
-		return true;
+	for (int b = 0; b < ssa->block_count; b++) {
+		ssa_block_t* block = &ssa->blocks[b];
+		int size = 16;
+		while (size < block->count * 2) size *= 2;
+		cse_entry_t* table = malloc(size * sizeof(cse_entry_t));
+		if (!table) {
+			error(comp, "Out of memory in CSE");
+		}
+		for (int i = 0; i < size; i++) {
+			table[i].value = SSA_NONE;
+		}
+
+		for (int i = 0; i < block->count; i++) {
+			int v = block->values[i];
+			if (!ssa_live(ssa, b, v)) continue;
+
+			ssa_value_t* value = &ssa->values[v];
+			cse_entry_t key = { value->op, 0, 0, v };
+			if (value->op == OP_PUSH) {
+				key.k1 = value->imm;
+			} else if (value->op == OP_LOAD) {
+				key.k1 = value->address;
+				key.k2 = generation[value->address];
+			} else if (value->op == OP_STORE) {
+				generation[value->address] = ++stores;
+				continue;
+			} else if (value->op == OP_IO) {
+				continue;
+			} else {
+				key.k1 = number[ssa_arg(ssa, v, 0)];
+				key.k2 = value->nargs == 2 ? number[ssa_arg(ssa, v, 1)] : SSA_NONE;
+
+				// Two loads of x between stores are the same value, so x-x is 0
+				if (key.k1 == key.k2 && fold_same_operands(ssa, v, ssa_arg(ssa, v, 0))) {
+					continue;
+				}
+				if (is_commutative(value->op) && key.k1 > key.k2) {
+					int tmp = key.k1;
+					key.k1 = key.k2;
+					key.k2 = tmp;
+				}
+			}
+
+			uint32_t hash = ((uint32_t)key.op * 2654435761u) ^ ((uint32_t)key.k1 * 40503u) ^ (uint32_t)key.k2;
+			int slot = (int)(hash & (uint32_t)(size - 1));
+			while (table[slot].value != SSA_NONE &&
+				(table[slot].op != key.op || table[slot].k1 != key.k1 || table[slot].k2 != key.k2)) {
+				slot = (slot + 1) & (size - 1);
+			}
+
+			if (table[slot].value == SSA_NONE) {
+				table[slot] = key;
+				continue;
+			}
+
+			int earlier = table[slot].value;
+			number[v] = number[earlier];
+			if (value->op != OP_PUSH && value->op != OP_LOAD && ssa_cost(ssa, v) > 6) {
+				ssa_replace(ssa, v, earlier);
+				comp->cse_count++;
+			}
+		}
+		free(table);
 	}
-	return false;
+
+	free(number);
+	free(generation);
 }
 
-void expect_token(compiler_t* comp, token_type_t type) {
-	if (current_token(comp)->type != type) {
-		char error_msg[MAX_LINE_LEN];
-		snprintf(error_msg, sizeof(error_msg), "Expected token type %d, got %d", type, current_token(comp)->type);
-		error(comp, error_msg);
+// Loop-invariant code motion. Loops are visited innermost first. A value
+// in the loop is invariant when it is arithmetic or a load of a variable
+// the loop never stores to, or whose reaching definition is outside the
+// loop, and its operands are invariant or defined outside the loop. Invariant arithmetic (with the loads feeding it) is
+// moved to the end of the preheader, so it runs once per loop entry;
+// codegen keeps the results in temporaries. Division and modulo by a
+// non-constant are left in place, since hoisting them out of a guarded
+// branch could introduce a trap.
+static void licm_mark(ssa_program_t* ssa, const bool* invariant, bool* hoist, int v) {
+	if (hoist[v]) return;
+	hoist[v] = true;
+	for (int i = 0; i < ssa->values[v].nargs; i++) {
+		int arg = ssa_resolve(ssa, ssa->values[v].args[i]);
+		if (invariant[arg] && ssa->values[arg].op != OP_PUSH) {
+			licm_mark(ssa, invariant, hoist, arg);
+		}
 	}
-	consume_token(comp);
 }
 
-bool is_keyword(const char* str, token_type_t* type) {
-	if (strcmp(str, "var") == 0) { *type = TOKEN_VAR; return true; }
-	if (strcmp(str, "if") == 0) { *type = TOKEN_IF; return true; }
-	if (strcmp(str, "else") == 0) { *type = TOKEN_ELSE; return true; }
-	if (strcmp(str, "while") == 0) { *type = TOKEN_WHILE; return true; }
-	if (strcmp(str, "return") == 0) { *type = TOKEN_RETURN; return true; }
-	return false;
+static bool licm_defined_outside(const ssa_program_t* ssa, const ssa_loop_t* loop, int def) {
+	if (def == SSA_NONE) return true;
+	int home = ssa->values[ssa_resolve(ssa, def)].block;
+	return home < loop->first || home > loop->last;
 }
 
-void tokenize(compiler_t* comp, const char* source) {
-	const char* p = source;
-	int line = 1;
-	int column = 1;
+static void pass_licm(compiler_t* comp) {
+	ssa_program_t* ssa = &comp->ssa;
+	int* stored = malloc(comp->next_var_addr * sizeof(int));
+	bool* invariant = calloc(ssa->value_count ? ssa->value_count : 1, sizeof(bool));
+	bool* hoist = calloc(ssa->value_count ? ssa->value_count : 1, sizeof(bool));
+	if (!stored || !invariant || !hoist) {
+		error(comp, "Out of memory in LICM");
+	}
+	for (int i = 0; i < comp->next_var_addr; i++) {
+		stored[i] = SSA_NONE;
+	}
 
-	comp->token_count = 0;
+	for (int l = 0; l < ssa->loop_count; l++) {
+		const ssa_loop_t* loop = &ssa->loops[l];
+		if (!ssa->blocks[loop->preheader].reachable) continue;
 
-	while (*p) {
-		while (isspace(*p)) {
-			if (*p == '\n') {
-				line++;
-				column = 1;
-			} else {
-				column++;
+		for (int b = loop->first; b <= loop->last; b++) {
+			for (int i = 0; i < ssa->blocks[b].count; i++) {
+				const ssa_value_t* value = &ssa->values[ssa->blocks[b].values[i]];
+				if (value->block == b && value->op == OP_STORE) {
+					stored[value->address] = l;
+				}
 			}
-			p++;
 		}
 
-		if (!*p) break;
-
-		token_t* token = &comp->tokens[comp->token_count];
-		token->line = line;
-		token->column = column;
-
-		if (*p == '/' && *(p + 1) == '/') {
-			while (*p && *p != '\n') p++;
-			continue;
+		for (int b = loop->first; b <= loop->last; b++) {
+			for (int i = 0; i < ssa->blocks[b].count; i++) {
+				int v = ssa->blocks[b].values[i];
+				const ssa_value_t* value = &ssa->values[v];
+				if (value->block != b || !ssa_is_pure(value->op)) continue;
+
+				bool ok = value->op != OP_LOAD || stored[value->address] != l ||
+					licm_defined_outside(ssa, loop, value->def);
+				if (value->op == OP_DIV || value->op == OP_MOD) {
+					uint8_t divisor;
+					ok = ssa_const(ssa, ssa_arg(ssa, v, 1), &divisor) && divisor != 0;
+				}
+				for (int k = 0; ok && k < value->nargs; k++) {
+					int arg = ssa_arg(ssa, v, k);
+					int home = ssa->values[arg].block;
+					bool outside = home < loop->first || home > loop->last;
+					ok = outside || invariant[arg] || ssa->values[arg].op == OP_PUSH;
+				}
+				invariant[v] = ok;
+			}
 		}
 
-		if (isdigit(*p)) {
-			int i = 0;
-			while (isdigit(*p) && i < MAX_IDENTIFIER_LEN - 1) {
-				token->value[i++] = *p++;
-				column++;
-			}
-			token->value[i] = '\0';
-			token->type = TOKEN_NUMBER;
-		}
-		else if (isalpha(*p) || *p == '_') {
-			int i = 0;
-			while ((isalnum(*p) || *p == '_') && i < MAX_IDENTIFIER_LEN - 1) {
-				token->value[i++] = *p++;
-				column++;
-			}
-			token->value[i] = '\0';
-
-			if (!is_keyword(token->value, &token->type)) {
-				token->type = TOKEN_IDENTIFIER;
-			}
-		}
-		else if (*p == '=' && *(p + 1) == '=') {
-			strcpy(token->value, "==");
-			token->type = TOKEN_EQUALS;
-			p += 2;
-			column += 2;
-		}
-		else if (*p == '!' && *(p + 1) == '=') {
-			strcpy(token->value, "!=");
-			token->type = TOKEN_NOT_EQUALS;
-			p += 2;
-			column += 2;
-		}
-		else if (*p == '<' && *(p + 1) == '=') {
-			strcpy(token->value, "<=");
-			token->type = TOKEN_LESS_EQUAL;
-			p += 2;
-			column += 2;
-		}
-		else if (*p == '>' && *(p + 1) == '=') {
-			strcpy(token->value, ">=");
-			token->type = TOKEN_GREATER_EQUAL;
-			p += 2;
-			column += 2;
-		}
-		else {
-			token->value[0] = *p;
-			token->value[1] = '\0';
-
-			switch (*p) {
-				case '=': token->type = TOKEN_ASSIGN; break;
-				case '+': token->type = TOKEN_PLUS; break;
-				case '-': token->type = TOKEN_MINUS; break;
-				case '*': token->type = TOKEN_MULTIPLY; break;
-				case '/': token->type = TOKEN_DIVIDE; break;
-				case '<': token->type = TOKEN_LESS; break;
-				case '>': token->type = TOKEN_GREATER; break;
-				case ';': token->type = TOKEN_SEMICOLON; break;
-				case ',': token->type = TOKEN_COMMA; break;
-				case '(': token->type = TOKEN_LPAREN; break;
-				case ')': token->type = TOKEN_RPAREN; break;
-				case '{': token->type = TOKEN_LBRACE; break;
-				case '}': token->type = TOKEN_RBRACE; break;
-				default: token->type = TOKEN_UNKNOWN; break;
+		// Mark from the last user back, so a hoisted tree counts once
+		for (int b = loop->last; b >= loop->first; b--) {
+			for (int i = ssa->blocks[b].count - 1; i >= 0; i--) {
+				int v = ssa->blocks[b].values[i];
+				const ssa_value_t* value = &ssa->values[v];
+				if (value->block == b && invariant[v] && value->nargs > 0 && !hoist[v]) {
+					licm_mark(ssa, invariant, hoist, v);
+					comp->hoisted_count++;
+				}
 			}
-			p++;
-			column++;
 		}
 
-		comp->token_count++;
-		if (comp->token_count >= MAX_TOKENS) {
-			error(comp, "Too many tokens");
+		// Move in order so operands stay ahead of their users
+		for (int b = loop->first; b <= loop->last; b++) {
+			for (int i = 0; i < ssa->blocks[b].count; i++) {
+				int v = ssa->blocks[b].values[i];
+				if (ssa->values[v].block == b && hoist[v]) {
+					ssa_append(comp, loop->preheader, v);
+				}
+				invariant[v] = false;
+				hoist[v] = false;
+			}
 		}
 	}
+
+	ssa_compact(ssa);
+	free(stored);
+	free(invariant);
+	free(hoist);
 }
 
-symbol_t* find_symbol(compiler_t* comp, const char* name) {
-	for (int i = 0; i < comp->symbol_count; i++) {
-		if (strcmp(comp->symbols[i].name, name) == 0) {
-			return &comp->symbols[i];
+// Strength reduction of operations with a constant right operand, using
+// 8-bit unsigned semantics: x*2^k = x<<k, x*2 = x+x, x*255 = -x,
+// x/2^k = x>>k, x/c = (x >= c) for c >= 128 and x%2^k = x&(2^k-1).
+static void pass_strength(compiler_t* comp) {
+	ssa_program_t* ssa = &comp->ssa;
+
+	for (int b = 0; b < ssa->block_count; b++) {
+		for (int i = 0; i < ssa->blocks[b].count; i++) {
+			int v = ssa->blocks[b].values[i];
+			ssa_value_t* value = &ssa->values[v];
+			uint8_t c;
+			if (value->block != b || !ssa_is_binary(value) || !ssa_const(ssa, ssa_arg(ssa, v, 1), &c)) {
+				continue;
+			}
+
+			int x = ssa_arg(ssa, v, 0);
+			int shift = log2_exact(c);
+			uint8_t op = value->op;
+			uint8_t new_op = op;
+			int operand = SSA_NONE;
+
+			if (op == OP_MUL && c == 2) {
+				new_op = OP_ADD;
+				operand = x;
+			} else if (op == OP_MUL && c == 255) {
+				new_op = OP_NEG;
+			} else if (op == OP_MUL && shift > 0) {
+				new_op = OP_SHL;
+				operand = ssa_new_const(comp, b, (uint8_t)shift);
+			} else if (op == OP_DIV && shift > 0) {
+				new_op = OP_SHR;
+				operand = ssa_new_const(comp, b, (uint8_t)shift);
+			} else if (op == OP_DIV && c >= 128) {
+				new_op = OP_GTE;
+				operand = ssa_arg(ssa, v, 1);
+			} else if (op == OP_MOD && shift > 0) {
+				new_op = OP_AND;
+				operand = ssa_new_const(comp, b, (uint8_t)(c - 1));
+			} else {
+				continue;
+			}
+
+			value = &ssa->values[v];
+			value->op = new_op;
+			value->nargs = new_op == OP_NEG ? 1 : 2;
+			value->args[1] = operand;
+			comp->reduced_count++;
 		}
 	}
-	return NULL;
 }
 
-symbol_t* add_symbol(compiler_t* comp, const char* name) {
-	if (comp->symbol_count >= MAX_SYMBOLS) {
-		error(comp, "Too many symbols - reduce number of variables");
+// Remove blocks that cannot be reached from the entry block
+static void pass_cfg(compiler_t* comp) {
+	ssa_program_t* ssa = &comp->ssa;
+	int* worklist = malloc((ssa->block_count ? ssa->block_count : 1) * sizeof(int));
+	if (!worklist) {
+		error(comp, "Out of memory in CFG cleanup");
 	}
 
-	if (strlen(name) >= MAX_IDENTIFIER_LEN) {
-		error(comp, "Variable name too long");
+	for (int b = 0; b < ssa->block_count; b++) {
+		ssa->blocks[b].reachable = false;
 	}
 
-	symbol_t* sym = &comp->symbols[comp->symbol_count++];
-	strcpy(sym->name, name);
-	sym->address = comp->next_var_addr++;
-	sym->initialized = false;
-	return sym;
-}
+	int pending = 0;
+	ssa->blocks[0].reachable = true;
+	worklist[pending++] = 0;
+	while (pending > 0) {
+		const ssa_block_t* block = &ssa->blocks[worklist[--pending]];
+		int succs = block->term == TERM_BRANCH ? 2 : block->term == TERM_JUMP ? 1 : 0;
+		for (int s = 0; s < succs; s++) {
+			int next = block->succ[s];
+			if (next != SSA_NONE && !ssa->blocks[next].reachable) {
+				ssa->blocks[next].reachable = true;
+				worklist[pending++] = next;
+			}
+		}
+	}
 
-bool is_builtin_function(const char* name) {
-	return (strcmp(name, "draw_pixel") == 0 ||
-	strcmp(name, "draw_line") == 0 ||
-	strcmp(name, "fill_rect") == 0 ||
-	strcmp(name, "refresh") == 0 ||
-	strcmp(name, "print_char") == 0 ||
-	strcmp(name, "read_char") == 0 ||
-	strcmp(name, "halt") == 0);
-}
-
-int get_builtin_syscall(const char* name) {
-	if (strcmp(name, "draw_pixel") == 0) return SYS_DRAW_PIXEL;
-	if (strcmp(name, "draw_line") == 0) return SYS_DRAW_LINE;
-	if (strcmp(name, "fill_rect") == 0) return SYS_FILL_RECT;
-	if (strcmp(name, "refresh") == 0) return SYS_REFRESH;
-	if (strcmp(name, "print_char") == 0) return SYS_PRINT_CHAR;
-	if (strcmp(name, "read_char") == 0) return SYS_READ_CHAR;
-	if (strcmp(name, "halt") == 0) return SYS_EXIT;
-	return -1;
+	for (int b = 0; b < ssa->block_count; b++) {
+		if (ssa->blocks[b].reachable) continue;
+		for (int i = 0; i < ssa->blocks[b].count; i++) {
+			ssa_delete(ssa, ssa->blocks[b].values[i]);
+		}
+		ssa->blocks[b].count = 0;
+	}
+	free(worklist);
 }
 
-void parse_program(compiler_t* comp) {
-	while (current_token(comp)->type != TOKEN_EOF) {
-		parse_statement(comp);
+// Within a block, a store overwritten before any load of the variable is dead
+static void pass_dse(compiler_t* comp) {
+	ssa_program_t* ssa = &comp->ssa;
+	int* pending = malloc(comp->next_var_addr * sizeof(int));
+	int* touched = malloc(comp->next_var_addr * sizeof(int));
+	if (!pending || !touched) {
+		error(comp, "Out of memory in dead store elimination");
+	}
+	for (int i = 0; i < comp->next_var_addr; i++) {
+		pending[i] = SSA_NONE;
+	}
+
+	for (int b = 0; b < ssa->block_count; b++) {
+		int touched_count = 0;
+		for (int i = 0; i < ssa->blocks[b].count; i++) {
+			int v = ssa->blocks[b].values[i];
+			const ssa_value_t* value = &ssa->values[v];
+			if (value->block != b) continue;
+
+			if (value->op == OP_LOAD) {
+				pending[value->address] = SSA_NONE;
+			} else if (value->op == OP_STORE) {
+				if (pending[value->address] != SSA_NONE) {
+					ssa_delete(ssa, pending[value->address]);
+					comp->dead_store_count++;
+				} else {
+					touched[touched_count++] = value->address;
+				}
+				pending[value->address] = v;
+			}
+		}
+		for (int i = 0; i < touched_count; i++) {
+			pending[touched[i]] = SSA_NONE;
+		}
 	}
 
-	if (comp->output_count == 0 || 
-		strstr(comp->output[comp->output_count - 1], "HALT") == NULL) {
-		emit(comp, "HALT");
+	free(pending);
+	free(touched);
+}
+
+// Remove arithmetic and loads whose results are never used
+static void pass_dce(compiler_t* comp) {
+	ssa_program_t* ssa = &comp->ssa;
+	ssa_compact(ssa);
+	ssa_count_uses(ssa);
+
+	// Operands come before their users, so one backward sweep cascades
+	for (int b = ssa->block_count - 1; b >= 0; b--) {
+		for (int i = ssa->blocks[b].count - 1; i >= 0; i--) {
+			int v = ssa->blocks[b].values[i];
+			ssa_value_t* value = &ssa->values[v];
+			if (value->block != b || value->uses > 0 || !ssa_is_pure(value->op)) continue;
+
+			for (int k = 0; k < value->nargs; k++) {
+				ssa->values[ssa_arg(ssa, v, k)].uses--;
+			}
+			ssa_delete(ssa, v);
+		}
 	}
 }
 
-void parse_statement(compiler_t* comp) {
-	token_t* tok = current_token(comp);
+/*
+ * Stack code generation
+ *
+ * Blocks are emitted in layout order. Constants, and loads used once
+ * before their variable is stored again, are emitted where they are used.
+ * Every other value is computed where it is defined. It stays on the VM
+ * stack when its only user finds it on top in operand order (or takes it
+ * twice, through DUP); otherwise it is spilled, stored to a temporary
+ * right after it is computed and loaded at each use. Spills are found by
+ * simulating each block's stack and spilling out-of-place operands until
+ * the block schedules.
+ */
 
-	switch (tok->type) {
-		case TOKEN_VAR:
-			parse_var_declaration(comp);
-			break;
-		case TOKEN_IF:
-			parse_if_statement(comp);
-			break;
-		case TOKEN_WHILE:
-			parse_while_statement(comp);
-			break;
-		case TOKEN_IDENTIFIER:
-			if (peek_token(comp)->type == TOKEN_ASSIGN) {
-				parse_assignment(comp);
+typedef struct {
+	bool* spill;
+	bool* deferred;         // Loads emitted at their use
+	int* stack;             // Simulated stack of values
+	int* remaining;         // Uses left for each spilled value
+	uint16_t* free_slots;   // Temporaries free for reuse within a block
+	int free_count;
+} codegen_t;
+
+static bool on_stack(const ssa_program_t* ssa, const codegen_t* cg, int v) {
+	return ssa->values[v].op != OP_PUSH && !cg->deferred[v] && !cg->spill[v];
+}
+
+// How a value finds its operands: the first resident ones are on top of
+// the stack, or (swap) only the second operand of a binary operation is
+typedef struct {
+	int resident;
+	bool swap;
+	bool dup;
+	bool ok;
+} operand_plan_t;
+
+static operand_plan_t plan_operands(ssa_program_t* ssa, const codegen_t* cg, int v) {
+	operand_plan_t plan = { 0, false, false, true };
+	int nargs = ssa->values[v].nargs;
+
+	if (nargs == 2 && ssa_arg(ssa, v, 0) == ssa_arg(ssa, v, 1) && on_stack(ssa, cg, ssa_arg(ssa, v, 0))) {
+		plan.resident = 1;
+		plan.dup = true;
+		return plan;
+	}
+
+	while (plan.resident < nargs && on_stack(ssa, cg, ssa_arg(ssa, v, plan.resident))) {
+		plan.resident++;
+	}
+	for (int i = plan.resident; i < nargs; i++) {
+		if (on_stack(ssa, cg, ssa_arg(ssa, v, i))) {
+			if (nargs == 2 && plan.resident == 0) {
+				plan.resident = 1;
+				plan.swap = true;
 			} else {
-				parse_expression_statement(comp);
-			}
-			break;
-		case TOKEN_LBRACE:
-			consume_token(comp); 
-			while (current_token(comp)->type != TOKEN_RBRACE && 
-				current_token(comp)->type != TOKEN_EOF) {
-				parse_statement(comp);
+				plan.ok = false;
 			}
-			expect_token(comp, TOKEN_RBRACE);
-			break;
-		default:
-			parse_expression_statement(comp);
 			break;
+		}
 	}
+	return plan;
 }
 
-void parse_var_declaration(compiler_t* comp) {
-	expect_token(comp, TOKEN_VAR);
+static bool emitted_at_use(const ssa_program_t* ssa, const codegen_t* cg, int v) {
+	return ssa->values[v].op == OP_PUSH || cg->deferred[v];
+}
 
-	if (current_token(comp)->type != TOKEN_IDENTIFIER) {
-		error(comp, "Expected variable name");
+// Simulate the block's stack; returns false after spilling more values
+static bool schedule_block(ssa_program_t* ssa, codegen_t* cg, int b) {
+	const ssa_block_t* block = &ssa->blocks[b];
+	int depth = 0;
+
+	for (int i = 0; i < block->count; i++) {
+		int v = block->values[i];
+		const ssa_value_t* value = &ssa->values[v];
+		if (emitted_at_use(ssa, cg, v)) continue;
+
+		operand_plan_t plan = plan_operands(ssa, cg, v);
+		bool in_place = plan.ok && depth >= plan.resident;
+		for (int k = 0; in_place && k < plan.resident; k++) {
+			int expected = ssa_arg(ssa, v, plan.swap ? 1 : k);
+			in_place = cg->stack[depth - plan.resident + k] == expected;
+		}
+
+		if (!in_place) {
+			for (int k = 0; k < value->nargs; k++) {
+				int arg = ssa_arg(ssa, v, k);
+				if (on_stack(ssa, cg, arg)) {
+					cg->spill[arg] = true;
+				}
+			}
+			return false;
+		}
+
+		depth -= plan.resident;
+		if (value->has_result && value->uses > 0 && !cg->spill[v]) {
+			cg->stack[depth++] = v;
+		}
 	}
 
-	char var_name[MAX_IDENTIFIER_LEN];
-	strcpy(var_name, current_token(comp)->value);
-	consume_token(comp);
+	if (block->term == TERM_BRANCH && on_stack(ssa, cg, block->cond)) {
+		if (depth == 1 && cg->stack[0] == block->cond) {
+			return true;
+		}
+		cg->spill[block->cond] = true;
+		return false;
+	}
 
-	symbol_t* sym = find_symbol(comp, var_name);
-	if (sym) {
-		error(comp, "Variable already declared");
+	// Anything left over was never taken in place
+	for (int k = 0; k < depth; k++) {
+		cg->spill[cg->stack[k]] = true;
 	}
+	return depth == 0;
+}
 
-	sym = add_symbol(comp, var_name);
+static uint16_t spill_slot(compiler_t* comp, codegen_t* cg, int v) {
+	ssa_value_t* value = &comp->ssa.values[v];
+	if (value->slot == 0) {
+		if (!value->cross_block && cg->free_count > 0) {
+			value->slot = cg->free_slots[--cg->free_count];
+		} else {
+			value->slot = alloc_temp(comp);
+		}
+	}
+	return value->slot;
+}
 
-	if (match_token(comp, TOKEN_ASSIGN)) {
-		parse_expression(comp);
-		char line[MAX_LINE_LEN];
-		snprintf(line, sizeof(line), "STORE 0x%04X", sym->address);
-		emit(comp, line);
-		sym->initialized = true;
+static void emit_operand(compiler_t* comp, codegen_t* cg, int v) {
+	ssa_value_t* value = &comp->ssa.values[v];
+	if (value->op == OP_PUSH) {
+		emit(comp, OP_PUSH, value->imm);
+		return;
+	}
+	if (cg->deferred[v]) {
+		emit(comp, OP_LOAD, value->address);
+		return;
 	}
 
-	expect_token(comp, TOKEN_SEMICOLON);
+	emit(comp, OP_LOAD, spill_slot(comp, cg, v));
+	if (--cg->remaining[v] == 0 && !value->cross_block) {
+		cg->free_slots[cg->free_count++] = value->slot;
+	}
 }
 
-void parse_assignment(compiler_t* comp) {
-	if (current_token(comp)->type != TOKEN_IDENTIFIER) {
-		error(comp, "Expected variable name");
+// A load can move down to its only user if no store to it comes between
+static bool can_defer(const ssa_program_t* ssa, const ssa_block_t* block, int i) {
+	const ssa_value_t* load = &ssa->values[block->values[i]];
+	if (load->op != OP_LOAD || load->uses != 1 || load->cross_block) return false;
+
+	for (int j = i + 1; j < block->count && block->values[j] != load->user; j++) {
+		const ssa_value_t* later = &ssa->values[block->values[j]];
+		if (later->op == OP_STORE && later->address == load->address) return false;
 	}
+	return true;
+}
 
-	char var_name[MAX_IDENTIFIER_LEN];
-	strcpy(var_name, current_token(comp)->value);
-	consume_token(comp);
+static void emit_terminator(compiler_t* comp, codegen_t* cg, int b, int next) {
+	ssa_program_t* ssa = &comp->ssa;
+	const ssa_block_t* block = &ssa->blocks[b];
 
-	symbol_t* sym = find_symbol(comp, var_name);
-	if (!sym) {
-		error(comp, "Undefined variable");
+	switch (block->term) {
+		case TERM_HALT:
+			emit(comp, OP_HALT, 0);
+			break;
+		case TERM_JUMP:
+			if (block->succ[0] != SSA_NONE && block->succ[0] != next) {
+				emit_jump(comp, OP_JMP, ssa->blocks[block->succ[0]].label);
+			}
+			break;
+		case TERM_BRANCH:
+			comp->current_line = ssa->values[block->cond].line;
+			if (!on_stack(ssa, cg, block->cond)) {
+				emit_operand(comp, cg, block->cond);
+			}
+			if (block->succ[1] == next) {
+				emit_jump(comp, OP_JNZ, ssa->blocks[block->succ[0]].label);
+			} else if (block->succ[0] == next) {
+				emit_jump(comp, OP_JZ, ssa->blocks[block->succ[1]].label);
+			} else {
+				emit_jump(comp, OP_JNZ, ssa->blocks[block->succ[0]].label);
+				emit_jump(comp, OP_JMP, ssa->blocks[block->succ[1]].label);
+			}
+			break;
 	}
+}
 
-	expect_token(comp, TOKEN_ASSIGN);
-	parse_expression(comp);
+static void emit_block(compiler_t* comp, codegen_t* cg, int b) {
+	ssa_program_t* ssa = &comp->ssa;
+	const ssa_block_t* block = &ssa->blocks[b];
+
+	for (int i = 0; i < block->count; i++) {
+		int v = block->values[i];
+		if (emitted_at_use(ssa, cg, v)) continue;
+
+		const ssa_value_t* value = &ssa->values[v];
+		comp->current_line = value->line;
+		operand_plan_t plan = plan_operands(ssa, cg, v);
+		if (plan.dup) {
+			emit(comp, OP_DUP, 0);
+		} else if (plan.swap) {
+			emit_operand(comp, cg, ssa_arg(ssa, v, 0));
+			if (!is_commutative(value->op)) {
+				emit(comp, OP_SWAP, 0);
+			}
+		} else {
+			for (int k = plan.resident; k < value->nargs; k++) {
+				emit_operand(comp, cg, ssa_arg(ssa, v, k));
+			}
+		}
 
-	char line[MAX_LINE_LEN];
-	snprintf(line, sizeof(line), "STORE 0x%04X", sym->address);
-	emit(comp, line);
-	sym->initialized = true;
+		switch (value->op) {
+			case OP_LOAD:
+			case OP_STORE:
+				emit(comp, value->op, value->address);
+				break;
+			case OP_IO:
+				emit(comp, OP_IO, value->imm);
+				break;
+			default:
+				emit(comp, value->op, 0);
+				break;
+		}
 
-	expect_token(comp, TOKEN_SEMICOLON);
+		if (value->has_result && value->uses == 0) {
+			emit(comp, OP_POP, 0);
+		} else if (cg->spill[v]) {
+			emit(comp, OP_STORE, spill_slot(comp, cg, v));
+		}
+	}
 }
 
-void parse_if_statement(compiler_t* comp) {
-	expect_token(comp, TOKEN_IF);
-	expect_token(comp, TOKEN_LPAREN);
-
-	parse_expression(comp);
+static void pass_codegen(compiler_t* comp) {
+	ssa_program_t* ssa = &comp->ssa;
+	int count = ssa->value_count ? ssa->value_count : 1;
+	codegen_t cg = {
+		calloc(count, sizeof(bool)),
+		calloc(count, sizeof(bool)),
+		malloc(count * sizeof(int)),
+		malloc(count * sizeof(int)),
+		malloc(count * sizeof(uint16_t)),
+		0
+	};
+	if (!cg.spill || !cg.deferred || !cg.stack || !cg.remaining || !cg.free_slots) {
+		error(comp, "Out of memory in code generation");
+	}
 
-	expect_token(comp, TOKEN_RPAREN);
+	ssa_count_uses(ssa);
 
-	
-	int if_id = comp->label_counter;
-	char else_label[32], end_label[32];
-	snprintf(else_label, sizeof(else_label), "IF_ELSE_%d", if_id);
-	snprintf(end_label, sizeof(end_label), "IF_END_%d", if_id);
-	comp->label_counter += 2; 
+	for (int b = 0; b < ssa->block_count; b++) {
+		const ssa_block_t* block = &ssa->blocks[b];
+		for (int i = 0; i < block->count; i++) {
+			cg.deferred[block->values[i]] = can_defer(ssa, block, i);
+		}
+	}
 
-	char line[MAX_LINE_LEN];
-	snprintf(line, sizeof(line), "JZ %s", else_label);
-	emit(comp, line);
+	for (int v = 0; v < ssa->value_count; v++) {
+		ssa_value_t* value = &ssa->values[v];
+		value->slot = 0;
+		cg.remaining[v] = value->uses;
+		if (value->block == SSA_NONE || emitted_at_use(ssa, &cg, v) || !value->has_result || value->uses == 0) {
+			continue;
+		}
 
-	parse_statement(comp);
+		// Only one user in the same block can take a value off the stack
+		const ssa_value_t* user = value->user >= 0 ? &ssa->values[value->user] : NULL;
+		bool dup_user = value->uses == 2 && user && user->nargs == 2 &&
+			ssa_resolve(ssa, user->args[0]) == v && ssa_resolve(ssa, user->args[1]) == v;
+		cg.spill[v] = value->cross_block || (value->uses > 1 && !dup_user);
+	}
 
-	if (current_token(comp)->type == TOKEN_ELSE) {
-		consume_token(comp);
-		snprintf(line, sizeof(line), "JMP %s", end_label);
-		emit(comp, line);
-		emit_label(comp, else_label);
-		parse_statement(comp);
-		emit_label(comp, end_label);
-	} else {
-		emit_label(comp, else_label);
+	for (int b = 0; b < ssa->block_count; b++) {
+		ssa->blocks[b].label = ssa->blocks[b].reachable ? new_label(comp) : SSA_NONE;
 	}
-}
 
-void parse_while_statement(compiler_t* comp) {
-	expect_token(comp, TOKEN_WHILE);
-	expect_token(comp, TOKEN_LPAREN);
+	for (int b = 0; b < ssa->block_count; b++) {
+		if (!ssa->blocks[b].reachable) continue;
 
-	char* loop_start = new_label(comp);
-	char* loop_end = new_label(comp);
+		while (!schedule_block(ssa, &cg, b)) {
+		}
 
-	emit_label(comp, loop_start);
+		int next = b + 1;
+		while (next < ssa->block_count && !ssa->blocks[next].reachable) next++;
 
-	parse_expression(comp);
+		emit_label(comp, ssa->blocks[b].label);
+		emit_block(comp, &cg, b);
+		emit_terminator(comp, &cg, b, next);
+	}
 
-	expect_token(comp, TOKEN_RPAREN);
+	free(cg.spill);
+	free(cg.deferred);
+	free(cg.stack);
+	free(cg.remaining);
+	free(cg.free_slots);
+}
 
-	char line[MAX_LINE_LEN];
-	snprintf(line, sizeof(line), "JZ %s", loop_end);
-	emit(comp, line);
+static void free_ssa(compiler_t* comp) {
+	ssa_program_t* ssa = &comp->ssa;
+	for (int b = 0; b < ssa->block_count; b++) {
+		free(ssa->blocks[b].values);
+	}
+	free(ssa->blocks);
+	free(ssa->values);
+	free(ssa->loops);
+	memset(ssa, 0, sizeof(ssa_program_t));
+}
 
-	parse_statement(comp);
+/*
+ * Pass pipeline
+ *
+ * Passes run in table order; -O<n> runs every pass whose level is at most
+ * n. The statement tree passes come before "lower", the SSA passes after
+ * it, "peephole" cleans up the generated stack code and "relax" picks
+ * short or long branches.
+ */
 
-	snprintf(line, sizeof(line), "JMP %s", loop_start);
-	emit(comp, line);
+typedef struct {
+	const char* name;
+	int level;              // Lowest -O level that runs the pass
+	void (*run)(compiler_t* comp);
+} pass_t;
+
+static const pass_t pass_pipeline[] = {
+	{ "unroll",    2, pass_unroll },
+	{ "lower",     0, pass_lower },
+	{ "promote",   1, pass_promote },
+	{ "constprop", 1, pass_constprop },
+	{ "cse",       2, pass_cse },
+	{ "constprop", 2, pass_constprop },
+	{ "licm",      2, pass_licm },
+	{ "strength",  1, pass_strength },
+	{ "cfg",       1, pass_cfg },
+	{ "dse",       1, pass_dse },
+	{ "dce",       1, pass_dce },
+	{ "codegen",   0, pass_codegen },
+	{ "peephole",  1, optimize_peephole },
+	{ "relax",     1, pass_relax },
+};
+
+#define PASS_COUNT ((int)(sizeof(pass_pipeline) / sizeof(pass_pipeline[0])))
+
+static void run_pipeline(compiler_t* comp) {
+	double elapsed[PASS_COUNT];
+
+	for (int p = 0; p < PASS_COUNT; p++) {
+		elapsed[p] = -1.0;
+		if (pass_pipeline[p].level > comp->opt_level) continue;
+
+		clock_t start = clock();
+		pass_pipeline[p].run(comp);
+		if (comp->ssa.block_count > 0) {
+			ssa_compact(&comp->ssa);
+		}
+		elapsed[p] = (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC;
 
-	emit_label(comp, loop_end);
-}
+		if (pass_pipeline[p].run == pass_lower) {
+			printf("Lowered to %d SSA values in %d blocks\n", comp->ssa.value_count, comp->ssa.block_count);
+		} else if (pass_pipeline[p].run == pass_codegen) {
+			printf("Generated %d IR instructions\n", comp->code.count);
+		}
+	}
 
-void parse_expression_statement(compiler_t* comp) {
-	if (current_token(comp)->type != TOKEN_SEMICOLON) {
-		parse_expression(comp);
-		
+	if (comp->time_passes) {
+		double total = 0.0;
+		printf("Pass timings (-O%d):\n", comp->opt_level);
+		for (int p = 0; p < PASS_COUNT; p++) {
+			if (elapsed[p] < 0.0) continue;
+			printf("  %-10s %9.3f ms\n", pass_pipeline[p].name, elapsed[p]);
+			total += elapsed[p];
+		}
+		printf("  %-10s %9.3f ms\n", "total", total);
 	}
-	expect_token(comp, TOKEN_SEMICOLON);
 }
 
-void parse_expression(compiler_t* comp) {
-	parse_comparison(comp);
+expr_t* parse_expression(compiler_t* comp) {
+	return parse_comparison(comp);
 }
 
-void parse_comparison(compiler_t* comp) {
-	parse_term(comp);
+expr_t* parse_comparison(compiler_t* comp) {
+	expr_t* expr = parse_term(comp);
 
 	while (true) {
 		token_type_t op = current_token(comp)->type;
@@ -525,156 +3202,148 @@ void parse_comparison(compiler_t* comp) {
 			op == TOKEN_LESS_EQUAL || op == TOKEN_GREATER_EQUAL) {
 
 			consume_token(comp);
-			parse_term(comp);
+			expr_t* right = parse_term(comp);
 
 			switch (op) {
-				case TOKEN_EQUALS: emit(comp, "EQ"); break;
-				case TOKEN_NOT_EQUALS: emit(comp, "NEQ"); break;
-				case TOKEN_LESS: emit(comp, "LT"); break;
-				case TOKEN_GREATER: emit(comp, "GT"); break;
-				case TOKEN_LESS_EQUAL: emit(comp, "LTE"); break;
-				case TOKEN_GREATER_EQUAL: emit(comp, "GTE"); break;
+				case TOKEN_EQUALS: expr = make_binary(comp, OP_EQ, expr, right); break;
+				case TOKEN_NOT_EQUALS: expr = make_binary(comp, OP_NEQ, expr, right); break;
+				case TOKEN_LESS: expr = make_binary(comp, OP_LT, expr, right); break;
+				case TOKEN_GREATER: expr = make_binary(comp, OP_GT, expr, right); break;
+				case TOKEN_LESS_EQUAL: expr = make_binary(comp, OP_LTE, expr, right); break;
+				case TOKEN_GREATER_EQUAL: expr = make_binary(comp, OP_GTE, expr, right); break;
 				default: break;
 			}
 		} else {
 			break;
 		}
 	}
+	return expr;
 }
 
-void parse_term(compiler_t* comp) {
-	parse_multiplicative(comp);
+expr_t* parse_term(compiler_t* comp) {
+	expr_t* expr = parse_multiplicative(comp);
 
 	while (current_token(comp)->type == TOKEN_PLUS || 
 		current_token(comp)->type == TOKEN_MINUS) {
 		token_type_t op = current_token(comp)->type;
 		consume_token(comp);
-		parse_multiplicative(comp);
+		expr_t* right = parse_multiplicative(comp);
 
 		if (op == TOKEN_PLUS) {
-			emit(comp, "ADD");
+			expr = make_binary(comp, OP_ADD, expr, right);
 		} else {
-			emit(comp, "SUB");
+			expr = make_binary(comp, OP_SUB, expr, right);
 		}
 	}
+	return expr;
 }
 
-void parse_factor(compiler_t* comp) {
+expr_t* parse_factor(compiler_t* comp) {
 	token_t* tok = current_token(comp);
 
 	if (tok->type == TOKEN_EOF) {
 		error(comp, "Unexpected end of file");
-		return;
+		return NULL;
 	}
 
 	if (tok->type == TOKEN_NUMBER) {
-		char line[MAX_LINE_LEN];
-		snprintf(line, sizeof(line), "PUSH %s", tok->value);
-		emit(comp, line);
+		// Literals wrap to 8 bits, as the VM only pushes bytes
+		expr_t* expr = make_const(comp, (uint8_t)strtol(tok->start, NULL, 10));
 		consume_token(comp);
+		return expr;
 	}
 	else if (tok->type == TOKEN_IDENTIFIER) {
-		char name[MAX_IDENTIFIER_LEN];
-		strcpy(name, tok->value);
+		token_t name = *tok;
 		consume_token(comp);
 
 		if (current_token(comp)->type == TOKEN_LPAREN) {
 			
-			parse_function_call(comp, name);
+			return parse_function_call(comp, &name);
 		} else {
 			
-			symbol_t* sym = find_symbol(comp, name);
+			symbol_t* sym = find_symbol(comp, name.start, name.length);
 			if (!sym) {
 				char error_msg[MAX_LINE_LEN];
-				snprintf(error_msg, sizeof(error_msg), "Undefined variable '%s'", name);
+				snprintf(error_msg, sizeof(error_msg), "Undefined variable '%.*s'", name.length, name.start);
 				error(comp, error_msg);
 			}
 
-			char line[MAX_LINE_LEN];
-			snprintf(line, sizeof(line), "LOAD 0x%04X", sym->address);
-			emit(comp, line);
+			expr_t* expr = new_expr(comp, EXPR_VAR);
+			expr->address = sym->address;
+			return expr;
 		}
 	}
 	else if (tok->type == TOKEN_LPAREN) {
 		consume_token(comp);
-		parse_expression(comp);
+		expr_t* expr = parse_expression(comp);
 		expect_token(comp, TOKEN_RPAREN);
+		return expr;
 	}
 	else {
 		char error_msg[MAX_LINE_LEN];
 		snprintf(error_msg, sizeof(error_msg), "Expected number, variable, or expression, got token type %d", tok->type);
 		error(comp, error_msg);
+		return NULL;
 	}
 }
 
-void parse_multiplicative(compiler_t* comp) {
-	parse_factor(comp);
+expr_t* parse_multiplicative(compiler_t* comp) {
+	expr_t* expr = parse_factor(comp);
 
 	while (current_token(comp)->type == TOKEN_MULTIPLY || 
-		current_token(comp)->type == TOKEN_DIVIDE) {
+		current_token(comp)->type == TOKEN_DIVIDE ||
+		current_token(comp)->type == TOKEN_MODULO) {
 		token_type_t op = current_token(comp)->type;
 		consume_token(comp);
-		parse_factor(comp);
+		expr_t* right = parse_factor(comp);
 
 		if (op == TOKEN_MULTIPLY) {
-			emit(comp, "MUL");
+			expr = make_binary(comp, OP_MUL, expr, right);
+		} else if (op == TOKEN_DIVIDE) {
+			expr = make_binary(comp, OP_DIV, expr, right);
 		} else {
-			emit(comp, "DIV");
+			expr = make_binary(comp, OP_MOD, expr, right);
 		}
 	}
+	return expr;
 }
 
-void parse_function_call(compiler_t* comp, const char* func_name) {
-	if (!is_builtin_function(func_name)) {
+expr_t* parse_function_call(compiler_t* comp, const token_t* func_name) {
+	if (!is_builtin_function(func_name->start, func_name->length)) {
 		char error_msg[MAX_LINE_LEN];
-		snprintf(error_msg, sizeof(error_msg), "Unknown function '%s'", func_name);
+		snprintf(error_msg, sizeof(error_msg), "Unknown function '%.*s'", func_name->length, func_name->start);
 		error(comp, error_msg);
 	}
 
 	expect_token(comp, TOKEN_LPAREN);
 
-	int arg_count = 0;
+	expr_t* call = new_expr(comp, EXPR_CALL);
+	expr_t** tail = &call->args;
 
 	
 	if (current_token(comp)->type != TOKEN_RPAREN && current_token(comp)->type != TOKEN_EOF) {
-		parse_expression(comp);
-		arg_count++;
+		*tail = parse_expression(comp);
+		tail = &(*tail)->next;
 
 		while (match_token(comp, TOKEN_COMMA)) {
 			if (current_token(comp)->type == TOKEN_RPAREN || current_token(comp)->type == TOKEN_EOF) {
 				error(comp, "Expected expression after comma");
 			}
-			parse_expression(comp);
-			arg_count++;
+			*tail = parse_expression(comp);
+			tail = &(*tail)->next;
 		}
 	}
 
 	expect_token(comp, TOKEN_RPAREN);
 
-	
-	int syscall_id = get_builtin_syscall(func_name);
-	if (syscall_id >= 0) {
-		char line[MAX_LINE_LEN];
-
-		if (strcmp(func_name, "halt") == 0) {
-			emit(comp, "SYS 0x00");
-			emit(comp, "HALT");
-		} else {
-			snprintf(line, sizeof(line), "SYS 0x%02X", syscall_id);
-			emit(comp, line);
-			
-			
-			if (strcmp(func_name, "read_char") == 0) {
-				// read_char pushes the read character onto the stack
-				// So we need to account for this in expression parsing
-			}
-			// Graphics calls like draw_pixel, draw_line, etc. consume stack but don't push
-			// No additional stack manipulation needed
-		}
-	}
+	// read_char pushes the character read; the graphics calls only consume
+	// their arguments. halt() also stops the VM if the exit call returns.
+	call->op = (uint8_t)get_builtin_syscall(func_name->start, func_name->length);
+	call->halts = call->op == IO_EXIT;
+	return call;
 }
 
-int compile_file(const char* input_file, const char* output_file) {
+int compile_file(const char* input_file, const char* output_file, const compile_options_t* options) {
 	if (!input_file || !output_file) {
 		fprintf(stderr, "Error: NULL file path provided\n");
 		return 1;
@@ -712,6 +3381,31 @@ int compile_file(const char* input_file, const char* output_file) {
 	source[bytes_read] = '\0';
 	fclose(input);
 
+	// Binary images and objects are cached by content; kxasm source output is
+	// not. The .dbg names the source file, so -g builds also key on its path
+	uint64_t cache_key = 0;
+	int unroll_factor = options->unroll_factor > 0 ? options->unroll_factor : UNROLL_DEFAULT;
+	if (!options->emit_assembly) {
+		struct {
+			int settings[4];
+			char source_path[BUILD_CACHE_MAX_PATH];
+		} key_options;
+		memset(&key_options, 0, sizeof(key_options));
+		key_options.settings[0] = options->opt_level;
+		key_options.settings[1] = unroll_factor;
+		key_options.settings[2] = options->emit_object;
+		key_options.settings[3] = options->debug_info;
+		if (options->debug_info) {
+			snprintf(key_options.source_path, sizeof(key_options.source_path), "%s", input_file);
+		}
+		cache_key = build_cache_key(TINYC_BUILD_ID, &key_options, sizeof(key_options), source, bytes_read);
+		if (write_cached_image(cache_key, bytes_read, output_file, options->debug_info)) {
+			printf("Compilation successful: %s -> %s\n", input_file, output_file);
+			free(source);
+			return 0;
+		}
+	}
+
 	
 	
 	printf("Allocating compiler structure...\n");
@@ -725,34 +3419,94 @@ int compile_file(const char* input_file, const char* output_file) {
 	
 	comp->next_var_addr = VAR_START_ADDR;
 	comp->current_line = 1;
+	comp->unroll_factor = unroll_factor;
+	comp->opt_level = options->opt_level;
+	comp->time_passes = options->time_passes;
+	comp->emit_object = options->emit_object;
 
 	
-	printf("Tokenizing...\n");
-	tokenize(comp, source);
-	printf("Generated %d tokens\n", comp->token_count);
+	init_lexer(comp, source);
 
-	
-	printf("Parsing and generating code...\n");
+	printf("Parsing...\n");
 	parse_program(comp);
-	printf("Generated %d lines of assembly\n", comp->output_count);
+	printf("Scanned %d tokens\n", comp->lexer.token_count);
+
+	run_pipeline(comp);
+	if (comp->unrolled_count > 0) {
+		printf("Unrolled %d counted loops\n", comp->unrolled_count);
+	}
+	if (comp->phi_count > 0) {
+		printf("Placed %d phis\n", comp->phi_count);
+	}
+	if (comp->cse_count > 0) {
+		printf("Eliminated %d common subexpressions\n", comp->cse_count);
+	}
+	if (comp->hoisted_count > 0) {
+		printf("Hoisted %d loop-invariant expressions\n", comp->hoisted_count);
+	}
+	if (comp->reduced_count > 0) {
+		printf("Strength-reduced %d operations\n", comp->reduced_count);
+	}
+	if (comp->dead_store_count > 0) {
+		printf("Removed %d dead stores\n", comp->dead_store_count);
+	}
+	if (comp->opt_level > 0) {
+		printf("Peephole optimizer: %d IR instructions\n", comp->code.count);
+		print_peephole_stats(comp);
+		printf("Relaxed %d of %d branches to short form, saving %d bytes\n",
+		       comp->relaxed_count, comp->branch_count, comp->relaxed_count);
+	}
 
 	
-	FILE* output = fopen(output_file, "w");
+	bool placed = place_data(comp);
+	FILE* output = placed ? fopen(output_file, options->emit_assembly ? "w" : "wb") : NULL;
 	if (!output) {
-		fprintf(stderr, "Error: Cannot create output file '%s'\n", output_file);
+		if (placed) {
+			fprintf(stderr, "Error: Cannot create output file '%s'\n", output_file);
+		}
 		free(source);
+		free(comp->code.insns);
+		free_ssa(comp);
+		arena_free(&comp->expr_arena);
+		free_symbols(comp);
 		free(comp);
 		return 1;
 	}
 
-	for (int i = 0; i < comp->output_count; i++) {
-		fprintf(output, "%s\n", comp->output[i]);
+	bool ok = true;
+	if (options->emit_assembly) {
+		write_assembly(comp, output);
+	} else {
+		uint32_t size = 0;
+		uint8_t* image = options->emit_object ? build_object(comp, &size) : build_image(comp, &size, NULL);
+		ok = image && fwrite(image, 1, size, output) == size;
+		uint8_t* debug = NULL;
+		uint32_t debug_size = 0;
+		if (ok && options->debug_info) {
+			debug = write_debug_info(comp, input_file, output_file, image, size, &debug_size);
+			ok = debug != NULL;
+		}
+		if (ok) {
+			// A failed store only costs a rebuild
+			build_cache_store(cache_key, bytes_read, image, size, debug, debug_size);
+		}
+		free(debug);
+		free(image);
 	}
 
 	fclose(output);
 	free(source);
+	free(comp->code.insns);
+	free_ssa(comp);
+	arena_free(&comp->expr_arena);
+	free_symbols(comp);
 	free(comp);  
 
+	if (!ok) {
+		fprintf(stderr, "Error: Failed to write '%s'\n", output_file);
+		return 1;
+	}
+
 	printf("Compilation successful: %s -> %s\n", input_file, output_file);
 	return 0;
 }
@@ -774,12 +3528,55 @@ bool is_valid_string(const char* str, size_t max_len) {
 	return false; 
 }
 
+// Output format follows -S or -c, or the .asm or .kxo extension of the output file
+static bool has_extension(const char* output_file, const char* extension) {
+	size_t len = strlen(output_file);
+	return len >= 4 && strcmp(output_file + len - 4, extension) == 0;
+}
+
 int main(int argc, char* argv[]) {
-	if (argc != 3) {
-		printf("TinyC Compiler v1.0\n");
-		printf("Usage: %s <input.tc> <output.asm>\n", argv[0] ? argv[0] : "compiler");
+	compile_options_t options = {0};
+	options.opt_level = 2;
+	bool force_assembly = false;
+	bool force_object = false;
+
+	int argi = 1;
+	while (argi < argc && argv[argi] && argv[argi][0] == '-') {
+		if (strcmp(argv[argi], "-S") == 0) {
+			force_assembly = true;
+		} else if (strcmp(argv[argi], "-c") == 0) {
+			force_object = true;
+		} else if (strcmp(argv[argi], "-T") == 0) {
+			options.time_passes = true;
+		} else if (strcmp(argv[argi], "-g") == 0) {
+			options.debug_info = true;
+		} else if (strncmp(argv[argi], "-O", 2) == 0 && argv[argi][2] >= '0' && argv[argi][2] <= '2' && !argv[argi][3]) {
+			options.opt_level = argv[argi][2] - '0';
+		} else if (strcmp(argv[argi], "-u") == 0 && argi + 1 < argc) {
+			options.unroll_factor = atoi(argv[++argi]);
+			if (options.unroll_factor < 1) {
+				fprintf(stderr, "Error: Unroll factor must be at least 1\n");
+				return 1;
+			}
+		} else {
+			fprintf(stderr, "Error: Unknown option '%s'\n", argv[argi]);
+			return 1;
+		}
+		argi++;
+	}
+
+	if (argc - argi != 2) {
+		printf("TinyC Compiler v%s\n", TINYC_VERSION);
+		printf("Usage: %s [-S|-c] [-g] [-O0|-O1|-O2] [-T] [-u factor] <input.tc> <output.bin|output.asm|output.kxo>\n", argv[0] ? argv[0] : "compiler");
+		printf("  -S         Write kxasm source instead of a binary (implied by a .asm output)\n");
+		printf("  -c         Write an object module for kxld (implied by a .kxo output)\n");
+		printf("  -g         Write a .dbg file with line numbers and variables for kxn\n");
+		printf("  -O level   0: direct translation, 1: folding and cleanup, 2: all passes (default)\n");
+		printf("  -T         Print the time spent in each pass\n");
+		printf("  -u factor  Unroll counted loops up to factor times (default %d, 1 disables)\n", UNROLL_DEFAULT);
 		return 1;
 	}
+	argv += argi - 1;
 
 	
 	if (!argv[1] || !argv[2]) {
@@ -820,5 +3617,16 @@ int main(int argc, char* argv[]) {
 	printf("Input file: '%s' (length: %zu)\n", input_file, strlen(input_file));
 	printf("Output file: '%s' (length: %zu)\n", output_file, strlen(output_file));
 
-	return compile_file(input_file, output_file);
+	options.emit_assembly = force_assembly || has_extension(output_file, ".asm");
+	options.emit_object = force_object || has_extension(output_file, ".kxo");
+	if (options.emit_assembly && options.emit_object) {
+		fprintf(stderr, "Error: Choose either kxasm source or an object module\n");
+		return 1;
+	}
+	if (options.debug_info && (options.emit_assembly || options.emit_object)) {
+		fprintf(stderr, "Error: -g needs a program image; kxasm source and objects have no final addresses\n");
+		return 1;
+	}
+
+	return compile_file(input_file, output_file, &options);
 }
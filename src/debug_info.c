@@ -0,0 +1,409 @@
+/**
+ * Debug info files for KXN program images
+ * Written by tinyc and kxasm, read by kxn. See debug_info.h for the layout.
+ */
+
+#include "debug_info.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define KXD_HEADER_SIZE 20
+
+static void put16(uint8_t* p, uint16_t value) {
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+}
+
+static void put32(uint8_t* p, uint32_t value) {
+    put16(p, value & 0xFFFF);
+    put16(p + 2, (value >> 16) & 0xFFFF);
+}
+
+static uint16_t get16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get32(const uint8_t* p) {
+    return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+/**
+ * Make room for one more element in a doubling array
+ */
+static bool grow(void** items, int count, int* capacity, size_t size) {
+    if (count < *capacity) {
+        return true;
+    }
+
+    int grown = *capacity ? *capacity * 2 : 16;
+    void* resized = realloc(*items, grown * size);
+    if (!resized) {
+        return false;
+    }
+    *items = resized;
+    *capacity = grown;
+    return true;
+}
+
+static uint8_t* put_uleb(uint8_t* p, uint32_t value) {
+    do {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        *p++ = value ? byte | 0x80 : byte;
+    } while (value);
+    return p;
+}
+
+static uint8_t* put_sleb(uint8_t* p, int64_t value) {
+    for (;;) {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        if ((value == 0 && !(byte & 0x40)) || (value == -1 && (byte & 0x40))) {
+            *p++ = byte;
+            return p;
+        }
+        *p++ = byte | 0x80;
+    }
+}
+
+// LEB128 readers return NULL when the value runs past end or overflows
+static const uint8_t* get_uleb(const uint8_t* p, const uint8_t* end, uint32_t* value) {
+    uint32_t result = 0;
+    for (int shift = 0; p < end && shift < 35; shift += 7) {
+        uint8_t byte = *p++;
+        result |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static const uint8_t* get_sleb(const uint8_t* p, const uint8_t* end, int64_t* value) {
+    int64_t result = 0;
+    for (int shift = 0; p < end && shift < 42; shift += 7) {
+        uint8_t byte = *p++;
+        result |= (int64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            if (byte & 0x40) {
+                result -= (int64_t)1 << (shift + 7);
+            }
+            *value = result;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// FNV-1a
+static uint32_t hash_image(const uint8_t* image, uint32_t size) {
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < size; i++) {
+        hash ^= image[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void kxd_init(kxd_info_t* info) {
+    memset(info, 0, sizeof(kxd_info_t));
+}
+
+void kxd_free(kxd_info_t* info) {
+    for (int i = 0; i < info->symbol_count; i++) {
+        free(info->symbols[i].name);
+    }
+    free(info->symbols);
+    free(info->lines);
+    free(info->source);
+    kxd_init(info);
+}
+
+void kxd_set_image(kxd_info_t* info, const uint8_t* image, uint32_t size) {
+    info->image_size = size;
+    info->image_hash = hash_image(image, size);
+}
+
+bool kxd_matches_image(const kxd_info_t* info, const uint8_t* image, uint32_t size) {
+    return info->image_size == size && info->image_hash == hash_image(image, size);
+}
+
+bool kxd_set_source(kxd_info_t* info, const char* source) {
+    size_t len = strlen(source);
+    if (len > 0xFFFF) {
+        len = 0xFFFF;
+    }
+
+    char* copy = malloc(len + 1);
+    if (!copy) {
+        return false;
+    }
+    memcpy(copy, source, len);
+    copy[len] = '\0';
+    free(info->source);
+    info->source = copy;
+    return true;
+}
+
+bool kxd_add_symbol(kxd_info_t* info, const char* name, size_t len, uint16_t address, uint8_t kind) {
+    if (!grow((void**)&info->symbols, info->symbol_count, &info->symbol_capacity, sizeof(kxd_symbol_t))) {
+        return false;
+    }
+    if (len > 0xFF) {
+        len = 0xFF;
+    }
+
+    char* copy = malloc(len + 1);
+    if (!copy) {
+        return false;
+    }
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+
+    kxd_symbol_t* sym = &info->symbols[info->symbol_count++];
+    sym->name = copy;
+    sym->address = address;
+    sym->kind = kind;
+    return true;
+}
+
+bool kxd_add_line(kxd_info_t* info, uint16_t pc, uint32_t line) {
+    if (info->line_count > 0) {
+        kxd_line_t* last = &info->lines[info->line_count - 1];
+        if (last->line == line) {
+            return true;
+        }
+        if (last->pc == pc) {
+            info->line_count--;
+            if (info->line_count > 0 && info->lines[info->line_count - 1].line == line) {
+                return true;
+            }
+        }
+    }
+
+    if (!grow((void**)&info->lines, info->line_count, &info->line_capacity, sizeof(kxd_line_t))) {
+        return false;
+    }
+    info->lines[info->line_count].pc = pc;
+    info->lines[info->line_count].line = line;
+    info->line_count++;
+    return true;
+}
+
+static int compare_symbols(const void* a, const void* b) {
+    const kxd_symbol_t* sa = a;
+    const kxd_symbol_t* sb = b;
+    if (sa->address != sb->address) {
+        return sa->address < sb->address ? -1 : 1;
+    }
+    return strcmp(sa->name, sb->name);
+}
+
+uint8_t* kxd_encode(kxd_info_t* info, uint32_t* size) {
+    if (info->symbol_count > 0xFFFF) {
+        return NULL;
+    }
+    qsort(info->symbols, info->symbol_count, sizeof(kxd_symbol_t), compare_symbols);
+
+    size_t source_len = info->source ? strlen(info->source) : 0;
+    size_t total = KXD_HEADER_SIZE + source_len;
+    for (int i = 0; i < info->symbol_count; i++) {
+        total += 4 + strlen(info->symbols[i].name);
+    }
+    total += (size_t)info->line_count * (3 + 5);    // Worst-case LEB128 sizes
+
+    uint8_t* out = malloc(total);
+    if (!out) {
+        return NULL;
+    }
+
+    memcpy(out, KXD_MAGIC, 4);
+    put32(out + 4, info->image_size);
+    put32(out + 8, info->image_hash);
+    put16(out + 12, (uint16_t)info->symbol_count);
+    put32(out + 14, (uint32_t)info->line_count);
+    put16(out + 18, (uint16_t)source_len);
+    uint8_t* p = out + KXD_HEADER_SIZE;
+    memcpy(p, info->source, source_len);
+    p += source_len;
+
+    for (int i = 0; i < info->symbol_count; i++) {
+        const kxd_symbol_t* sym = &info->symbols[i];
+        size_t len = strlen(sym->name);
+        put16(p, sym->address);
+        p[2] = sym->kind;
+        p[3] = (uint8_t)len;
+        memcpy(p + 4, sym->name, len);
+        p += 4 + len;
+    }
+
+    uint16_t pc = 0;
+    uint32_t line = 0;
+    for (int i = 0; i < info->line_count; i++) {
+        p = put_uleb(p, (uint32_t)(info->lines[i].pc - pc));
+        p = put_sleb(p, (int64_t)info->lines[i].line - line);
+        pc = info->lines[i].pc;
+        line = info->lines[i].line;
+    }
+
+    *size = (uint32_t)(p - out);
+    return out;
+}
+
+bool kxd_write(kxd_info_t* info, const char* path) {
+    uint32_t size = 0;
+    uint8_t* data = kxd_encode(info, &size);
+    bool ok = data && kxd_write_encoded(data, size, path);
+    free(data);
+    return ok;
+}
+
+bool kxd_write_encoded(const uint8_t* data, uint32_t size, const char* path) {
+    FILE* file = fopen(path, "wb");
+    bool ok = file && fwrite(data, 1, size, file) == size;
+    if (file && fclose(file) != 0) {
+        ok = false;
+    }
+    return ok;
+}
+
+static const char* decode(kxd_info_t* info, const uint8_t* data, size_t size) {
+    if (size < KXD_HEADER_SIZE || memcmp(data, KXD_MAGIC, 4) != 0) {
+        return "not a KXN debug info file";
+    }
+
+    info->image_size = get32(data + 4);
+    info->image_hash = get32(data + 8);
+    uint16_t symbol_count = get16(data + 12);
+    uint32_t line_count = get32(data + 14);
+    uint16_t source_len = get16(data + 18);
+    const uint8_t* p = data + KXD_HEADER_SIZE;
+    const uint8_t* end = data + size;
+    if ((size_t)(end - p) < source_len) {
+        return "truncated debug info";
+    }
+
+    info->source = malloc(source_len + 1);
+    if (!info->source) {
+        return "out of memory";
+    }
+    memcpy(info->source, p, source_len);
+    info->source[source_len] = '\0';
+    p += source_len;
+
+    for (int i = 0; i < symbol_count; i++) {
+        if (end - p < 4 || end - p - 4 < p[3]) {
+            return "truncated debug info";
+        }
+        if (p[2] != KXD_SYMBOL_CODE && p[2] != KXD_SYMBOL_DATA) {
+            return "symbol of an unknown kind";
+        }
+        if (!kxd_add_symbol(info, (const char*)p + 4, p[3], get16(p), p[2])) {
+            return "out of memory";
+        }
+        if (i > 0 && info->symbols[i].address < info->symbols[i - 1].address) {
+            return "symbols out of order";
+        }
+        p += 4 + p[3];
+    }
+
+    // Every entry takes at least two bytes
+    if (line_count > (size_t)(end - p) / 2) {
+        return "truncated debug info";
+    }
+    info->lines = malloc((line_count ? line_count : 1) * sizeof(kxd_line_t));
+    if (!info->lines) {
+        return "out of memory";
+    }
+    info->line_capacity = (int)line_count;
+
+    uint32_t pc = 0;
+    int64_t line = 0;
+    for (uint32_t i = 0; i < line_count; i++) {
+        uint32_t pc_delta;
+        int64_t line_delta;
+        if (!(p = get_uleb(p, end, &pc_delta)) || !(p = get_sleb(p, end, &line_delta))) {
+            return "truncated debug info";
+        }
+        pc += pc_delta;
+        line += line_delta;
+        if (pc > 0xFFFF || (i > 0 && pc_delta == 0) || line < 1 || line > UINT32_MAX) {
+            return "invalid line table";
+        }
+        info->lines[i].pc = (uint16_t)pc;
+        info->lines[i].line = (uint32_t)line;
+        info->line_count++;
+    }
+    return p == end ? NULL : "trailing data in debug info";
+}
+
+const char* kxd_load(kxd_info_t* info, const char* path) {
+    kxd_init(info);
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return "cannot open file";
+    }
+
+    uint8_t* data = NULL;
+    long len = -1;
+    if (fseek(file, 0, SEEK_END) == 0 && (len = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+        data = malloc(len ? len : 1);
+    }
+    if (data && fread(data, 1, len, file) != (size_t)len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    if (!data) {
+        return "cannot read file";
+    }
+
+    const char* problem = decode(info, data, (size_t)len);
+    free(data);
+    return problem;
+}
+
+const kxd_symbol_t* kxd_symbol_at(const kxd_info_t* info, uint16_t pc) {
+    // Last symbol at or below pc, then back to the nearest code symbol
+    int lo = 0;
+    int hi = info->symbol_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (info->symbols[mid].address <= pc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (int i = lo - 1; i >= 0; i--) {
+        if (info->symbols[i].kind == KXD_SYMBOL_CODE) {
+            return &info->symbols[i];
+        }
+    }
+    return NULL;
+}
+
+uint32_t kxd_line_at(const kxd_info_t* info, uint16_t pc) {
+    int lo = 0;
+    int hi = info->line_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (info->lines[mid].pc <= pc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo > 0 ? info->lines[lo - 1].line : 0;
+}
+
+bool kxd_path(const char* image_path, char* path, size_t size) {
+    const char* base = strrchr(image_path, '/');
+    const char* dot = strrchr(base ? base + 1 : image_path, '.');
+    size_t stem = dot && dot != (base ? base + 1 : image_path) ? (size_t)(dot - image_path) : strlen(image_path);
+
+    int written = snprintf(path, size, "%.*s.dbg", (int)stem, image_path);
+    return written >= 0 && (size_t)written < size;
+}
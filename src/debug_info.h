@@ -0,0 +1,177 @@
+#ifndef DEBUG_INFO_H
+#define DEBUG_INFO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Debug info for a program image (.dbg)
+ *
+ * Written next to the image by tinyc -g and kxasm -g and loaded by kxn, so
+ * errors, profiles and traces can name the label and source line of a pc.
+ *
+ * File layout, all fields little-endian:
+ *   header   "KXD1", image size (4), image hash (4), symbol count (2),
+ *            line entry count (4), source name length (2), source name
+ *   symbols  address (2), kind (1), name length (1), name
+ *   lines    pc delta (ULEB128), line delta (SLEB128) per entry
+ *
+ * Symbols are sorted by address. A line entry says that code from its pc
+ * up to the next entry's pc came from that source line; deltas are taken
+ * from the previous entry, starting at pc 0 and line 0.
+ *
+ * The image size and FNV-1a hash tie the file to the image it describes,
+ * so a .dbg left behind by an earlier build is recognized and ignored.
+ */
+
+#define KXD_MAGIC "KXD1"
+
+typedef enum {
+    KXD_SYMBOL_CODE = 1,    // Label or other code address
+    KXD_SYMBOL_DATA = 2     // Variable or .data reservation
+} kxd_symbol_kind_t;
+
+typedef struct {
+    char* name;
+    uint16_t address;
+    uint8_t kind;           // kxd_symbol_kind_t
+} kxd_symbol_t;
+
+typedef struct {
+    uint16_t pc;
+    uint32_t line;
+} kxd_line_t;
+
+typedef struct {
+    uint32_t image_size;    // Image the info describes
+    uint32_t image_hash;
+    char* source;           // Source file the image was built from
+    kxd_symbol_t* symbols;
+    int symbol_count;
+    int symbol_capacity;
+    kxd_line_t* lines;      // Ascending pcs
+    int line_count;
+    int line_capacity;
+} kxd_info_t;
+
+/**
+ * Initialize empty debug info
+ * @param info: Debug info to initialize
+ */
+void kxd_init(kxd_info_t* info);
+
+/**
+ * Free everything owned by debug info
+ * @param info: Debug info to free
+ */
+void kxd_free(kxd_info_t* info);
+
+/**
+ * Record the source file name
+ * @param info: Debug info
+ * @param source: Source file name
+ * @return: true on success, false if out of memory
+ */
+bool kxd_set_source(kxd_info_t* info, const char* source);
+
+/**
+ * Record the image the debug info describes
+ * @param info: Debug info
+ * @param image: Program image
+ * @param size: Size of the image in bytes
+ */
+void kxd_set_image(kxd_info_t* info, const uint8_t* image, uint32_t size);
+
+/**
+ * Check that loaded debug info was written for an image
+ * @param info: Loaded debug info
+ * @param image: Program image
+ * @param size: Size of the image in bytes
+ * @return: true if the size and hash match
+ */
+bool kxd_matches_image(const kxd_info_t* info, const uint8_t* image, uint32_t size);
+
+/**
+ * Add a symbol
+ * @param info: Debug info
+ * @param name: Symbol name (need not be NUL-terminated, at most 255 bytes are kept)
+ * @param len: Length of the name
+ * @param address: Address in the image
+ * @param kind: kxd_symbol_kind_t
+ * @return: true on success, false if out of memory
+ */
+bool kxd_add_symbol(kxd_info_t* info, const char* name, size_t len, uint16_t address, uint8_t kind);
+
+/**
+ * Start a line table entry; pcs must be added in ascending order. An entry
+ * for the same line as the previous one is merged into it, and a later
+ * entry at the same pc replaces it.
+ * @param info: Debug info
+ * @param pc: First address of the code
+ * @param line: Source line, 1-based
+ * @return: true on success, false if out of memory
+ */
+bool kxd_add_line(kxd_info_t* info, uint16_t pc, uint32_t line);
+
+/**
+ * Encode debug info in the .dbg format; sorts the symbols by address
+ * @param info: Debug info
+ * @param size: Set to the size of the encoding
+ * @return: Encoded file contents to free, or NULL if out of memory or
+ *          there are too many symbols
+ */
+uint8_t* kxd_encode(kxd_info_t* info, uint32_t* size);
+
+/**
+ * Write debug info in the .dbg format; sorts the symbols by address
+ * @param info: Debug info
+ * @param path: File to write
+ * @return: true on success
+ */
+bool kxd_write(kxd_info_t* info, const char* path);
+
+/**
+ * Write debug info encoded earlier by kxd_encode, such as a cached copy
+ * @param data: Encoded debug info
+ * @param size: Size of the encoding
+ * @param path: File to write
+ * @return: true on success
+ */
+bool kxd_write_encoded(const uint8_t* data, uint32_t size, const char* path);
+
+/**
+ * Load and validate a .dbg file
+ * @param info: Debug info to fill in; free with kxd_free even on failure
+ * @param path: File to read
+ * @return: NULL on success, otherwise a description of the problem
+ */
+const char* kxd_load(kxd_info_t* info, const char* path);
+
+/**
+ * Find the code symbol a pc belongs to
+ * @param info: Loaded debug info
+ * @param pc: Address
+ * @return: Closest code symbol at or below pc, or NULL
+ */
+const kxd_symbol_t* kxd_symbol_at(const kxd_info_t* info, uint16_t pc);
+
+/**
+ * Find the source line of a pc
+ * @param info: Loaded debug info
+ * @param pc: Address
+ * @return: Source line, or 0 if the pc has none
+ */
+uint32_t kxd_line_at(const kxd_info_t* info, uint16_t pc);
+
+/**
+ * Debug info path for an image: the image path with its extension
+ * replaced by .dbg
+ * @param image_path: Program image path
+ * @param path: Buffer for the result
+ * @param size: Size of the buffer
+ * @return: false if the result does not fit
+ */
+bool kxd_path(const char* image_path, char* path, size_t size);
+
+#endif // DEBUG_INFO_H
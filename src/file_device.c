@@ -0,0 +1,550 @@
+/**
+ * Asynchronous file device for KXN VM
+ * Moves blocks between host files and VM memory without blocking the
+ * interpreter. On Linux transfers go through io_uring; elsewhere, or when
+ * the kernel refuses io_uring, a small pool of worker threads runs
+ * pread/pwrite.
+ */
+
+#define _GNU_SOURCE
+#include "file_device.h"
+#include "platform_io.h"
+#include "vm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#define FILE_DEVICE_IO_URING 1
+#endif
+#endif
+
+#define FILE_DEVICE_WORKERS 4
+#define URING_SUBMIT_ATTEMPTS 8     // io_uring_enter tries on EINTR or EAGAIN
+
+typedef enum {
+    REQUEST_FREE = 0,
+    REQUEST_PENDING,
+    REQUEST_DONE,
+    REQUEST_ERROR
+} request_state_t;
+
+typedef struct {
+    request_state_t state;
+    uint8_t handle;
+    bool write;
+    uint16_t addr;
+    uint16_t len;
+    uint64_t offset;
+    int32_t result;         // Bytes transferred, or -errno
+    int32_t done;           // Bytes moved so far by an io_uring transfer cut short
+    struct iovec iov;       // Kept alive for the kernel while in flight
+} file_request_t;
+
+typedef struct {
+    int fd;                 // -1 when the slot is free
+    uint64_t position;      // Offset of the next transfer
+    uint32_t pending;       // Transfers in flight on this file
+} host_file_t;
+
+#ifdef FILE_DEVICE_IO_URING
+typedef struct {
+    int fd;
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+} uring_t;
+#endif
+
+struct file_device_t {
+    uint8_t* memory;
+    host_file_t files[FILE_DEVICE_MAX_FILES];
+    file_request_t requests[FILE_DEVICE_MAX_REQUESTS];
+
+    bool use_uring;
+#ifdef FILE_DEVICE_IO_URING
+    uring_t ring;
+#endif
+
+    // Thread pool fallback; lock guards requests, files and the queue
+    pthread_t workers[FILE_DEVICE_WORKERS];
+    int worker_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    uint8_t queue[FILE_DEVICE_MAX_REQUESTS];
+    int queue_head;
+    int queue_count;
+    bool quit;
+};
+
+/**
+ * Record the outcome of a transfer
+ */
+static void complete_request(file_device_t* dev, int index, int32_t result) {
+    file_request_t* req = &dev->requests[index];
+    req->result = result;
+    req->state = result < 0 ? REQUEST_ERROR : REQUEST_DONE;
+    dev->files[req->handle - 1].pending--;
+}
+
+#ifdef FILE_DEVICE_IO_URING
+/**
+ * Set up an io_uring instance and map its rings
+ */
+static bool uring_init(uring_t* ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return false;
+    }
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sq_ptr != MAP_FAILED) munmap(ring->sq_ptr, ring->sq_size);
+        if (ring->cq_ptr != MAP_FAILED) munmap(ring->cq_ptr, ring->cq_size);
+        if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+        close(ring->fd);
+        return false;
+    }
+
+    uint8_t* sq = ring->sq_ptr;
+    uint8_t* cq = ring->cq_ptr;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+static void uring_cleanup(uring_t* ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->cq_ptr, ring->cq_size);
+    munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->fd);
+}
+
+/**
+ * Queue one transfer, or the part of it left after a short one, and hand
+ * it to the kernel
+ * @return: false if the kernel never took the transfer; it is then off the
+ *          ring and will not complete, so the caller must fail it
+ */
+static bool uring_submit(file_device_t* dev, int index) {
+    uring_t* ring = &dev->ring;
+    file_request_t* req = &dev->requests[index];
+    req->iov.iov_base = dev->memory + req->addr + req->done;
+    req->iov.iov_len = (size_t)(req->len - req->done);
+
+    // Requests are bounded by FILE_DEVICE_MAX_REQUESTS, so the SQ never fills
+    unsigned tail = *ring->sq_tail;
+    unsigned slot = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = dev->files[req->handle - 1].fd;
+    sqe->addr = (uint64_t)(uintptr_t)&req->iov;
+    sqe->len = 1;
+    sqe->off = req->offset + (uint64_t)req->done;
+    sqe->user_data = (uint64_t)index;
+    ring->sq_array[slot] = slot;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    for (int attempt = 0; attempt < URING_SUBMIT_ATTEMPTS; attempt++) {
+        long submitted = syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+        if (submitted == 1) {
+            return true;
+        }
+        if (submitted == 0 || (errno != EINTR && errno != EAGAIN)) {
+            break;
+        }
+    }
+
+    // Without SQPOLL the kernel only moves the SQ head inside io_uring_enter,
+    // so an unconsumed entry can be taken back before anyone else sees it
+    if (__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) != tail) {
+        return true;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+    return false;
+}
+
+/**
+ * Collect finished transfers from the completion ring. Short transfers are
+ * resubmitted for the rest of their range, as the thread pool loops over
+ * short pread/pwrite calls, so both backends report the same byte counts.
+ * @param wait: block until at least one completion is available
+ */
+static void uring_reap(file_device_t* dev, bool wait) {
+    uring_t* ring = &dev->ring;
+
+    if (wait) {
+        syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    }
+
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+        int index = (int)cqe->user_data;
+        file_request_t* req = &dev->requests[index];
+        int32_t res = cqe->res;
+        head++;
+
+        // A read of 0 bytes is end of file
+        bool more = res == -EINTR || res == -EAGAIN || (res > 0 && req->done + res < req->len);
+        if (res > 0) {
+            req->done += res;
+        }
+        if (more && !uring_submit(dev, index)) {
+            complete_request(dev, index, -EIO);
+        } else if (!more) {
+            complete_request(dev, index, res < 0 ? res : req->done);
+        }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
+/**
+ * Worker thread: runs queued transfers with pread/pwrite
+ */
+static void* worker_main(void* data) {
+    file_device_t* dev = (file_device_t*)data;
+
+    pthread_mutex_lock(&dev->lock);
+    while (true) {
+        while (dev->queue_count == 0 && !dev->quit) {
+            pthread_cond_wait(&dev->work_cond, &dev->lock);
+        }
+        if (dev->queue_count == 0) {
+            break;
+        }
+
+        int index = dev->queue[dev->queue_head];
+        dev->queue_head = (dev->queue_head + 1) % FILE_DEVICE_MAX_REQUESTS;
+        dev->queue_count--;
+        file_request_t req = dev->requests[index];
+        int fd = dev->files[req.handle - 1].fd;
+        pthread_mutex_unlock(&dev->lock);
+
+        // Loop over short transfers; a read of 0 bytes is end of file
+        int32_t done = 0;
+        uint8_t* buffer = dev->memory + req.addr;
+        while (done < req.len) {
+            ssize_t n = req.write
+                ? pwrite(fd, buffer + done, req.len - done, (off_t)(req.offset + done))
+                : pread(fd, buffer + done, req.len - done, (off_t)(req.offset + done));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                done = -errno;
+                break;
+            }
+            if (n == 0) {
+                break;
+            }
+            done += (int32_t)n;
+        }
+
+        pthread_mutex_lock(&dev->lock);
+        complete_request(dev, index, done);
+        pthread_cond_broadcast(&dev->done_cond);
+    }
+    pthread_mutex_unlock(&dev->lock);
+    return NULL;
+}
+
+/**
+ * Block until the given file (or every file, for handle 0) has no
+ * transfers in flight
+ */
+static void wait_idle(file_device_t* dev, uint8_t handle) {
+    for (int i = 0; i < FILE_DEVICE_MAX_FILES; i++) {
+        host_file_t* file = &dev->files[i];
+        if (handle != 0 && i != handle - 1) continue;
+
+#ifdef FILE_DEVICE_IO_URING
+        if (dev->use_uring) {
+            while (file->pending > 0) {
+                uring_reap(dev, true);
+            }
+            continue;
+        }
+#endif
+        pthread_mutex_lock(&dev->lock);
+        while (file->pending > 0) {
+            pthread_cond_wait(&dev->done_cond, &dev->lock);
+        }
+        pthread_mutex_unlock(&dev->lock);
+    }
+}
+
+/**
+ * Create the file device
+ */
+file_device_t* file_device_init(uint8_t* memory) {
+    file_device_t* dev = calloc(1, sizeof(file_device_t));
+    if (!dev) {
+        return NULL;
+    }
+
+    dev->memory = memory;
+    for (int i = 0; i < FILE_DEVICE_MAX_FILES; i++) {
+        dev->files[i].fd = -1;
+    }
+    pthread_mutex_init(&dev->lock, NULL);
+    pthread_cond_init(&dev->work_cond, NULL);
+    pthread_cond_init(&dev->done_cond, NULL);
+
+    // KXN_FILE_BACKEND=threads forces the portable backend
+    const char* backend = getenv("KXN_FILE_BACKEND");
+    bool want_uring = !backend || strcmp(backend, "threads") != 0;
+
+#ifdef FILE_DEVICE_IO_URING
+    if (want_uring) {
+        dev->use_uring = uring_init(&dev->ring, FILE_DEVICE_MAX_REQUESTS);
+    }
+#else
+    (void)want_uring;
+#endif
+
+    if (!dev->use_uring) {
+        for (int i = 0; i < FILE_DEVICE_WORKERS; i++) {
+            if (pthread_create(&dev->workers[i], NULL, worker_main, dev) != 0) {
+                break;
+            }
+            dev->worker_count++;
+        }
+        if (dev->worker_count == 0) {
+            file_device_cleanup(dev);
+            return NULL;
+        }
+    }
+
+    return dev;
+}
+
+/**
+ * Free the file device
+ */
+void file_device_cleanup(file_device_t* dev) {
+    if (!dev) return;
+
+    wait_idle(dev, 0);
+
+    pthread_mutex_lock(&dev->lock);
+    dev->quit = true;
+    pthread_cond_broadcast(&dev->work_cond);
+    pthread_mutex_unlock(&dev->lock);
+    for (int i = 0; i < dev->worker_count; i++) {
+        pthread_join(dev->workers[i], NULL);
+    }
+
+#ifdef FILE_DEVICE_IO_URING
+    if (dev->use_uring) {
+        uring_cleanup(&dev->ring);
+    }
+#endif
+
+    for (int i = 0; i < FILE_DEVICE_MAX_FILES; i++) {
+        if (dev->files[i].fd >= 0) {
+            close(dev->files[i].fd);
+        }
+    }
+
+    pthread_cond_destroy(&dev->done_cond);
+    pthread_cond_destroy(&dev->work_cond);
+    pthread_mutex_destroy(&dev->lock);
+    free(dev);
+}
+
+const char* file_device_backend(file_device_t* dev) {
+    return dev->use_uring ? "io_uring" : "threads";
+}
+
+/**
+ * Open a host file
+ */
+uint8_t file_device_open(file_device_t* dev, const char* path, uint8_t mode) {
+    int flags;
+    if ((mode & FILE_MODE_READ) && (mode & FILE_MODE_WRITE)) {
+        flags = O_RDWR;
+    } else if (mode & FILE_MODE_WRITE) {
+        flags = O_WRONLY;
+    } else if (mode & FILE_MODE_READ) {
+        flags = O_RDONLY;
+    } else {
+        return 0;
+    }
+    if (mode & FILE_MODE_CREATE) {
+        flags |= O_CREAT | O_TRUNC;
+    }
+
+    for (int i = 0; i < FILE_DEVICE_MAX_FILES; i++) {
+        host_file_t* file = &dev->files[i];
+        if (file->fd >= 0) continue;
+
+        int fd = open(path, flags, 0644);
+        if (fd < 0) {
+            return 0;
+        }
+        file->fd = fd;
+        file->position = 0;
+        file->pending = 0;
+        return (uint8_t)(i + 1);
+    }
+    return 0;
+}
+
+/**
+ * Close a host file
+ */
+bool file_device_close(file_device_t* dev, uint8_t handle) {
+    if (handle == 0 || handle > FILE_DEVICE_MAX_FILES || dev->files[handle - 1].fd < 0) {
+        return false;
+    }
+
+    wait_idle(dev, handle);
+    close(dev->files[handle - 1].fd);
+    dev->files[handle - 1].fd = -1;
+    return true;
+}
+
+/**
+ * Start an asynchronous transfer
+ */
+uint8_t file_device_submit(file_device_t* dev, uint8_t handle, bool write, uint16_t addr, uint16_t len) {
+    if (handle == 0 || handle > FILE_DEVICE_MAX_FILES || dev->files[handle - 1].fd < 0) {
+        return 0;
+    }
+    if ((uint32_t)addr + len > VM_MEMORY_SIZE) {
+        len = (uint16_t)(VM_MEMORY_SIZE - addr);
+    }
+
+    pthread_mutex_lock(&dev->lock);
+    int index = -1;
+    for (int i = 0; i < FILE_DEVICE_MAX_REQUESTS; i++) {
+        if (dev->requests[i].state == REQUEST_FREE) {
+            index = i;
+            break;
+        }
+    }
+    if (index < 0) {
+        pthread_mutex_unlock(&dev->lock);
+        return 0;
+    }
+
+    host_file_t* file = &dev->files[handle - 1];
+    file_request_t* req = &dev->requests[index];
+    req->state = REQUEST_PENDING;
+    req->handle = handle;
+    req->write = write;
+    req->addr = addr;
+    req->len = len;
+    req->offset = file->position;
+    req->result = 0;
+    req->done = 0;
+    file->position += len;
+    file->pending++;
+
+#ifdef FILE_DEVICE_IO_URING
+    if (dev->use_uring) {
+        pthread_mutex_unlock(&dev->lock);
+        if (!uring_submit(dev, index)) {
+            complete_request(dev, index, -EIO);
+        }
+        return (uint8_t)(index + 1);
+    }
+#endif
+
+    int tail = (dev->queue_head + dev->queue_count) % FILE_DEVICE_MAX_REQUESTS;
+    dev->queue[tail] = (uint8_t)index;
+    dev->queue_count++;
+    pthread_cond_signal(&dev->work_cond);
+    pthread_mutex_unlock(&dev->lock);
+    return (uint8_t)(index + 1);
+}
+
+/**
+ * Check the state of a transfer
+ */
+uint8_t file_device_poll(file_device_t* dev, uint8_t request) {
+    if (request == 0 || request > FILE_DEVICE_MAX_REQUESTS) {
+        return FILE_STATUS_INVALID;
+    }
+
+#ifdef FILE_DEVICE_IO_URING
+    if (dev->use_uring) {
+        uring_reap(dev, false);
+    }
+#endif
+
+    pthread_mutex_lock(&dev->lock);
+    request_state_t state = dev->requests[request - 1].state;
+    pthread_mutex_unlock(&dev->lock);
+
+    switch (state) {
+        case REQUEST_PENDING: return FILE_STATUS_PENDING;
+        case REQUEST_DONE:    return FILE_STATUS_DONE;
+        case REQUEST_ERROR:   return FILE_STATUS_ERROR;
+        default:              return FILE_STATUS_INVALID;
+    }
+}
+
+/**
+ * Collect a finished transfer and free its request id
+ */
+uint16_t file_device_result(file_device_t* dev, uint8_t request) {
+    if (request == 0 || request > FILE_DEVICE_MAX_REQUESTS) {
+        return 0;
+    }
+
+    uint16_t bytes = 0;
+    pthread_mutex_lock(&dev->lock);
+    file_request_t* req = &dev->requests[request - 1];
+    if (req->state == REQUEST_DONE || req->state == REQUEST_ERROR) {
+        bytes = req->result > 0 ? (uint16_t)req->result : 0;
+        req->state = REQUEST_FREE;
+    }
+    pthread_mutex_unlock(&dev->lock);
+    return bytes;
+}
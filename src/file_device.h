@@ -0,0 +1,81 @@
+#ifndef FILE_DEVICE_H
+#define FILE_DEVICE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FILE_DEVICE_MAX_FILES    16  // Open host files per VM
+#define FILE_DEVICE_MAX_REQUESTS 32  // Transfers in flight per VM
+#define FILE_DEVICE_MAX_PATH     256 // Longest guest path accepted
+
+// File device instance (opaque)
+typedef struct file_device_t file_device_t;
+
+/**
+ * Create a file device that transfers blocks to and from VM memory.
+ * Uses io_uring on Linux when the kernel allows it, otherwise a small
+ * thread pool running pread/pwrite.
+ * @param memory: VM memory that transfers read from and write into
+ * @return: Device on success, NULL on failure
+ */
+file_device_t* file_device_init(uint8_t* memory);
+
+/**
+ * Wait for outstanding transfers, close all files and free the device
+ * @param dev: File device
+ */
+void file_device_cleanup(file_device_t* dev);
+
+/**
+ * Name of the backend in use ("io_uring" or "threads")
+ * @param dev: File device
+ */
+const char* file_device_backend(file_device_t* dev);
+
+/**
+ * Open a host file
+ * @param dev: File device
+ * @param path: Host path
+ * @param mode: FILE_MODE_* flags
+ * @return: Handle (1-based), or 0 on failure
+ */
+uint8_t file_device_open(file_device_t* dev, const char* path, uint8_t mode);
+
+/**
+ * Close a host file, waiting for its outstanding transfers first
+ * @param dev: File device
+ * @param handle: Handle returned by file_device_open
+ * @return: true on success, false if the handle is not open
+ */
+bool file_device_close(file_device_t* dev, uint8_t handle);
+
+/**
+ * Start an asynchronous transfer between the file and VM memory.
+ * Transfers are sequential: each one starts where the previous transfer
+ * on the same handle was requested to end.
+ * @param dev: File device
+ * @param handle: Open file handle
+ * @param write: true to write memory to the file, false to read into memory
+ * @param addr: First byte of the VM memory range
+ * @param len: Length of the range (clipped to the end of memory)
+ * @return: Request id (1-based) to poll, or 0 if the transfer was rejected
+ */
+uint8_t file_device_submit(file_device_t* dev, uint8_t handle, bool write, uint16_t addr, uint16_t len);
+
+/**
+ * Check the state of a transfer without blocking
+ * @param dev: File device
+ * @param request: Request id returned by file_device_submit
+ * @return: FILE_STATUS_* value
+ */
+uint8_t file_device_poll(file_device_t* dev, uint8_t request);
+
+/**
+ * Collect the result of a finished transfer and release its request id
+ * @param dev: File device
+ * @param request: Request id of a completed or failed transfer
+ * @return: Bytes transferred (0 on error or if still pending)
+ */
+uint16_t file_device_result(file_device_t* dev, uint8_t request);
+
+#endif // FILE_DEVICE_H
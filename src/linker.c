@@ -0,0 +1,318 @@
+/**
+ * kxld - linker for KXN object files
+ * Places the code of each module in command-line order from address 0 and
+ * ends it with a HALT, so the modules run one after another. Data sections
+ * follow the code unless -d gives their address. Global symbols are
+ * resolved across modules, then every relocation is patched.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm.h"
+#include "object.h"
+
+#define DATA_LIMIT 0xFF00   // The top page is left to the stack
+
+typedef struct {
+    const char* path;
+    kxo_object_t obj;
+    uint16_t code_base;
+    uint16_t data_base;
+} module_t;
+
+// Open-addressing table of global definitions (power-of-two size)
+typedef struct {
+    const kxo_symbol_t* symbol;
+    int module;
+    uint16_t address;
+} global_t;
+
+typedef struct {
+    global_t* slots;
+    int capacity;
+} global_table_t;
+
+static uint32_t hash_name(const char* name) {
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static global_t* find_global(const global_table_t* table, const char* name) {
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    for (uint32_t i = hash_name(name) & mask; ; i = (i + 1) & mask) {
+        global_t* slot = &table->slots[i];
+        if (!slot->symbol || strcmp(slot->symbol->name, name) == 0) {
+            return slot;
+        }
+    }
+}
+
+static uint16_t symbol_address(const module_t* mod, const kxo_symbol_t* sym) {
+    return sym->section == KXO_SECTION_CODE ? (uint16_t)(mod->code_base + sym->value)
+                                            : (uint16_t)(mod->data_base + sym->value);
+}
+
+// Undefined symbols are reported once per module
+static bool first_reference(const kxo_object_t* obj, int reloc) {
+    for (int i = 0; i < reloc; i++) {
+        if (obj->relocs[i].kind == KXO_RELOC_SYMBOL && obj->relocs[i].symbol == obj->relocs[reloc].symbol) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint8_t* read_file(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+
+    uint8_t* data = NULL;
+    long len = -1;
+    if (fseek(file, 0, SEEK_END) == 0 && (len = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+        data = malloc(len ? len : 1);
+    }
+    if (data && fread(data, 1, len, file) != (size_t)len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    *size = (size_t)len;
+    return data;
+}
+
+static void write_map(FILE* out, const module_t* modules, int count, uint32_t code_end,
+                      uint32_t data_base, uint32_t data_end) {
+    fprintf(out, "Code  0x%04X-0x%04X  %u bytes\n", 0u, code_end, code_end);
+    fprintf(out, "Data  0x%04X-0x%04X  %u bytes\n\n", data_base, data_end, data_end - data_base);
+
+    for (int m = 0; m < count; m++) {
+        const module_t* mod = &modules[m];
+        fprintf(out, "%s: code 0x%04X (%u bytes), data 0x%04X (%u bytes)\n", mod->path,
+                mod->code_base, mod->obj.code_size, mod->data_base, mod->obj.data_size);
+        for (int i = 0; i < mod->obj.symbol_count; i++) {
+            const kxo_symbol_t* sym = &mod->obj.symbols[i];
+            if (sym->section == KXO_SECTION_UNDEF) continue;
+            fprintf(out, "  0x%04X  %s  %s%s\n", symbol_address(mod, sym),
+                    sym->section == KXO_SECTION_CODE ? "code" : "data", sym->name,
+                    sym->flags & KXO_SYMBOL_GLOBAL ? " (global)" : "");
+        }
+    }
+}
+
+static int link_modules(module_t* modules, int count, const char* output_path, const char* map_path,
+                        long data_addr) {
+    // Code from 0 in link order, then the HALT that ends the program
+    uint32_t code_end = 0;
+    for (int m = 0; m < count; m++) {
+        modules[m].code_base = (uint16_t)code_end;
+        code_end += modules[m].obj.code_size;
+        if (code_end >= DATA_LIMIT) {
+            fprintf(stderr, "Error: Code does not fit below 0x%04X\n", DATA_LIMIT);
+            return 1;
+        }
+    }
+    code_end++;
+
+    uint32_t data_base = data_addr >= 0 ? (uint32_t)data_addr : code_end;
+    uint32_t data_end = data_base;
+    for (int m = 0; m < count; m++) {
+        modules[m].data_base = (uint16_t)data_end;
+        data_end += modules[m].obj.data_size;
+    }
+    if (data_end > DATA_LIMIT) {
+        fprintf(stderr, "Error: Data ends at 0x%04X, past the stack page at 0x%04X\n", data_end, DATA_LIMIT);
+        return 1;
+    }
+    if (data_end > data_base && data_base < code_end) {
+        fprintf(stderr, "Error: Data at 0x%04X overlaps code ending at 0x%04X\n", data_base, code_end);
+        return 1;
+    }
+
+    // Collect global definitions
+    int globals = 0;
+    for (int m = 0; m < count; m++) {
+        globals += modules[m].obj.symbol_count;
+    }
+    global_table_t table;
+    table.capacity = 16;
+    while (table.capacity < globals * 2) table.capacity *= 2;
+    table.slots = calloc(table.capacity, sizeof(global_t));
+    uint8_t* image = calloc(code_end, 1);
+    if (!table.slots || !image) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(table.slots);
+        free(image);
+        return 1;
+    }
+
+    int errors = 0;
+    for (int m = 0; m < count; m++) {
+        const kxo_object_t* obj = &modules[m].obj;
+        for (int i = 0; i < obj->symbol_count; i++) {
+            const kxo_symbol_t* sym = &obj->symbols[i];
+            if (sym->section == KXO_SECTION_UNDEF || !(sym->flags & KXO_SYMBOL_GLOBAL)) continue;
+
+            global_t* slot = find_global(&table, sym->name);
+            if (slot->symbol) {
+                fprintf(stderr, "Error: '%s' is defined in both %s and %s\n", sym->name,
+                        modules[slot->module].path, modules[m].path);
+                errors++;
+                continue;
+            }
+            slot->symbol = sym;
+            slot->module = m;
+            slot->address = symbol_address(&modules[m], sym);
+        }
+    }
+
+    // Place the code and patch each relocated operand
+    for (int m = 0; m < count && !errors; m++) {
+        const module_t* mod = &modules[m];
+        const kxo_object_t* obj = &mod->obj;
+        uint8_t* code = image + mod->code_base;
+        memcpy(code, obj->code, obj->code_size);
+
+        for (int i = 0; i < obj->reloc_count; i++) {
+            const kxo_reloc_t* reloc = &obj->relocs[i];
+            uint16_t target = 0;
+            if (reloc->kind == KXO_RELOC_CODE) {
+                target = mod->code_base;
+            } else if (reloc->kind == KXO_RELOC_DATA) {
+                target = mod->data_base;
+            } else {
+                const kxo_symbol_t* sym = &obj->symbols[reloc->symbol];
+                if (sym->section != KXO_SECTION_UNDEF) {
+                    target = symbol_address(mod, sym);
+                } else {
+                    const global_t* def = find_global(&table, sym->name);
+                    if (!def->symbol) {
+                        if (first_reference(obj, i)) {
+                            fprintf(stderr, "Error: Undefined symbol '%s' referenced from %s\n", sym->name, mod->path);
+                        }
+                        errors++;
+                        continue;
+                    }
+                    target = def->address;
+                }
+            }
+
+            uint16_t addend = (uint16_t)(code[reloc->offset] | (code[reloc->offset + 1] << 8));
+            uint16_t value = (uint16_t)(addend + target);
+            code[reloc->offset] = value & 0xFF;
+            code[reloc->offset + 1] = (value >> 8) & 0xFF;
+        }
+    }
+    image[code_end - 1] = OP_HALT;
+    free(table.slots);
+
+    if (errors) {
+        free(image);
+        return 1;
+    }
+
+    FILE* out = fopen(output_path, "wb");
+    bool ok = out && fwrite(image, 1, code_end, out) == code_end;
+    if (out && fclose(out) != 0) {
+        ok = false;
+    }
+    free(image);
+    if (!ok) {
+        fprintf(stderr, "Error: Cannot write '%s'\n", output_path);
+        return 1;
+    }
+
+    if (map_path) {
+        FILE* map = fopen(map_path, "w");
+        if (!map) {
+            fprintf(stderr, "Error: Cannot write '%s'\n", map_path);
+            return 1;
+        }
+        write_map(map, modules, count, code_end, data_base, data_end);
+        fclose(map);
+    }
+
+    printf("Linked %d modules: %u bytes of code, %u bytes of data at 0x%04X -> %s\n",
+           count, code_end, data_end - data_base, data_base, output_path);
+    return 0;
+}
+
+static void usage(const char* name) {
+    printf("Usage: %s -o <output.bin> [-d address] [-m output.map] <input.kxo>...\n", name);
+    printf("  -o file     Program image to write\n");
+    printf("  -d address  Place data at address (default: right after the code)\n");
+    printf("  -m file     Write a map of sections and symbols\n");
+}
+
+int main(int argc, char* argv[]) {
+    const char* output_path = NULL;
+    const char* map_path = NULL;
+    long data_addr = -1;
+
+    int argi = 1;
+    for (; argi < argc && argv[argi][0] == '-'; argi++) {
+        if (strcmp(argv[argi], "-o") == 0 && argi + 1 < argc) {
+            output_path = argv[++argi];
+        } else if (strcmp(argv[argi], "-m") == 0 && argi + 1 < argc) {
+            map_path = argv[++argi];
+        } else if (strcmp(argv[argi], "-d") == 0 && argi + 1 < argc) {
+            char* end;
+            data_addr = strtol(argv[++argi], &end, 0);
+            if (*end || data_addr < 0 || data_addr >= DATA_LIMIT) {
+                fprintf(stderr, "Error: Invalid data address '%s'\n", argv[argi]);
+                return 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    int count = argc - argi;
+    if (!output_path || count == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    module_t* modules = calloc(count, sizeof(module_t));
+    if (!modules) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 1;
+    }
+
+    int result = 0;
+    for (int m = 0; m < count && result == 0; m++) {
+        modules[m].path = argv[argi + m];
+
+        size_t size = 0;
+        uint8_t* data = read_file(modules[m].path, &size);
+        if (!data) {
+            fprintf(stderr, "Error: Cannot read '%s'\n", modules[m].path);
+            result = 1;
+            break;
+        }
+
+        const char* problem = kxo_decode(&modules[m].obj, data, size);
+        free(data);
+        if (problem) {
+            fprintf(stderr, "Error: %s: %s\n", modules[m].path, problem);
+            result = 1;
+        }
+    }
+
+    if (result == 0) {
+        result = link_modules(modules, count, output_path, map_path, data_addr);
+    }
+
+    for (int m = 0; m < count; m++) {
+        kxo_free(&modules[m].obj);
+    }
+    free(modules);
+    return result;
+}
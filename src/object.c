@@ -0,0 +1,228 @@
+/**
+ * Relocatable object files for the KXN toolchain
+ * Written by tinyc and kxasm, read by kxld. See object.h for the layout.
+ */
+
+#include "object.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define KXO_HEADER_SIZE 16
+#define KXO_SYMBOL_SIZE 8
+#define KXO_RELOC_SIZE  5
+
+static void put16(uint8_t* p, uint16_t value) {
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+}
+
+static void put32(uint8_t* p, uint32_t value) {
+    put16(p, value & 0xFFFF);
+    put16(p + 2, (value >> 16) & 0xFFFF);
+}
+
+static uint16_t get16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get32(const uint8_t* p) {
+    return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+/**
+ * Make room for one more element in a doubling array
+ */
+static bool grow(void** items, int count, int* capacity, size_t size) {
+    if (count < *capacity) {
+        return true;
+    }
+
+    int grown = *capacity ? *capacity * 2 : 16;
+    void* resized = realloc(*items, grown * size);
+    if (!resized) {
+        return false;
+    }
+    *items = resized;
+    *capacity = grown;
+    return true;
+}
+
+void kxo_init(kxo_object_t* obj) {
+    memset(obj, 0, sizeof(kxo_object_t));
+}
+
+void kxo_free(kxo_object_t* obj) {
+    for (int i = 0; i < obj->symbol_count; i++) {
+        free(obj->symbols[i].name);
+    }
+    free(obj->symbols);
+    free(obj->relocs);
+    free(obj->code);
+    kxo_init(obj);
+}
+
+bool kxo_set_code(kxo_object_t* obj, const uint8_t* code, uint16_t size) {
+    uint8_t* copy = malloc(size ? size : 1);
+    if (!copy) {
+        return false;
+    }
+    memcpy(copy, code, size);
+    free(obj->code);
+    obj->code = copy;
+    obj->code_size = size;
+    return true;
+}
+
+int kxo_add_symbol(kxo_object_t* obj, const char* name, size_t len, uint8_t section, uint16_t value, uint8_t flags) {
+    if (!grow((void**)&obj->symbols, obj->symbol_count, &obj->symbol_capacity, sizeof(kxo_symbol_t))) {
+        return -1;
+    }
+
+    char* copy = malloc(len + 1);
+    if (!copy) {
+        return -1;
+    }
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+
+    kxo_symbol_t* sym = &obj->symbols[obj->symbol_count];
+    sym->name = copy;
+    sym->value = value;
+    sym->section = section;
+    sym->flags = flags;
+    return obj->symbol_count++;
+}
+
+int kxo_find_symbol(const kxo_object_t* obj, const char* name, size_t len) {
+    for (int i = 0; i < obj->symbol_count; i++) {
+        if (strncmp(obj->symbols[i].name, name, len) == 0 && obj->symbols[i].name[len] == '\0') {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool kxo_add_reloc(kxo_object_t* obj, uint16_t offset, uint8_t kind, uint16_t symbol) {
+    if (!grow((void**)&obj->relocs, obj->reloc_count, &obj->reloc_capacity, sizeof(kxo_reloc_t))) {
+        return false;
+    }
+
+    kxo_reloc_t* reloc = &obj->relocs[obj->reloc_count++];
+    reloc->offset = offset;
+    reloc->kind = kind;
+    reloc->symbol = symbol;
+    return true;
+}
+
+uint8_t* kxo_encode(const kxo_object_t* obj, uint32_t* size) {
+    uint32_t strings_size = 0;
+    for (int i = 0; i < obj->symbol_count; i++) {
+        strings_size += (uint32_t)strlen(obj->symbols[i].name) + 1;
+    }
+
+    uint32_t total = KXO_HEADER_SIZE + obj->code_size + obj->symbol_count * KXO_SYMBOL_SIZE +
+                     obj->reloc_count * KXO_RELOC_SIZE + strings_size;
+    uint8_t* out = malloc(total);
+    if (!out) {
+        return NULL;
+    }
+
+    memcpy(out, KXO_MAGIC, 4);
+    put16(out + 4, obj->code_size);
+    put16(out + 6, obj->data_size);
+    put16(out + 8, (uint16_t)obj->symbol_count);
+    put16(out + 10, (uint16_t)obj->reloc_count);
+    put32(out + 12, strings_size);
+
+    uint8_t* p = out + KXO_HEADER_SIZE;
+    memcpy(p, obj->code, obj->code_size);
+    p += obj->code_size;
+
+    uint32_t name_offset = 0;
+    for (int i = 0; i < obj->symbol_count; i++) {
+        const kxo_symbol_t* sym = &obj->symbols[i];
+        put32(p, name_offset);
+        put16(p + 4, sym->value);
+        p[6] = sym->section;
+        p[7] = sym->flags;
+        p += KXO_SYMBOL_SIZE;
+        name_offset += (uint32_t)strlen(sym->name) + 1;
+    }
+
+    for (int i = 0; i < obj->reloc_count; i++) {
+        const kxo_reloc_t* reloc = &obj->relocs[i];
+        put16(p, reloc->offset);
+        p[2] = reloc->kind;
+        put16(p + 3, reloc->symbol);
+        p += KXO_RELOC_SIZE;
+    }
+
+    for (int i = 0; i < obj->symbol_count; i++) {
+        size_t len = strlen(obj->symbols[i].name) + 1;
+        memcpy(p, obj->symbols[i].name, len);
+        p += len;
+    }
+
+    *size = total;
+    return out;
+}
+
+const char* kxo_decode(kxo_object_t* obj, const uint8_t* data, size_t size) {
+    kxo_init(obj);
+    if (size < KXO_HEADER_SIZE || memcmp(data, KXO_MAGIC, 4) != 0) {
+        return "not a KXN object file";
+    }
+
+    uint16_t code_size = get16(data + 4);
+    uint16_t symbol_count = get16(data + 8);
+    uint16_t reloc_count = get16(data + 10);
+    uint32_t strings_size = get32(data + 12);
+    size_t expected = (size_t)KXO_HEADER_SIZE + code_size + (size_t)symbol_count * KXO_SYMBOL_SIZE +
+                      (size_t)reloc_count * KXO_RELOC_SIZE + strings_size;
+    if (expected != size) {
+        return "truncated or corrupt object file";
+    }
+
+    const uint8_t* p = data + KXO_HEADER_SIZE;
+    if (!kxo_set_code(obj, p, code_size)) {
+        return "out of memory";
+    }
+    obj->data_size = get16(data + 6);
+    p += code_size;
+
+    const char* strings = (const char*)(p + (size_t)symbol_count * KXO_SYMBOL_SIZE + (size_t)reloc_count * KXO_RELOC_SIZE);
+    for (int i = 0; i < symbol_count; i++, p += KXO_SYMBOL_SIZE) {
+        uint32_t name_offset = get32(p);
+        if (name_offset >= strings_size) {
+            return "symbol name outside the string table";
+        }
+
+        const char* name = strings + name_offset;
+        const char* end = memchr(name, '\0', strings_size - name_offset);
+        if (!end) {
+            return "unterminated symbol name";
+        }
+        if (p[6] > KXO_SECTION_DATA) {
+            return "symbol in an unknown section";
+        }
+        if (kxo_add_symbol(obj, name, (size_t)(end - name), p[6], get16(p + 4), p[7]) < 0) {
+            return "out of memory";
+        }
+    }
+
+    for (int i = 0; i < reloc_count; i++, p += KXO_RELOC_SIZE) {
+        uint16_t offset = get16(p);
+        uint8_t kind = p[2];
+        uint16_t symbol = get16(p + 3);
+        if (offset + 2 > code_size) {
+            return "relocation outside the code";
+        }
+        if (kind < KXO_RELOC_CODE || kind > KXO_RELOC_SYMBOL || (kind == KXO_RELOC_SYMBOL && symbol >= symbol_count)) {
+            return "invalid relocation";
+        }
+        if (!kxo_add_reloc(obj, offset, kind, symbol)) {
+            return "out of memory";
+        }
+    }
+    return NULL;
+}
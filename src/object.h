@@ -0,0 +1,136 @@
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Relocatable object format (.kxo)
+ *
+ * An object holds one module: its code, the size of its data section, a
+ * symbol table and a list of relocations. Code is assembled as if it
+ * started at address 0 and data as if it started at 0; kxld places both
+ * and patches every 16-bit operand named by a relocation. The word at a
+ * relocation's offset holds the addend.
+ *
+ * File layout, all fields little-endian:
+ *   header   "KXO1", code size (2), data size (2), symbol count (2),
+ *            relocation count (2), string table size (4)
+ *   code     code size bytes
+ *   symbols  name offset (4), value (2), section (1), flags (1)
+ *   relocs   offset (2), kind (1), symbol index (2)
+ *   strings  NUL-terminated symbol names
+ */
+
+#define KXO_MAGIC "KXO1"
+
+typedef enum {
+    KXO_SECTION_UNDEF = 0,  // Defined in another module
+    KXO_SECTION_CODE  = 1,
+    KXO_SECTION_DATA  = 2
+} kxo_section_t;
+
+#define KXO_SYMBOL_GLOBAL 0x01  // Visible to other modules
+
+typedef enum {
+    KXO_RELOC_CODE   = 1,   // Add the module's code address
+    KXO_RELOC_DATA   = 2,   // Add the module's data address
+    KXO_RELOC_SYMBOL = 3    // Add the address of a symbol
+} kxo_reloc_kind_t;
+
+typedef struct {
+    char* name;
+    uint16_t value;         // Offset in its section
+    uint8_t section;        // kxo_section_t
+    uint8_t flags;          // KXO_SYMBOL_*
+} kxo_symbol_t;
+
+typedef struct {
+    uint16_t offset;        // Operand position in the code
+    uint8_t kind;           // kxo_reloc_kind_t
+    uint16_t symbol;        // KXO_RELOC_SYMBOL: symbol index
+} kxo_reloc_t;
+
+typedef struct {
+    uint8_t* code;
+    uint16_t code_size;
+    uint16_t data_size;
+    kxo_symbol_t* symbols;
+    int symbol_count;
+    int symbol_capacity;
+    kxo_reloc_t* relocs;
+    int reloc_count;
+    int reloc_capacity;
+} kxo_object_t;
+
+/**
+ * Initialize an empty object
+ * @param obj: Object to initialize
+ */
+void kxo_init(kxo_object_t* obj);
+
+/**
+ * Free everything owned by an object
+ * @param obj: Object to free
+ */
+void kxo_free(kxo_object_t* obj);
+
+/**
+ * Copy a module's code into the object
+ * @param obj: Object
+ * @param code: Code bytes, assembled as if at address 0
+ * @param size: Size of the code in bytes
+ * @return: true on success, false if out of memory
+ */
+bool kxo_set_code(kxo_object_t* obj, const uint8_t* code, uint16_t size);
+
+/**
+ * Add a symbol
+ * @param obj: Object
+ * @param name: Symbol name (need not be NUL-terminated)
+ * @param len: Length of the name
+ * @param section: kxo_section_t of the definition, or KXO_SECTION_UNDEF
+ * @param value: Offset within the section
+ * @param flags: KXO_SYMBOL_* flags
+ * @return: Symbol index, or -1 if out of memory
+ */
+int kxo_add_symbol(kxo_object_t* obj, const char* name, size_t len, uint8_t section, uint16_t value, uint8_t flags);
+
+/**
+ * Find a symbol by name
+ * @param obj: Object
+ * @param name: Symbol name (need not be NUL-terminated)
+ * @param len: Length of the name
+ * @return: Symbol index, or -1 if there is none
+ */
+int kxo_find_symbol(const kxo_object_t* obj, const char* name, size_t len);
+
+/**
+ * Add a relocation
+ * @param obj: Object
+ * @param offset: Position of the 16-bit operand in the code
+ * @param kind: kxo_reloc_kind_t
+ * @param symbol: Symbol index for KXO_RELOC_SYMBOL, otherwise 0
+ * @return: true on success, false if out of memory
+ */
+bool kxo_add_reloc(kxo_object_t* obj, uint16_t offset, uint8_t kind, uint16_t symbol);
+
+/**
+ * Encode an object in the .kxo file format
+ * @param obj: Object
+ * @param size: Set to the encoded size
+ * @return: Encoded bytes (caller frees), or NULL if out of memory
+ */
+uint8_t* kxo_encode(const kxo_object_t* obj, uint32_t* size);
+
+/**
+ * Decode and validate an object file
+ * @param obj: Object to fill in; free with kxo_free even on failure
+ * @param data: File contents
+ * @param size: Size of the file
+ * @return: NULL on success, otherwise a description of the problem
+ */
+const char* kxo_decode(kxo_object_t* obj, const uint8_t* data, size_t size);
+
+#endif // OBJECT_H
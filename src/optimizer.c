@@ -0,0 +1,747 @@
+/**
+ * kxopt - post-link optimizer for KXN program images
+ * Disassembles an image from its entry point at 0, following every branch
+ * and call, to recover its basic blocks. The code is then rewritten:
+ * blocks no path reaches are dropped, jumps to jumps go straight to the
+ * final target, blocks are laid out so each one falls through into its
+ * successor, and branches are re-encoded in their short form wherever
+ * they reach. Data stays where it was, so the new code has to fit in the
+ * space of the old; code addresses are assumed to appear only as branch
+ * and call operands.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm.h"
+#include "debug_info.h"
+
+#define NO_BLOCK -1
+#define NO_ADDRESS -1   // Instruction added by the optimizer
+
+// Operand kind of each opcode plus one, so 0 marks an invalid opcode
+static const uint8_t operand_kinds[256] = {
+#define OPERAND_KIND(name, value, mnemonic, operand) [value] = operand + 1,
+    VM_OPCODES(OPERAND_KIND)
+#undef OPERAND_KIND
+};
+
+typedef enum {
+    BYTE_UNKNOWN,
+    BYTE_OPCODE,
+    BYTE_OPERAND
+} byte_kind_t;
+
+// A straight-line instruction; calls name their target block
+typedef struct {
+    uint16_t addr;          // Input address
+    uint8_t op;             // Long form for calls
+    uint16_t operand;
+    int target;             // OP_CALL: target block
+} insn_t;
+
+typedef enum {
+    EXIT_FALL,              // Runs into next
+    EXIT_JUMP,              // JMP to target
+    EXIT_BRANCH,            // JZ or JNZ to target, otherwise next
+    EXIT_STOP               // HALT or RET
+} exit_kind_t;
+
+typedef struct {
+    uint16_t addr;          // Input address
+    int first;              // Straight-line instructions first..first+count-1
+    int count;
+    exit_kind_t exit;
+    uint8_t exit_op;        // EXIT_BRANCH: OP_JZ or OP_JNZ; EXIT_STOP: OP_HALT or OP_RET
+    uint16_t exit_addr;     // Input address of the exit instruction
+    int target;
+    int next;
+    bool reachable;
+    bool placed;
+} block_t;
+
+// Rewritten code: long-form opcodes until encode_program sizes the branches
+typedef struct {
+    uint8_t op;
+    uint16_t operand;
+    int target;             // Branches and calls: target block
+    int32_t addr;           // Input address, or NO_ADDRESS
+    uint16_t new_addr;      // Output address, set by encode_program
+    bool is_short;
+} out_insn_t;
+
+typedef struct {
+    const uint8_t* image;
+    uint32_t size;
+    uint8_t kinds[VM_MEMORY_SIZE];      // byte_kind_t of each input byte
+    bool leader[VM_MEMORY_SIZE];        // A block starts here
+    int block_at[VM_MEMORY_SIZE];       // Block starting at an address, or NO_BLOCK
+
+    insn_t* insns;
+    int insn_count;
+    block_t* blocks;
+    int block_count;
+    uint32_t code_bytes;    // Bytes reached from the entry point
+    int jump_count;         // Jumps in the reached code
+    int indirect_count;     // LOAD_IND and STORE_IND instructions
+
+    int* order;             // Blocks in output order
+    int* order_first;       // First output instruction of each placed block
+    int order_count;
+    out_insn_t* out;
+    int out_count;
+    uint16_t* block_addr;   // Output address of each placed block
+    uint8_t* code;          // Encoded output
+    uint32_t code_size;
+} program_t;
+
+static uint16_t get16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static int operand_size(uint8_t op) {
+    switch (operand_kinds[op] - 1) {
+        case VM_OPERAND_IMM8:
+        case VM_OPERAND_REL8:
+            return 1;
+        case VM_OPERAND_ADDR16:
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+static bool is_short_branch(uint8_t op) {
+    return op >= OP_JMPS && op <= OP_CALLS;
+}
+
+static uint8_t long_form(uint8_t op) {
+    return is_short_branch(op) ? (uint8_t)(op - VM_SHORT_BRANCH_DELTA) : op;
+}
+
+static bool is_branch(uint8_t op) {
+    op = long_form(op);
+    return op == OP_JMP || op == OP_JZ || op == OP_JNZ || op == OP_CALL;
+}
+
+static uint32_t branch_target(const uint8_t* image, uint32_t pc) {
+    if (is_short_branch(image[pc])) {
+        return (uint16_t)(pc + 2 + (int8_t)image[pc + 1]);
+    }
+    return get16(image + pc + 1);
+}
+
+static uint8_t* read_file(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+
+    uint8_t* data = NULL;
+    long len = -1;
+    if (fseek(file, 0, SEEK_END) == 0 && (len = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+        data = malloc(len ? len : 1);
+    }
+    if (data && fread(data, 1, len, file) != (size_t)len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    *size = (size_t)len;
+    return data;
+}
+
+/**
+ * Walk every path from the entry point, marking opcode and operand bytes
+ * and the addresses where blocks start
+ */
+static bool decode_program(program_t* prog) {
+    uint32_t* work = malloc((prog->size + 1) * sizeof(uint32_t));
+    if (!work) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return false;
+    }
+
+    int pending = 0;
+    work[pending++] = 0;
+    prog->leader[0] = true;
+    bool ok = true;
+    while (ok && pending > 0) {
+        uint32_t pc = work[--pending];
+        while (ok) {
+            if (pc >= prog->size) {
+                fprintf(stderr, "Error: Execution runs past the end of the image at 0x%04X\n", pc);
+                ok = false;
+                break;
+            }
+            if (prog->kinds[pc] == BYTE_OPCODE) {
+                break;
+            }
+
+            uint8_t op = prog->image[pc];
+            uint32_t len = 1 + operand_size(op);
+            if (!operand_kinds[op]) {
+                fprintf(stderr, "Error: Invalid opcode 0x%02X at 0x%04X\n", op, pc);
+                ok = false;
+                break;
+            }
+            if (pc + len > prog->size) {
+                fprintf(stderr, "Error: Instruction at 0x%04X runs past the end of the image\n", pc);
+                ok = false;
+                break;
+            }
+            for (uint32_t k = 0; k < len; k++) {
+                if (prog->kinds[pc + k] != BYTE_UNKNOWN) {
+                    fprintf(stderr, "Error: Instructions overlap at 0x%04X\n", pc + k);
+                    ok = false;
+                }
+                prog->kinds[pc + k] = k == 0 ? BYTE_OPCODE : BYTE_OPERAND;
+            }
+            prog->code_bytes += len;
+
+            uint8_t base = long_form(op);
+            if (base == OP_LOAD || base == OP_STORE) {
+                uint16_t addr = get16(prog->image + pc + 1);
+                if (addr < prog->size) {
+                    fprintf(stderr, "Error: Code at 0x%04X reads or writes the image itself at 0x%04X\n", pc, addr);
+                    ok = false;
+                }
+            } else if (op == OP_LOAD_IND || op == OP_STORE_IND) {
+                prog->indirect_count++;
+            } else if (is_branch(op)) {
+                uint32_t target = branch_target(prog->image, pc);
+                if (target >= prog->size) {
+                    fprintf(stderr, "Error: Branch at 0x%04X leaves the image for 0x%04X\n", pc, target);
+                    ok = false;
+                    break;
+                }
+                prog->leader[target] = true;
+                work[pending++] = target;
+                prog->jump_count += base == OP_JMP;
+            }
+
+            pc += len;
+            if (base == OP_JMP || op == OP_HALT || op == OP_RET) {
+                if (pc < prog->size) {
+                    prog->leader[pc] = true;
+                }
+                break;
+            }
+            if ((base == OP_JZ || base == OP_JNZ) && pc < prog->size) {
+                prog->leader[pc] = true;
+            }
+        }
+    }
+
+    free(work);
+    return ok;
+}
+
+/**
+ * Split the decoded code into blocks, numbered in address order so block 0
+ * is the entry point
+ */
+static bool build_blocks(program_t* prog) {
+    int blocks = 0;
+    for (uint32_t pc = 0; pc < prog->size; pc++) {
+        prog->block_at[pc] = NO_BLOCK;
+        if (prog->kinds[pc] == BYTE_OPCODE && prog->leader[pc]) {
+            prog->block_at[pc] = blocks++;
+        }
+    }
+
+    prog->blocks = calloc(blocks, sizeof(block_t));
+    prog->insns = malloc((prog->code_bytes ? prog->code_bytes : 1) * sizeof(insn_t));
+    if (!prog->blocks || !prog->insns) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return false;
+    }
+    prog->block_count = blocks;
+
+    for (uint32_t start = 0; start < prog->size; start++) {
+        if (prog->block_at[start] == NO_BLOCK) continue;
+
+        block_t* block = &prog->blocks[prog->block_at[start]];
+        block->addr = (uint16_t)start;
+        block->first = prog->insn_count;
+        block->target = NO_BLOCK;
+        block->next = NO_BLOCK;
+
+        uint32_t pc = start;
+        for (;;) {
+            uint8_t op = prog->image[pc];
+            uint8_t base = long_form(op);
+            uint32_t len = 1 + operand_size(op);
+            block->exit_addr = (uint16_t)pc;
+            if (base == OP_JMP) {
+                block->exit = EXIT_JUMP;
+                block->target = prog->block_at[branch_target(prog->image, pc)];
+                break;
+            }
+            if (base == OP_JZ || base == OP_JNZ) {
+                block->exit = EXIT_BRANCH;
+                block->exit_op = base;
+                block->target = prog->block_at[branch_target(prog->image, pc)];
+                block->next = prog->block_at[pc + len];
+                break;
+            }
+            if (op == OP_HALT || op == OP_RET) {
+                block->exit = EXIT_STOP;
+                block->exit_op = op;
+                break;
+            }
+
+            insn_t* insn = &prog->insns[prog->insn_count++];
+            insn->addr = (uint16_t)pc;
+            insn->op = base;
+            insn->operand = len == 3 ? get16(prog->image + pc + 1) : len == 2 ? prog->image[pc + 1] : 0;
+            insn->target = base == OP_CALL ? prog->block_at[branch_target(prog->image, pc)] : NO_BLOCK;
+            block->count++;
+
+            pc += len;
+            if (prog->block_at[pc] != NO_BLOCK) {
+                block->exit = EXIT_FALL;
+                block->next = prog->block_at[pc];
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+// Follow blocks that do nothing but jump elsewhere; a cycle of them stops the walk
+static int final_target(const program_t* prog, int b) {
+    for (int steps = 0; steps < prog->block_count; steps++) {
+        const block_t* block = &prog->blocks[b];
+        if (block->count > 0 || block->exit != EXIT_JUMP) break;
+        b = block->target;
+    }
+    return b;
+}
+
+/**
+ * Point every branch, call and fall-through past chains of jumps. A jump
+ * to a lone HALT or RET becomes that instruction.
+ * @return: Number of branch operands changed
+ */
+static int thread_jumps(program_t* prog) {
+    int threaded = 0;
+    for (int b = 0; b < prog->block_count; b++) {
+        block_t* block = &prog->blocks[b];
+        for (int i = 0; i < block->count; i++) {
+            insn_t* insn = &prog->insns[block->first + i];
+            if (insn->target != NO_BLOCK) {
+                int target = final_target(prog, insn->target);
+                threaded += target != insn->target;
+                insn->target = target;
+            }
+        }
+
+        if (block->exit == EXIT_JUMP || block->exit == EXIT_BRANCH) {
+            int target = final_target(prog, block->target);
+            threaded += target != block->target;
+            block->target = target;
+        }
+        if (block->exit == EXIT_FALL || block->exit == EXIT_BRANCH) {
+            block->next = final_target(prog, block->next);
+        }
+
+        const block_t* target = block->exit == EXIT_JUMP ? &prog->blocks[block->target] : NULL;
+        if (target && target->count == 0 && target->exit == EXIT_STOP) {
+            block->exit = EXIT_STOP;
+            block->exit_op = target->exit_op;
+            threaded++;
+        }
+    }
+    return threaded;
+}
+
+// Mark the blocks reached from the entry point once jumps are threaded
+static bool mark_reachable(program_t* prog) {
+    int* work = malloc((prog->block_count + 1) * sizeof(int));
+    if (!work) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return false;
+    }
+
+    int pending = 0;
+    work[pending++] = 0;
+    prog->blocks[0].reachable = true;
+    while (pending > 0) {
+        const block_t* block = &prog->blocks[work[--pending]];
+        int succ[2] = { NO_BLOCK, NO_BLOCK };
+        if (block->exit == EXIT_JUMP || block->exit == EXIT_BRANCH) succ[0] = block->target;
+        if (block->exit == EXIT_FALL || block->exit == EXIT_BRANCH) succ[1] = block->next;
+
+        for (int k = 0; k < 2 + block->count; k++) {
+            int s = k < 2 ? succ[k] : prog->insns[block->first + k - 2].target;
+            if (s != NO_BLOCK && !prog->blocks[s].reachable) {
+                prog->blocks[s].reachable = true;
+                work[pending++] = s;
+            }
+        }
+    }
+
+    free(work);
+    return true;
+}
+
+// The successor a block would like to fall through into
+static int preferred_next(const program_t* prog, int b) {
+    const block_t* block = &prog->blocks[b];
+    switch (block->exit) {
+        case EXIT_FALL:
+            return block->next;
+        case EXIT_JUMP:
+            return block->target;
+        case EXIT_BRANCH:
+            return prog->blocks[block->next].placed ? block->target : block->next;
+        default:
+            return NO_BLOCK;
+    }
+}
+
+/**
+ * Order the reachable blocks, starting with the entry point. With follow
+ * set, each block is followed by its preferred successor while that is
+ * still unplaced; otherwise the input order is kept.
+ */
+static void layout_blocks(program_t* prog, bool follow) {
+    prog->order_count = 0;
+    for (int b = 0; b < prog->block_count; b++) {
+        prog->blocks[b].placed = false;
+    }
+
+    for (int b = 0; b < prog->block_count; b++) {
+        int cur = b;
+        while (cur != NO_BLOCK && prog->blocks[cur].reachable && !prog->blocks[cur].placed) {
+            prog->blocks[cur].placed = true;
+            prog->order[prog->order_count++] = cur;
+            cur = follow ? preferred_next(prog, cur) : NO_BLOCK;
+        }
+    }
+}
+
+static void add_out(program_t* prog, uint8_t op, uint16_t operand, int target, int32_t addr) {
+    out_insn_t* out = &prog->out[prog->out_count++];
+    out->op = op;
+    out->operand = operand;
+    out->target = target;
+    out->addr = addr;
+    out->is_short = false;
+}
+
+// Emit the blocks in layout order; exits to the next block need no jump
+static void emit_blocks(program_t* prog) {
+    prog->out_count = 0;
+    for (int i = 0; i < prog->order_count; i++) {
+        const block_t* block = &prog->blocks[prog->order[i]];
+        int following = i + 1 < prog->order_count ? prog->order[i + 1] : NO_BLOCK;
+        prog->order_first[i] = prog->out_count;
+
+        for (int k = 0; k < block->count; k++) {
+            const insn_t* insn = &prog->insns[block->first + k];
+            add_out(prog, insn->op, insn->operand, insn->target, insn->addr);
+        }
+
+        switch (block->exit) {
+            case EXIT_FALL:
+                if (block->next != following) {
+                    add_out(prog, OP_JMP, 0, block->next, NO_ADDRESS);
+                }
+                break;
+            case EXIT_JUMP:
+                if (block->target != following) {
+                    add_out(prog, OP_JMP, 0, block->target, block->exit_addr);
+                }
+                break;
+            case EXIT_BRANCH:
+                if (block->target == following && block->next != following) {
+                    uint8_t inverted = block->exit_op == OP_JZ ? OP_JNZ : OP_JZ;
+                    add_out(prog, inverted, 0, block->next, block->exit_addr);
+                } else {
+                    add_out(prog, block->exit_op, 0, block->target, block->exit_addr);
+                    if (block->next != following) {
+                        add_out(prog, OP_JMP, 0, block->next, NO_ADDRESS);
+                    }
+                }
+                break;
+            case EXIT_STOP:
+                add_out(prog, block->exit_op, 0, NO_BLOCK, block->exit_addr);
+                break;
+        }
+    }
+    prog->order_first[prog->order_count] = prog->out_count;
+}
+
+// Lay out the output addresses; returns the code size
+static uint32_t place_code(program_t* prog, uint32_t* insn_addr) {
+    uint32_t pos = 0;
+    for (int i = 0; i < prog->order_count; i++) {
+        prog->block_addr[prog->order[i]] = (uint16_t)pos;
+        for (int k = prog->order_first[i]; k < prog->order_first[i + 1]; k++) {
+            const out_insn_t* out = &prog->out[k];
+            insn_addr[k] = pos;
+            pos += out->is_short ? 2 : 1 + operand_size(out->op);
+        }
+    }
+    return pos;
+}
+
+/**
+ * Encode the output, relaxing branches as kxasm does: every branch starts
+ * short and goes back to its long form if its target is out of reach
+ * @return: false if the code no longer fits in the input image
+ */
+static bool encode_program(program_t* prog, int* short_count, int* branch_count) {
+    uint32_t* insn_addr = malloc((prog->out_count ? prog->out_count : 1) * sizeof(uint32_t));
+    if (!insn_addr) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return false;
+    }
+
+    *branch_count = 0;
+    for (int k = 0; k < prog->out_count; k++) {
+        prog->out[k].is_short = prog->out[k].target != NO_BLOCK;
+        *branch_count += prog->out[k].is_short;
+    }
+
+    uint32_t size = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        size = place_code(prog, insn_addr);
+        for (int k = 0; k < prog->out_count; k++) {
+            out_insn_t* out = &prog->out[k];
+            if (!out->is_short) continue;
+            int32_t offset = (int32_t)prog->block_addr[out->target] - (int32_t)(insn_addr[k] + 2);
+            if (offset < VM_SHORT_BRANCH_MIN || offset > VM_SHORT_BRANCH_MAX) {
+                out->is_short = false;
+                changed = true;
+            }
+        }
+    }
+
+    if (size > prog->size) {
+        free(insn_addr);
+        return false;
+    }
+
+    *short_count = 0;
+    uint8_t* code = prog->code;
+    for (int k = 0; k < prog->out_count; k++) {
+        const out_insn_t* out = &prog->out[k];
+        uint32_t pc = insn_addr[k];
+        uint16_t operand = out->operand;
+        if (out->target != NO_BLOCK) {
+            operand = prog->block_addr[out->target];
+        }
+
+        if (out->is_short) {
+            code[pc] = (uint8_t)(out->op + VM_SHORT_BRANCH_DELTA);
+            code[pc + 1] = (uint8_t)(operand - (pc + 2));
+            (*short_count)++;
+            continue;
+        }
+        code[pc] = out->op;
+        switch (operand_size(out->op)) {
+            case 1:
+                code[pc + 1] = operand & 0xFF;
+                break;
+            case 2:
+                code[pc + 1] = operand & 0xFF;
+                code[pc + 2] = (operand >> 8) & 0xFF;
+                break;
+        }
+    }
+
+    for (int k = 0; k < prog->out_count; k++) {
+        prog->out[k].new_addr = (uint16_t)insn_addr[k];
+    }
+    prog->code_size = size;
+    free(insn_addr);
+    return true;
+}
+
+/**
+ * Carry the input's .dbg over to the output: code symbols move with their
+ * blocks and the line table follows the instructions it describes
+ */
+static void rewrite_debug_info(const program_t* prog, const char* input_path, const char* output_path) {
+    char input_dbg[1024];
+    char output_dbg[1024];
+    if (!kxd_path(input_path, input_dbg, sizeof(input_dbg)) || !kxd_path(output_path, output_dbg, sizeof(output_dbg))) {
+        return;
+    }
+    FILE* probe = fopen(input_dbg, "rb");
+    if (!probe) {
+        return;
+    }
+    fclose(probe);
+
+    kxd_info_t old_info;
+    kxd_info_t new_info;
+    kxd_init(&new_info);
+    const char* problem = kxd_load(&old_info, input_dbg);
+    if (!problem && !kxd_matches_image(&old_info, prog->image, prog->size)) {
+        problem = "written for a different image";
+    }
+    kxd_set_image(&new_info, prog->code, prog->code_size);
+    bool ok = !problem && kxd_set_source(&new_info, old_info.source);
+
+    // Output address of each input instruction that was kept
+    int32_t* moved_to = ok ? malloc((prog->size ? prog->size : 1) * sizeof(int32_t)) : NULL;
+    ok = ok && moved_to;
+    for (uint32_t addr = 0; ok && addr < prog->size; addr++) {
+        moved_to[addr] = NO_ADDRESS;
+    }
+    for (int k = 0; ok && k < prog->out_count; k++) {
+        if (prog->out[k].addr != NO_ADDRESS) {
+            moved_to[prog->out[k].addr] = prog->out[k].new_addr;
+        }
+    }
+
+    // Code symbols follow their instruction, or their block when the
+    // instruction itself was dropped, like a jump that now falls through
+    for (int i = 0; ok && i < old_info.symbol_count; i++) {
+        const kxd_symbol_t* sym = &old_info.symbols[i];
+        uint16_t address = sym->address;
+        if (sym->kind == KXD_SYMBOL_CODE) {
+            if (sym->address >= prog->size) continue;
+            int b = prog->block_at[sym->address];
+            if (moved_to[sym->address] != NO_ADDRESS) {
+                address = (uint16_t)moved_to[sym->address];
+            } else if (b != NO_BLOCK && prog->blocks[b].placed) {
+                address = prog->block_addr[b];
+            } else {
+                continue;
+            }
+        }
+        ok = kxd_add_symbol(&new_info, sym->name, strlen(sym->name), address, sym->kind);
+    }
+    free(moved_to);
+
+    for (int k = 0; ok && k < prog->out_count; k++) {
+        if (prog->out[k].addr == NO_ADDRESS) continue;
+        uint32_t line = kxd_line_at(&old_info, (uint16_t)prog->out[k].addr);
+        if (line) {
+            ok = kxd_add_line(&new_info, prog->out[k].new_addr, line);
+        }
+    }
+
+    ok = ok && kxd_write(&new_info, output_dbg);
+    if (ok) {
+        printf("Debug info: %d symbols, %d line entries written to '%s'\n", new_info.symbol_count,
+               new_info.line_count, output_dbg);
+    } else {
+        fprintf(stderr, "Warning: Cannot carry over debug info '%s'%s%s\n", input_dbg,
+                problem ? ": " : "", problem ? problem : "");
+    }
+    kxd_free(&old_info);
+    kxd_free(&new_info);
+}
+
+static int optimize(program_t* prog, const char* input_path, const char* output_path) {
+    if (!decode_program(prog) || !build_blocks(prog)) {
+        return 1;
+    }
+    int threaded = thread_jumps(prog);
+    if (!mark_reachable(prog)) {
+        return 1;
+    }
+
+    int outs = prog->insn_count + 2 * prog->block_count;
+    prog->order = malloc((prog->block_count + 1) * sizeof(int));
+    prog->order_first = malloc((prog->block_count + 1) * sizeof(int));
+    prog->out = malloc(outs * sizeof(out_insn_t));
+    prog->block_addr = calloc(prog->block_count, sizeof(uint16_t));
+    prog->code = malloc(prog->size);
+    if (!prog->order || !prog->order_first || !prog->out || !prog->block_addr || !prog->code) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 1;
+    }
+
+    // A fall-through layout can need jumps the input order did not
+    int short_count = 0;
+    int branch_count = 0;
+    bool fits = false;
+    for (int follow = 1; follow >= 0 && !fits; follow--) {
+        layout_blocks(prog, follow);
+        emit_blocks(prog);
+        fits = encode_program(prog, &short_count, &branch_count);
+    }
+    if (!fits) {
+        memcpy(prog->code, prog->image, prog->size);
+        prog->code_size = prog->size;
+        printf("No smaller layout found; copying the image unchanged\n");
+    }
+
+    FILE* out = fopen(output_path, "wb");
+    bool ok = out && fwrite(prog->code, 1, prog->code_size, out) == prog->code_size;
+    if (out && fclose(out) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: Cannot write '%s'\n", output_path);
+        return 1;
+    }
+
+    if (prog->indirect_count > 0) {
+        printf("Warning: %d indirect loads or stores are assumed to address data outside the image\n",
+               prog->indirect_count);
+    }
+    if (fits) {
+        int jumps = 0;
+        for (int k = 0; k < prog->out_count; k++) {
+            jumps += prog->out[k].op == OP_JMP;
+        }
+        printf("Optimized %d blocks: %u unreachable bytes removed, %d branches threaded, "
+               "jumps %d -> %d, %d of %d branches short\n", prog->order_count, prog->size - prog->code_bytes,
+               threaded, prog->jump_count, jumps, short_count, branch_count);
+        rewrite_debug_info(prog, input_path, output_path);
+    }
+    printf("%s: %u -> %u bytes -> %s\n", input_path, prog->size, prog->code_size, output_path);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        printf("Usage: %s <input.bin> <output.bin>\n", argv[0]);
+        printf("  Rewrites a program image; its .dbg from tinyc -g or kxasm -g is carried over if present\n");
+        return 1;
+    }
+
+    size_t size = 0;
+    uint8_t* image = read_file(argv[1], &size);
+    if (!image) {
+        fprintf(stderr, "Error: Cannot read '%s'\n", argv[1]);
+        return 1;
+    }
+    if (size == 0 || size > VM_MEMORY_SIZE) {
+        fprintf(stderr, "Error: '%s' is not a program image\n", argv[1]);
+        free(image);
+        return 1;
+    }
+
+    program_t* prog = calloc(1, sizeof(program_t));
+    if (!prog) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(image);
+        return 1;
+    }
+    prog->image = image;
+    prog->size = (uint32_t)size;
+
+    int result = optimize(prog, argv[1], argv[2]);
+
+    free(prog->insns);
+    free(prog->blocks);
+    free(prog->order);
+    free(prog->order_first);
+    free(prog->out);
+    free(prog->block_addr);
+    free(prog->code);
+    free(prog);
+    free(image);
+    return result;
+}
@@ -3,24 +3,61 @@
 
 #include <stdint.h>
 #include <stdbool.h>
-
-// Forward declaration for VM structure
-typedef struct vm_t vm_t;
+#include "vm.h"
 
 // Platform I/O operation IDs (renamed from SYS_*)
 #define IO_EXIT        0x00  // Exit program
 #define IO_PRINT_CHAR  0x01  // Print char (pop 1: ASCII)
 #define IO_READ_CHAR   0x02  // Read char from stdin, push ASCII
+#define IO_PRINT_STR   0x03  // Print NUL-terminated string (pop addr_hi, addr_lo)
+#define IO_PRINT_PSTR  0x04  // Print length-prefixed string (pop addr_hi, addr_lo)
 #define IO_DRAW_PIXEL  0x10  // Draw pixel (pop x, y, color)
 #define IO_DRAW_LINE   0x11  // Draw line (pop x1,y1,x2,y2,color)
 #define IO_FILL_RECT   0x12  // Fill rect (pop x,y,w,h,color)
 #define IO_REFRESH     0x13  // Refresh display buffer
+#define IO_DRAW_LIST   0x14  // Run display list (pop addr_hi, addr_lo)
 #define IO_POLL_KEY    0x20  // Poll keyboard push 1 if key available
 #define IO_GET_KEY     0x21  // Get key push ASCII code
 #define IO_POLL_MOUSE  0x22  // Poll mouse push 1 if mouse event
 #define IO_GET_MOUSE_X 0x23  // Get mouse X push lo, hi
 #define IO_GET_MOUSE_Y 0x24  // Get mouse Y push lo, hi
 #define IO_GET_MOUSE_B 0x25  // Get mouse buttons push 8-bit flags
+#define IO_INPUT_DEPTH 0x26  // Push number of queued input events (saturates at 255)
+#define IO_INPUT_DRAIN 0x27  // Drain events (pop addr_hi, addr_lo, max) push count
+#define IO_FILE_OPEN   0x30  // Open file (pop path_hi, path_lo, mode) push handle or 0
+#define IO_FILE_CLOSE  0x31  // Close file (pop handle) push 1 on success
+#define IO_FILE_READ   0x32  // Start read (pop handle, addr_hi, addr_lo, len_hi, len_lo) push request or 0
+#define IO_FILE_WRITE  0x33  // Start write (pop handle, addr_hi, addr_lo, len_hi, len_lo) push request or 0
+#define IO_FILE_POLL   0x34  // Poll transfer (pop request) push FILE_STATUS_*
+#define IO_FILE_RESULT 0x35  // Finish transfer (pop request) push bytes lo, hi
+
+// File device open modes (IO_FILE_OPEN)
+#define FILE_MODE_READ   0x01
+#define FILE_MODE_WRITE  0x02
+#define FILE_MODE_CREATE 0x04  // Create or truncate
+
+// File transfer states (IO_FILE_POLL)
+#define FILE_STATUS_PENDING 0x00
+#define FILE_STATUS_DONE    0x01
+#define FILE_STATUS_ERROR   0x02
+#define FILE_STATUS_INVALID 0x03
+
+// Display list commands for IO_DRAW_LIST: a command byte followed by its
+// operands, terminated by DRAW_CMD_END
+#define DRAW_CMD_END   0x00  // End of list
+#define DRAW_CMD_PIXEL 0x01  // x, y, color
+#define DRAW_CMD_LINE  0x02  // x1, y1, x2, y2, color
+#define DRAW_CMD_RECT  0x03  // x, y, w, h, color
+#define DRAW_CMD_BLIT  0x04  // x, y, w, h, src lo, src hi (w*h grayscale bytes)
+
+// Input event records written by IO_INPUT_DRAIN, INPUT_EVENT_SIZE bytes each:
+// type, code, x lo, x hi, y lo, y hi, timestamp lo, timestamp hi (ms)
+#define INPUT_EVENT_SIZE       8
+#define INPUT_EVENT_KEY_DOWN   0x01  // code = ASCII key
+#define INPUT_EVENT_KEY_UP     0x02  // code = ASCII key
+#define INPUT_EVENT_MOUSE_MOVE 0x03  // code = button flags
+#define INPUT_EVENT_MOUSE_DOWN 0x04  // code = button flags
+#define INPUT_EVENT_MOUSE_UP   0x05  // code = button flags
 
 // Error codes for platform I/O operations
 typedef enum {
@@ -57,14 +94,42 @@ void platform_io_cleanup(platform_io_context_t* ctx);
 platform_io_error_t handle_platform_io(vm_t* vm, platform_io_context_t* ctx, uint8_t io_id);
 
 /**
- * Process platform events (keyboard, mouse, window events)
- * Should be called regularly to handle input and system events
+ * Run a loaded program: run_vm executes on a VM thread while the calling
+ * thread, which must be the main thread, handles platform events and
+ * presents frames until the VM stops
+ * @param vm: VM instance
+ * @param ctx: Platform I/O context
+ * @return: Error code from run_vm
+ */
+vm_error_t platform_io_run(vm_t* vm, platform_io_context_t* ctx);
+
+/**
+ * Check in with the event loop from the VM thread
+ * Should be called regularly so the VM stops when the user quits
  * @param vm: VM instance
  * @param ctx: Platform I/O context
  * @return: true if VM should continue running, false if should exit
  */
 bool platform_io_process_events(vm_t* vm, platform_io_context_t* ctx);
 
+/**
+ * Block the VM thread until input arrives or the timeout expires. Used
+ * instead of platform_io_process_events while the VM is waiting for
+ * input, so an idle VM does not spin.
+ * @param vm: VM instance
+ * @param ctx: Platform I/O context
+ * @param timeout_ms: Maximum time to block in milliseconds
+ * @return: true if VM should continue running, false if should exit
+ */
+bool platform_io_wait_events(vm_t* vm, platform_io_context_t* ctx, uint32_t timeout_ms);
+
+/**
+ * Flush buffered console output
+ * Called by the VM when execution stops so nothing printed is lost
+ * @param ctx: Platform I/O context
+ */
+void platform_io_flush(platform_io_context_t* ctx);
+
 /**
  * Check if platform is waiting for input
  * @param ctx: Platform I/O context
@@ -5,30 +5,291 @@
 
 #include "../../platform_io.h"
 #include "../../vm.h"
+#include "../../file_device.h"
 #include <SDL2/SDL.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// The VM runs on its own thread while the main thread, which SDL requires
+// for events and rendering, runs the event loop. Completed frames are handed
+// over through a triple buffer: the VM owns the back frame, the event loop
+// owns the front frame, and the ready frame is the latest completed one
+// waiting to be presented. The event loop presents it at most once per
+// display refresh, so the VM never waits on the display.
+#define FRAME_BUFFER_COUNT 3
+#define DEFAULT_REFRESH_RATE 60
+#define EVENT_LOOP_WAIT_MS 100  // Longest the event loop sleeps with no frame waiting
+#define FRAME_BUFFER_BYTES (VM_DISPLAY_WIDTH * VM_DISPLAY_HEIGHT * sizeof(uint32_t))
+
+// Console output is collected here and written on newline, when the buffer
+// fills, before blocking for input and on exit.
+#define CONSOLE_BUFFER_SIZE 4096
+
+// Input events are queued in a single-producer/single-consumer ring so the
+// event loop and the VM thread exchange them without locking.
+#define INPUT_QUEUE_SIZE 256  // Must be a power of 2
+
+// Key presses wait here for read_char and IO_GET_KEY, so keys typed while
+// the VM is busy are read in order instead of overwriting each other.
+#define KEY_BUFFER_SIZE 16
+
+typedef struct {
+    uint32_t timestamp;
+    uint8_t type;
+    uint8_t code;
+    uint16_t x;
+    uint16_t y;
+} input_event_t;
+
+typedef struct {
+    input_event_t events[INPUT_QUEUE_SIZE];
+    SDL_atomic_t head;   // Next slot to write, advanced by the producer only
+    SDL_atomic_t tail;   // Next slot to read, advanced by the consumer only
+    uint32_t dropped;    // Events lost to a full queue (producer only)
+} input_queue_t;
+
 /**
  * SDL2-specific platform I/O context
  */
 typedef struct platform_io_context_t {
-    // SDL objects
+    // SDL objects, used on the main thread only
     SDL_Window* window;
     SDL_Renderer* renderer;
     SDL_Texture* texture;
     uint32_t* pixels;
     
-    // Input state
-    uint8_t last_key;
-    bool key_available;
+    // Frame handoff, guarded by frame_lock
+    SDL_mutex* frame_lock;
+    uint32_t* frames[FRAME_BUFFER_COUNT];
+    int back_frame;
+    int ready_frame;
+    int front_frame;
+    bool frame_pending;
+    uint64_t ready_stamp;
+    
+    // Present pacing (performance counter ticks)
+    uint64_t present_interval;
+    uint64_t last_present;
+    
+    // VM thread and its handshake with the event loop
+    vm_t* vm;
+    SDL_atomic_t vm_stopped;  // Set by the VM thread once run_vm returns
+    SDL_atomic_t quit;        // Set by the event loop when the window is closed
+    Uint32 wake_event;        // Wakes the event loop for a new frame or a stopped VM
+    
+    // Presentation counters (latencies in performance counter ticks)
+    uint64_t frames_published;
+    uint64_t frames_presented;
+    uint64_t frames_dropped;
+    uint64_t present_latency_total;
+    uint64_t present_latency_max;
+    
+    // Buffered console output
+    char console[CONSOLE_BUFFER_SIZE];
+    size_t console_len;
+    
+    // Host file device, created on first use
+    file_device_t* files;
+    
+    // Input state: the event loop writes the key and mouse state under
+    // input_lock and signals input_cond on key presses and quit
+    input_queue_t input_queue;
+    SDL_mutex* input_lock;
+    SDL_cond* input_cond;
+    uint8_t keys[KEY_BUFFER_SIZE];  // Unread key presses, oldest at key_start
+    uint32_t key_start;
+    uint32_t key_count;
+    uint8_t last_key;                // Returned by IO_GET_KEY when no key is waiting
     int mouse_x, mouse_y;
     uint8_t mouse_buttons;
     bool mouse_event;
-    bool waiting_for_input;
+    bool waiting_for_input;  // VM thread only
 } platform_io_context_t;
 
+/**
+ * Queue an input event (producer side). Drops the event if the queue is full.
+ */
+static void input_queue_push(input_queue_t* queue, const input_event_t* event) {
+    int head = SDL_AtomicGet(&queue->head);
+    int tail = SDL_AtomicGet(&queue->tail);
+    if ((uint32_t)(head - tail) >= INPUT_QUEUE_SIZE) {
+        queue->dropped++;
+        return;
+    }
+    queue->events[head & (INPUT_QUEUE_SIZE - 1)] = *event;
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&queue->head, head + 1);
+}
+
+/**
+ * Dequeue the oldest input event (consumer side)
+ * Returns false if the queue is empty
+ */
+static bool input_queue_pop(input_queue_t* queue, input_event_t* event) {
+    int tail = SDL_AtomicGet(&queue->tail);
+    int head = SDL_AtomicGet(&queue->head);
+    if (head == tail) {
+        return false;
+    }
+    SDL_MemoryBarrierAcquire();
+    *event = queue->events[tail & (INPUT_QUEUE_SIZE - 1)];
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&queue->tail, tail + 1);
+    return true;
+}
+
+/**
+ * Number of events currently queued
+ */
+static uint32_t input_queue_depth(input_queue_t* queue) {
+    return (uint32_t)(SDL_AtomicGet(&queue->head) - SDL_AtomicGet(&queue->tail));
+}
+
+/**
+ * Write buffered console output to stdout
+ */
+void platform_io_flush(platform_io_context_t* ctx) {
+    if (ctx->console_len > 0) {
+        fwrite(ctx->console, 1, ctx->console_len, stdout);
+        ctx->console_len = 0;
+    }
+    fflush(stdout);
+}
+
+/**
+ * Append bytes to the console buffer, flushing when it fills or a line ends
+ */
+static void console_write(platform_io_context_t* ctx, const uint8_t* data, size_t len) {
+    bool newline = false;
+    
+    while (len > 0) {
+        size_t space = CONSOLE_BUFFER_SIZE - ctx->console_len;
+        size_t chunk = len < space ? len : space;
+        memcpy(ctx->console + ctx->console_len, data, chunk);
+        if (memchr(data, '\n', chunk)) {
+            newline = true;
+        }
+        ctx->console_len += chunk;
+        data += chunk;
+        len -= chunk;
+        
+        if (ctx->console_len == CONSOLE_BUFFER_SIZE) {
+            platform_io_flush(ctx);
+        }
+    }
+    
+    if (newline) {
+        platform_io_flush(ctx);
+    }
+}
+
+/**
+ * Wake the event loop from the VM thread
+ */
+static void wake_event_loop(platform_io_context_t* ctx) {
+    SDL_Event event;
+    memset(&event, 0, sizeof(event));
+    event.type = ctx->wake_event;
+    SDL_PushEvent(&event);
+}
+
+/**
+ * Hand the current pixel buffer to the event loop (VM thread).
+ * If the previous frame has not been presented yet it is replaced and
+ * counted as dropped; otherwise the event loop is woken to present it.
+ */
+static void publish_frame(platform_io_context_t* ctx) {
+    memcpy(ctx->frames[ctx->back_frame], ctx->pixels, FRAME_BUFFER_BYTES);
+    
+    SDL_LockMutex(ctx->frame_lock);
+    bool was_pending = ctx->frame_pending;
+    if (was_pending) {
+        ctx->frames_dropped++;
+    }
+    int frame = ctx->ready_frame;
+    ctx->ready_frame = ctx->back_frame;
+    ctx->back_frame = frame;
+    ctx->frame_pending = true;
+    ctx->ready_stamp = SDL_GetPerformanceCounter();
+    ctx->frames_published++;
+    SDL_UnlockMutex(ctx->frame_lock);
+    
+    if (!was_pending) {
+        wake_event_loop(ctx);
+    }
+}
+
+/**
+ * Present the ready frame, if there is one (main thread). Unless forced,
+ * waits out the rest of the current refresh interval by leaving the frame
+ * for a later call.
+ */
+static void present_ready_frame(platform_io_context_t* ctx, bool force) {
+    uint64_t now = SDL_GetPerformanceCounter();
+    if (!ctx->renderer || (!force && now - ctx->last_present < ctx->present_interval)) {
+        return;
+    }
+    
+    // Take ownership of the ready frame
+    SDL_LockMutex(ctx->frame_lock);
+    if (!ctx->frame_pending) {
+        SDL_UnlockMutex(ctx->frame_lock);
+        return;
+    }
+    int frame = ctx->ready_frame;
+    ctx->ready_frame = ctx->front_frame;
+    ctx->front_frame = frame;
+    ctx->frame_pending = false;
+    uint64_t stamp = ctx->ready_stamp;
+    SDL_UnlockMutex(ctx->frame_lock);
+    
+    SDL_UpdateTexture(ctx->texture, NULL, ctx->frames[frame], VM_DISPLAY_WIDTH * sizeof(uint32_t));
+    SDL_RenderClear(ctx->renderer);
+    SDL_RenderCopy(ctx->renderer, ctx->texture, NULL, NULL);
+    SDL_RenderPresent(ctx->renderer);
+    
+    uint64_t latency = SDL_GetPerformanceCounter() - stamp;
+    ctx->last_present = now;
+    ctx->frames_presented++;
+    ctx->present_latency_total += latency;
+    if (latency > ctx->present_latency_max) {
+        ctx->present_latency_max = latency;
+    }
+}
+
+/**
+ * Release every resource held by the context
+ */
+static void destroy_context(platform_io_context_t* ctx) {
+    for (int i = 0; i < FRAME_BUFFER_COUNT; i++) {
+        free(ctx->frames[i]);
+    }
+    free(ctx->pixels);
+    
+    if (ctx->frame_lock) {
+        SDL_DestroyMutex(ctx->frame_lock);
+    }
+    if (ctx->input_cond) {
+        SDL_DestroyCond(ctx->input_cond);
+    }
+    if (ctx->input_lock) {
+        SDL_DestroyMutex(ctx->input_lock);
+    }
+    if (ctx->texture) {
+        SDL_DestroyTexture(ctx->texture);
+    }
+    if (ctx->renderer) {
+        SDL_DestroyRenderer(ctx->renderer);
+    }
+    if (ctx->window) {
+        SDL_DestroyWindow(ctx->window);
+    }
+    
+    SDL_Quit();
+    free(ctx);
+}
+
 /**
  * Initialize SDL2 platform I/O subsystem
  */
@@ -57,22 +318,51 @@ platform_io_context_t* platform_io_init(void) {
                                    SDL_WINDOW_SHOWN);
     if (!ctx->window) {
         printf("SDL_CreateWindow failed: %s\n", SDL_GetError());
-        SDL_Quit();
-        free(ctx);
+        destroy_context(ctx);
+        return NULL;
+    }
+    
+    // Allocate the drawing buffer and the presentation frames
+    ctx->pixels = calloc(1, FRAME_BUFFER_BYTES);
+    for (int i = 0; i < FRAME_BUFFER_COUNT; i++) {
+        ctx->frames[i] = calloc(1, FRAME_BUFFER_BYTES);
+    }
+    if (!ctx->pixels || !ctx->frames[0] || !ctx->frames[1] || !ctx->frames[2]) {
+        printf("Failed to allocate pixel buffer\n");
+        destroy_context(ctx);
         return NULL;
     }
+    ctx->back_frame = 0;
+    ctx->ready_frame = 1;
+    ctx->front_frame = 2;
     
-    // Create renderer
+    ctx->frame_lock = SDL_CreateMutex();
+    ctx->input_lock = SDL_CreateMutex();
+    if (!ctx->frame_lock || !ctx->input_lock) {
+        printf("SDL_CreateMutex failed: %s\n", SDL_GetError());
+        destroy_context(ctx);
+        return NULL;
+    }
+    ctx->input_cond = SDL_CreateCond();
+    if (!ctx->input_cond) {
+        printf("SDL_CreateCond failed: %s\n", SDL_GetError());
+        destroy_context(ctx);
+        return NULL;
+    }
+    ctx->wake_event = SDL_RegisterEvents(1);
+    if (ctx->wake_event == (Uint32)-1) {
+        printf("SDL_RegisterEvents failed: %s\n", SDL_GetError());
+        destroy_context(ctx);
+        return NULL;
+    }
+    
+    // Without vsync, presents are paced to the display's refresh rate instead
     ctx->renderer = SDL_CreateRenderer(ctx->window, -1, SDL_RENDERER_ACCELERATED);
     if (!ctx->renderer) {
         printf("SDL_CreateRenderer failed: %s\n", SDL_GetError());
-        SDL_DestroyWindow(ctx->window);
-        SDL_Quit();
-        free(ctx);
+        destroy_context(ctx);
         return NULL;
     }
-    
-    // Create texture for pixel buffer
     ctx->texture = SDL_CreateTexture(ctx->renderer,
                                      SDL_PIXELFORMAT_ARGB8888,
                                      SDL_TEXTUREACCESS_STREAMING,
@@ -80,27 +370,16 @@ platform_io_context_t* platform_io_init(void) {
                                      VM_DISPLAY_HEIGHT);
     if (!ctx->texture) {
         printf("SDL_CreateTexture failed: %s\n", SDL_GetError());
-        SDL_DestroyRenderer(ctx->renderer);
-        SDL_DestroyWindow(ctx->window);
-        SDL_Quit();
-        free(ctx);
+        destroy_context(ctx);
         return NULL;
     }
     
-    // Allocate pixel buffer
-    ctx->pixels = malloc(VM_DISPLAY_WIDTH * VM_DISPLAY_HEIGHT * sizeof(uint32_t));
-    if (!ctx->pixels) {
-        printf("Failed to allocate pixel buffer\n");
-        SDL_DestroyTexture(ctx->texture);
-        SDL_DestroyRenderer(ctx->renderer);
-        SDL_DestroyWindow(ctx->window);
-        SDL_Quit();
-        free(ctx);
-        return NULL;
+    SDL_DisplayMode mode;
+    int refresh_rate = DEFAULT_REFRESH_RATE;
+    if (SDL_GetWindowDisplayMode(ctx->window, &mode) == 0 && mode.refresh_rate > 0) {
+        refresh_rate = mode.refresh_rate;
     }
-    
-    // Clear pixel buffer
-    memset(ctx->pixels, 0, VM_DISPLAY_WIDTH * VM_DISPLAY_HEIGHT * sizeof(uint32_t));
+    ctx->present_interval = SDL_GetPerformanceFrequency() / refresh_rate;
     
     printf("SDL2 platform initialized successfully\n");
     return ctx;
@@ -112,24 +391,49 @@ platform_io_context_t* platform_io_init(void) {
 void platform_io_cleanup(platform_io_context_t* ctx) {
     if (!ctx) return;
     
-    if (ctx->pixels) {
-        free(ctx->pixels);
+    platform_io_flush(ctx);
+    if (ctx->files) {
+        printf("File device backend: %s\n", file_device_backend(ctx->files));
+        file_device_cleanup(ctx->files);
+        ctx->files = NULL;
     }
-    if (ctx->texture) {
-        SDL_DestroyTexture(ctx->texture);
-    }
-    if (ctx->renderer) {
-        SDL_DestroyRenderer(ctx->renderer);
+    if (ctx->input_queue.dropped > 0) {
+        printf("Input queue overflowed: %u events dropped\n", ctx->input_queue.dropped);
     }
-    if (ctx->window) {
-        SDL_DestroyWindow(ctx->window);
+    
+    // Show the last frame and report presentation counters
+    present_ready_frame(ctx, true);
+    double ticks_per_ms = SDL_GetPerformanceFrequency() / 1000.0;
+    if (ctx->frames_published > 0) {
+        double avg = ctx->frames_presented ? ctx->present_latency_total / (double)ctx->frames_presented : 0.0;
+        printf("Frames: %llu published, %llu presented, %llu dropped\n",
+               (unsigned long long)ctx->frames_published,
+               (unsigned long long)ctx->frames_presented,
+               (unsigned long long)ctx->frames_dropped);
+        printf("Present latency: avg %.2f ms, max %.2f ms\n",
+               avg / ticks_per_ms, ctx->present_latency_max / ticks_per_ms);
     }
     
-    SDL_Quit();
-    free(ctx);
+    destroy_context(ctx);
     printf("SDL2 platform cleaned up\n");
 }
 
+/**
+ * Convert 8-bit grayscale to ARGB
+ */
+static inline uint32_t gray_to_argb(uint8_t color) {
+    return 0xFF000000 | (color << 16) | (color << 8) | color;
+}
+
+/**
+ * Plot a single pixel, ignoring coordinates outside the display
+ */
+static inline void draw_pixel(platform_io_context_t* ctx, int x, int y, uint32_t color) {
+    if (x >= 0 && x < VM_DISPLAY_WIDTH && y >= 0 && y < VM_DISPLAY_HEIGHT) {
+        ctx->pixels[y * VM_DISPLAY_WIDTH + x] = color;
+    }
+}
+
 /**
  * Bresenham line drawing algorithm
  */
@@ -141,10 +445,7 @@ static void draw_line(platform_io_context_t* ctx, int x0, int y0, int x1, int y1
     int err = dx - dy;
     
     while (true) {
-        // Draw pixel if within bounds
-        if (x0 >= 0 && x0 < VM_DISPLAY_WIDTH && y0 >= 0 && y0 < VM_DISPLAY_HEIGHT) {
-            ctx->pixels[y0 * VM_DISPLAY_WIDTH + x0] = color;
-        }
+        draw_pixel(ctx, x0, y0, color);
         
         if (x0 == x1 && y0 == y1) break;
         
@@ -160,6 +461,206 @@ static void draw_line(platform_io_context_t* ctx, int x0, int y0, int x1, int y1
     }
 }
 
+/**
+ * Fill a rectangle clipped to the display
+ */
+static void fill_rect(platform_io_context_t* ctx, int x, int y, int w, int h, uint32_t color) {
+    int x_end = x + w < VM_DISPLAY_WIDTH ? x + w : VM_DISPLAY_WIDTH;
+    int y_end = y + h < VM_DISPLAY_HEIGHT ? y + h : VM_DISPLAY_HEIGHT;
+    
+    for (int py = y; py < y_end; py++) {
+        uint32_t* row = &ctx->pixels[py * VM_DISPLAY_WIDTH];
+        for (int px = x; px < x_end; px++) {
+            row[px] = color;
+        }
+    }
+}
+
+/**
+ * Copy a w*h block of grayscale bytes from guest memory to the display
+ */
+static void blit(vm_t* vm, platform_io_context_t* ctx, int x, int y, int w, int h, uint16_t src) {
+    for (int row = 0; row < h; row++) {
+        for (int col = 0; col < w; col++) {
+            uint16_t addr = src + row * w + col;
+            draw_pixel(ctx, x + col, y + row, gray_to_argb(vm->memory[addr]));
+        }
+    }
+}
+
+/**
+ * Execute a display list stored in guest memory
+ * Commands are a command byte followed by its operands; the list ends at
+ * DRAW_CMD_END. Returns an error if the list is malformed or runs off the
+ * end of memory.
+ */
+static platform_io_error_t run_draw_list(vm_t* vm, platform_io_context_t* ctx, uint16_t addr) {
+    uint32_t pos = addr;
+    
+    while (pos < VM_MEMORY_SIZE) {
+        const uint8_t* cmd = &vm->memory[pos];
+        uint32_t size;
+        
+        switch (cmd[0]) {
+            case DRAW_CMD_END:   return PLATFORM_IO_OK;
+            case DRAW_CMD_PIXEL: size = 4; break;
+            case DRAW_CMD_LINE:  size = 6; break;
+            case DRAW_CMD_RECT:  size = 6; break;
+            case DRAW_CMD_BLIT:  size = 7; break;
+            default:
+                platform_io_flush(ctx);
+                printf("Invalid display list command 0x%02X at 0x%04X\n", cmd[0], pos);
+                return PLATFORM_IO_ERROR_INVALID_OPERATION;
+        }
+        if (pos + size > VM_MEMORY_SIZE) {
+            break;
+        }
+        
+        switch (cmd[0]) {
+            case DRAW_CMD_PIXEL:
+                draw_pixel(ctx, cmd[1], cmd[2], gray_to_argb(cmd[3]));
+                break;
+            case DRAW_CMD_LINE:
+                draw_line(ctx, cmd[1], cmd[2], cmd[3], cmd[4], gray_to_argb(cmd[5]));
+                break;
+            case DRAW_CMD_RECT:
+                fill_rect(ctx, cmd[1], cmd[2], cmd[3], cmd[4], gray_to_argb(cmd[5]));
+                break;
+            case DRAW_CMD_BLIT:
+                blit(vm, ctx, cmd[1], cmd[2], cmd[3], cmd[4], cmd[5] | (cmd[6] << 8));
+                break;
+        }
+        pos += size;
+    }
+    
+    platform_io_flush(ctx);
+    printf("Display list at 0x%04X is not terminated\n", addr);
+    return PLATFORM_IO_ERROR_OUT_OF_BOUNDS;
+}
+
+/**
+ * Handle file device operations, creating the device on first use
+ */
+static platform_io_error_t handle_file_io(vm_t* vm, platform_io_context_t* ctx, uint8_t io_id) {
+    if (!ctx->files) {
+        ctx->files = file_device_init(vm->memory);
+        if (!ctx->files) {
+            return PLATFORM_IO_ERROR_DEVICE_NOT_READY;
+        }
+    }
+    
+    switch (io_id) {
+        case IO_FILE_OPEN: {
+            uint8_t mode = vm_pop(vm);
+            uint16_t addr = vm_pop(vm);
+            addr |= vm_pop(vm) << 8;
+            
+            // Copy the NUL-terminated guest path
+            char path[FILE_DEVICE_MAX_PATH];
+            size_t len = 0;
+            while (len < sizeof(path) - 1 && addr + len < VM_MEMORY_SIZE && vm->memory[addr + len]) {
+                path[len] = (char)vm->memory[addr + len];
+                len++;
+            }
+            path[len] = '\0';
+            
+            vm_push(vm, file_device_open(ctx->files, path, mode));
+            return PLATFORM_IO_OK;
+        }
+        
+        case IO_FILE_CLOSE: {
+            uint8_t handle = vm_pop(vm);
+            vm_push(vm, file_device_close(ctx->files, handle) ? 1 : 0);
+            return PLATFORM_IO_OK;
+        }
+        
+        case IO_FILE_READ:
+        case IO_FILE_WRITE: {
+            uint16_t len = vm_pop(vm);
+            len |= vm_pop(vm) << 8;
+            uint16_t addr = vm_pop(vm);
+            addr |= vm_pop(vm) << 8;
+            uint8_t handle = vm_pop(vm);
+            
+            vm_push(vm, file_device_submit(ctx->files, handle, io_id == IO_FILE_WRITE, addr, len));
+            return PLATFORM_IO_OK;
+        }
+        
+        case IO_FILE_POLL: {
+            uint8_t request = vm_pop(vm);
+            vm_push(vm, file_device_poll(ctx->files, request));
+            return PLATFORM_IO_OK;
+        }
+        
+        case IO_FILE_RESULT: {
+            // Push transferred byte count (little-endian 16-bit)
+            uint8_t request = vm_pop(vm);
+            uint16_t bytes = file_device_result(ctx->files, request);
+            vm_push(vm, bytes & 0xFF);
+            vm_push(vm, (bytes >> 8) & 0xFF);
+            return PLATFORM_IO_OK;
+        }
+        
+        default:
+            return PLATFORM_IO_ERROR_INVALID_OPERATION;
+    }
+}
+
+/**
+ * Take the oldest unread key press; the caller holds input_lock
+ * Returns false if no key is waiting
+ */
+static bool take_key(platform_io_context_t* ctx, uint8_t* key) {
+    if (ctx->key_count == 0) {
+        return false;
+    }
+    *key = ctx->keys[ctx->key_start];
+    ctx->key_start = (ctx->key_start + 1) % KEY_BUFFER_SIZE;
+    ctx->key_count--;
+    return true;
+}
+
+/**
+ * Handle key and mouse state queries; the caller holds input_lock
+ */
+static void handle_input_state(vm_t* vm, platform_io_context_t* ctx, uint8_t io_id) {
+    switch (io_id) {
+        case IO_POLL_KEY:
+            // Push 1 if key is available, 0 otherwise
+            vm_push(vm, ctx->key_count > 0 ? 1 : 0);
+            break;
+            
+        case IO_GET_KEY:
+            // Get the oldest unread key and mark it as consumed
+            take_key(ctx, &ctx->last_key);
+            vm_push(vm, ctx->last_key);
+            break;
+            
+        case IO_POLL_MOUSE:
+            // Push 1 if mouse event occurred, 0 otherwise
+            vm_push(vm, ctx->mouse_event ? 1 : 0);
+            break;
+            
+        case IO_GET_MOUSE_X:
+            // Push mouse X coordinate (little-endian 16-bit)
+            vm_push(vm, ctx->mouse_x & 0xFF);
+            vm_push(vm, (ctx->mouse_x >> 8) & 0xFF);
+            break;
+            
+        case IO_GET_MOUSE_Y:
+            // Push mouse Y coordinate (little-endian 16-bit)
+            vm_push(vm, ctx->mouse_y & 0xFF);
+            vm_push(vm, (ctx->mouse_y >> 8) & 0xFF);
+            break;
+            
+        case IO_GET_MOUSE_B:
+            // Get mouse button state and clear event flag
+            vm_push(vm, ctx->mouse_buttons);
+            ctx->mouse_event = false;
+            break;
+    }
+}
+
 /**
  * Handle platform I/O operations
  */
@@ -167,24 +668,51 @@ platform_io_error_t handle_platform_io(vm_t* vm, platform_io_context_t* ctx, uin
     switch (io_id) {
         case IO_EXIT:
             vm->running = false;
+            platform_io_flush(ctx);
             return PLATFORM_IO_OK;
             
         case IO_PRINT_CHAR: {
             uint8_t ch = vm_pop(vm);
-            printf("%c", ch);
-            fflush(stdout);
+            console_write(ctx, &ch, 1);
+            return PLATFORM_IO_OK;
+        }
+        
+        case IO_PRINT_STR: {
+            uint16_t addr = vm_pop(vm);
+            addr |= vm_pop(vm) << 8;
+            
+            const uint8_t* str = &vm->memory[addr];
+            const uint8_t* end = memchr(str, '\0', VM_MEMORY_SIZE - addr);
+            console_write(ctx, str, end ? (size_t)(end - str) : (size_t)(VM_MEMORY_SIZE - addr));
+            return PLATFORM_IO_OK;
+        }
+        
+        case IO_PRINT_PSTR: {
+            uint16_t addr = vm_pop(vm);
+            addr |= vm_pop(vm) << 8;
+            
+            uint32_t len = vm->memory[addr];
+            if ((uint32_t)addr + 1 + len > VM_MEMORY_SIZE) {
+                return PLATFORM_IO_ERROR_OUT_OF_BOUNDS;
+            }
+            console_write(ctx, &vm->memory[addr + 1], len);
             return PLATFORM_IO_OK;
         }
         
         case IO_READ_CHAR: {
             if (!ctx->waiting_for_input) {
+                // Make sure any prompt is visible before blocking
+                platform_io_flush(ctx);
                 ctx->waiting_for_input = true;
-                vm->pc--; // Retry this instruction until input is available
-            } else if (ctx->key_available) {
+                vm->pc -= 2; // Retry OP_IO (opcode + id) once input is available
+                return PLATFORM_IO_OK;
+            }
+            SDL_LockMutex(ctx->input_lock);
+            if (take_key(ctx, &ctx->last_key)) {
                 vm_push(vm, ctx->last_key);
                 ctx->waiting_for_input = false;
-                ctx->key_available = false;
             }
+            SDL_UnlockMutex(ctx->input_lock);
             return PLATFORM_IO_OK;
         }
         
@@ -193,11 +721,7 @@ platform_io_error_t handle_platform_io(vm_t* vm, platform_io_context_t* ctx, uin
             uint8_t y = vm_pop(vm);
             uint8_t x = vm_pop(vm);
             
-            if (x < VM_DISPLAY_WIDTH && y < VM_DISPLAY_HEIGHT) {
-                // Convert 8-bit grayscale to ARGB
-                uint32_t pixel_color = 0xFF000000 | (color << 16) | (color << 8) | color;
-                ctx->pixels[y * VM_DISPLAY_WIDTH + x] = pixel_color;
-            }
+            draw_pixel(ctx, x, y, gray_to_argb(color));
             return PLATFORM_IO_OK;
         }
         
@@ -208,9 +732,7 @@ platform_io_error_t handle_platform_io(vm_t* vm, platform_io_context_t* ctx, uin
             uint8_t y1 = vm_pop(vm);
             uint8_t x1 = vm_pop(vm);
             
-            // Convert 8-bit grayscale to ARGB
-            uint32_t pixel_color = 0xFF000000 | (color << 16) | (color << 8) | color;
-            draw_line(ctx, x1, y1, x2, y2, pixel_color);
+            draw_line(ctx, x1, y1, x2, y2, gray_to_argb(color));
             return PLATFORM_IO_OK;
         }
         
@@ -221,106 +743,230 @@ platform_io_error_t handle_platform_io(vm_t* vm, platform_io_context_t* ctx, uin
             uint8_t y = vm_pop(vm);
             uint8_t x = vm_pop(vm);
             
-            // Convert 8-bit grayscale to ARGB
-            uint32_t pixel_color = 0xFF000000 | (color << 16) | (color << 8) | color;
-            
-            // Fill rectangle with bounds checking
-            for (int py = y; py < y + h && py < VM_DISPLAY_HEIGHT; py++) {
-                for (int px = x; px < x + w && px < VM_DISPLAY_WIDTH; px++) {
-                    if (px >= 0 && py >= 0) {
-                        ctx->pixels[py * VM_DISPLAY_WIDTH + px] = pixel_color;
-                    }
-                }
-            }
+            fill_rect(ctx, x, y, w, h, gray_to_argb(color));
             return PLATFORM_IO_OK;
         }
         
+        case IO_DRAW_LIST: {
+            uint16_t addr = vm_pop(vm);
+            addr |= vm_pop(vm) << 8;
+            return run_draw_list(vm, ctx, addr);
+        }
+        
         case IO_REFRESH:
-            // Update texture with pixel data and present to screen
-            SDL_UpdateTexture(ctx->texture, NULL, ctx->pixels, VM_DISPLAY_WIDTH * sizeof(uint32_t));
-            SDL_RenderClear(ctx->renderer);
-            SDL_RenderCopy(ctx->renderer, ctx->texture, NULL, NULL);
-            SDL_RenderPresent(ctx->renderer);
+            // Hand the frame over; the event loop presents it
+            publish_frame(ctx);
             return PLATFORM_IO_OK;
             
         case IO_POLL_KEY:
-            // Push 1 if key is available, 0 otherwise
-            vm_push(vm, ctx->key_available ? 1 : 0);
-            return PLATFORM_IO_OK;
-            
         case IO_GET_KEY:
-            // Get the last pressed key and mark as consumed
-            vm_push(vm, ctx->last_key);
-            ctx->key_available = false;
-            return PLATFORM_IO_OK;
-            
         case IO_POLL_MOUSE:
-            // Push 1 if mouse event occurred, 0 otherwise
-            vm_push(vm, ctx->mouse_event ? 1 : 0);
-            return PLATFORM_IO_OK;
-            
         case IO_GET_MOUSE_X:
-            // Push mouse X coordinate (little-endian 16-bit)
-            vm_push(vm, ctx->mouse_x & 0xFF);
-            vm_push(vm, (ctx->mouse_x >> 8) & 0xFF);
+        case IO_GET_MOUSE_Y:
+        case IO_GET_MOUSE_B:
+            SDL_LockMutex(ctx->input_lock);
+            handle_input_state(vm, ctx, io_id);
+            SDL_UnlockMutex(ctx->input_lock);
             return PLATFORM_IO_OK;
             
-        case IO_GET_MOUSE_Y:
-            // Push mouse Y coordinate (little-endian 16-bit)
-            vm_push(vm, ctx->mouse_y & 0xFF);
-            vm_push(vm, (ctx->mouse_y >> 8) & 0xFF);
+        case IO_INPUT_DEPTH: {
+            uint32_t depth = input_queue_depth(&ctx->input_queue);
+            vm_push(vm, depth > 0xFF ? 0xFF : depth);
             return PLATFORM_IO_OK;
+        }
+        
+        case IO_INPUT_DRAIN: {
+            // Copy up to max queued events into guest memory, oldest first
+            uint8_t max = vm_pop(vm);
+            uint16_t addr = vm_pop(vm);
+            addr |= vm_pop(vm) << 8;
             
-        case IO_GET_MOUSE_B:
-            // Get mouse button state and clear event flag
-            vm_push(vm, ctx->mouse_buttons);
-            ctx->mouse_event = false;
+            uint8_t count = 0;
+            input_event_t event;
+            while (count < max && (uint32_t)addr + INPUT_EVENT_SIZE <= VM_MEMORY_SIZE &&
+                   input_queue_pop(&ctx->input_queue, &event)) {
+                uint8_t* record = &vm->memory[addr];
+                record[0] = event.type;
+                record[1] = event.code;
+                record[2] = event.x & 0xFF;
+                record[3] = (event.x >> 8) & 0xFF;
+                record[4] = event.y & 0xFF;
+                record[5] = (event.y >> 8) & 0xFF;
+                record[6] = event.timestamp & 0xFF;
+                record[7] = (event.timestamp >> 8) & 0xFF;
+                addr += INPUT_EVENT_SIZE;
+                count++;
+            }
+            vm_push(vm, count);
             return PLATFORM_IO_OK;
+        }
+        
+        case IO_FILE_OPEN:
+        case IO_FILE_CLOSE:
+        case IO_FILE_READ:
+        case IO_FILE_WRITE:
+        case IO_FILE_POLL:
+        case IO_FILE_RESULT:
+            return handle_file_io(vm, ctx, io_id);
             
         default:
+            platform_io_flush(ctx);
             printf("Unknown I/O operation: 0x%02X\n", io_id);
             return PLATFORM_IO_ERROR_INVALID_OPERATION;
     }
 }
 
 /**
- * Process SDL events (keyboard, mouse, window)
+ * Apply a single SDL event to the input state (main thread)
  */
-bool platform_io_process_events(vm_t* vm, platform_io_context_t* ctx) {
-    SDL_Event event;
+static void dispatch_event(platform_io_context_t* ctx, const SDL_Event* event) {
+    input_event_t input;
     
-    while (SDL_PollEvent(&event)) {
-        switch (event.type) {
-            case SDL_QUIT:
-                // User closed the window
-                return false;
-                
-            case SDL_KEYDOWN:
-                // Store the pressed key
-                ctx->last_key = event.key.keysym.sym & 0xFF;
-                ctx->key_available = true;
-                break;
-                
-            case SDL_MOUSEBUTTONDOWN:
-            case SDL_MOUSEBUTTONUP:
-            case SDL_MOUSEMOTION:
-                // Update mouse state (scale coordinates from window to display size)
-                ctx->mouse_x = event.motion.x / 2;
-                ctx->mouse_y = event.motion.y / 2;
-                ctx->mouse_buttons = SDL_GetMouseState(NULL, NULL);
-                ctx->mouse_event = true;
-                break;
+    switch (event->type) {
+        case SDL_QUIT:
+            // User closed the window: stop the VM, waking it if it waits for input
+            SDL_AtomicSet(&ctx->quit, 1);
+            SDL_LockMutex(ctx->input_lock);
+            SDL_CondBroadcast(ctx->input_cond);
+            SDL_UnlockMutex(ctx->input_lock);
+            break;
+            
+        case SDL_KEYDOWN:
+        case SDL_KEYUP:
+            input.timestamp = event->key.timestamp;
+            input.type = event->type == SDL_KEYDOWN ? INPUT_EVENT_KEY_DOWN : INPUT_EVENT_KEY_UP;
+            input.code = event->key.keysym.sym & 0xFF;
+            input.x = ctx->mouse_x;
+            input.y = ctx->mouse_y;
+            input_queue_push(&ctx->input_queue, &input);
+            
+            if (event->type == SDL_KEYDOWN) {
+                // Buffer the pressed key and wake a VM blocked in read_char;
+                // keys beyond the buffer are dropped
+                SDL_LockMutex(ctx->input_lock);
+                if (ctx->key_count < KEY_BUFFER_SIZE) {
+                    ctx->keys[(ctx->key_start + ctx->key_count) % KEY_BUFFER_SIZE] = input.code;
+                    ctx->key_count++;
+                }
+                SDL_CondSignal(ctx->input_cond);
+                SDL_UnlockMutex(ctx->input_lock);
+            }
+            break;
+            
+        case SDL_MOUSEBUTTONDOWN:
+        case SDL_MOUSEBUTTONUP:
+        case SDL_MOUSEMOTION:
+            // Update mouse state (scale coordinates from window to display size)
+            SDL_LockMutex(ctx->input_lock);
+            ctx->mouse_x = event->motion.x / 2;
+            ctx->mouse_y = event->motion.y / 2;
+            ctx->mouse_buttons = SDL_GetMouseState(NULL, NULL);
+            ctx->mouse_event = true;
+            SDL_UnlockMutex(ctx->input_lock);
+            
+            input.timestamp = event->motion.timestamp;
+            input.type = event->type == SDL_MOUSEMOTION ? INPUT_EVENT_MOUSE_MOVE :
+                         event->type == SDL_MOUSEBUTTONDOWN ? INPUT_EVENT_MOUSE_DOWN :
+                         INPUT_EVENT_MOUSE_UP;
+            input.code = ctx->mouse_buttons;
+            input.x = ctx->mouse_x;
+            input.y = ctx->mouse_y;
+            input_queue_push(&ctx->input_queue, &input);
+            break;
+    }
+}
+
+/**
+ * How long the event loop may sleep: until the next present is due when a
+ * frame is waiting, otherwise until an event or the wake event arrives
+ */
+static int event_loop_timeout(platform_io_context_t* ctx) {
+    SDL_LockMutex(ctx->frame_lock);
+    bool pending = ctx->frame_pending;
+    SDL_UnlockMutex(ctx->frame_lock);
+    if (!pending) {
+        return EVENT_LOOP_WAIT_MS;
+    }
+    
+    uint64_t elapsed = SDL_GetPerformanceCounter() - ctx->last_present;
+    if (elapsed >= ctx->present_interval) {
+        return 0;
+    }
+    uint64_t ticks_per_ms = SDL_GetPerformanceFrequency() / 1000;
+    return (int)((ctx->present_interval - elapsed + ticks_per_ms - 1) / ticks_per_ms);
+}
+
+/**
+ * Entry point of the VM thread
+ */
+static int vm_thread_main(void* data) {
+    platform_io_context_t* ctx = data;
+    run_vm(ctx->vm, ctx);
+    SDL_AtomicSet(&ctx->vm_stopped, 1);
+    wake_event_loop(ctx);
+    return 0;
+}
+
+/**
+ * Run the VM on its own thread; the main thread pumps SDL events and
+ * presents frames until the VM stops
+ */
+vm_error_t platform_io_run(vm_t* vm, platform_io_context_t* ctx) {
+    ctx->vm = vm;
+    SDL_Thread* thread = SDL_CreateThread(vm_thread_main, "kxn-vm", ctx);
+    if (!thread) {
+        printf("SDL_CreateThread failed: %s\n", SDL_GetError());
+        vm->error = VM_ERROR_PLATFORM_IO;
+        return vm->error;
+    }
+    
+    while (!SDL_AtomicGet(&ctx->vm_stopped)) {
+        SDL_Event event;
+        if (SDL_WaitEventTimeout(&event, event_loop_timeout(ctx))) {
+            dispatch_event(ctx, &event);
+            while (SDL_PollEvent(&event)) {
+                dispatch_event(ctx, &event);
+            }
         }
+        present_ready_frame(ctx, false);
     }
     
-    // Add a small delay to prevent excessive CPU usage
-    SDL_Delay(1);
-    return true;
+    SDL_WaitThread(thread, NULL);
+    ctx->vm = NULL;
+    return vm->error;
 }
 
 /**
- * Check if platform is waiting for input
+ * Check in with the event loop (VM thread)
+ */
+bool platform_io_process_events(vm_t* vm, platform_io_context_t* ctx) {
+    (void)vm;
+    return !SDL_AtomicGet(&ctx->quit);
+}
+
+/**
+ * Park the VM thread until a key is pressed, the window is closed or the
+ * timeout expires
+ */
+bool platform_io_wait_events(vm_t* vm, platform_io_context_t* ctx, uint32_t timeout_ms) {
+    (void)vm;
+    SDL_LockMutex(ctx->input_lock);
+    if (ctx->key_count == 0 && !SDL_AtomicGet(&ctx->quit)) {
+        SDL_CondWaitTimeout(ctx->input_cond, ctx->input_lock, timeout_ms);
+    }
+    SDL_UnlockMutex(ctx->input_lock);
+    return !SDL_AtomicGet(&ctx->quit);
+}
+
+/**
+ * Check if platform is waiting for input (VM thread)
  */
 bool platform_io_is_waiting_for_input(platform_io_context_t* ctx) {
-    return ctx->waiting_for_input && !ctx->key_available;
+    if (!ctx->waiting_for_input) {
+        return false;
+    }
+    SDL_LockMutex(ctx->input_lock);
+    bool waiting = ctx->key_count == 0;
+    SDL_UnlockMutex(ctx->input_lock);
+    return waiting;
 }
@@ -1,5 +1,6 @@
 #include "vm.h"
 #include "platform_io.h"
+#include "debug_info.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -60,6 +61,8 @@ vm_error_t init_vm(vm_t* vm) {
     vm->bp = VM_STACK_TOP;
     vm->running = true;
     vm->error = VM_OK;
+    vm->fault_pc = 0;
+    vm->program_size = 0;
     
     return VM_OK;
 }
@@ -88,29 +91,38 @@ vm_error_t load_program(vm_t* vm, const char* filename) {
         return VM_ERROR_INVALID_ADDRESS;
     }
     
+    vm->program_size = (uint32_t)bytes_read;
     return VM_OK;
 }
 
 /**
- * Main VM execution loop
+ * Main VM execution loop, run on the VM thread started by platform_io_run
  * @param vm: VM instance
  * @param platform_ctx: Platform I/O context (opaque to VM core)
  */
 vm_error_t run_vm(vm_t* vm, void* platform_ctx) {
     platform_io_context_t* io_ctx = (platform_io_context_t*)platform_ctx;
+    uint32_t poll_countdown = 0;
     
     while (vm->running && vm->error == VM_OK) {
-        // Process platform events
-        if (!platform_io_process_events(vm, io_ctx)) {
-            vm->running = false;
-            break;
-        }
-        
-        // If waiting for input, skip instruction execution
+        // If waiting for input, park until an event arrives
         if (platform_io_is_waiting_for_input(io_ctx)) {
+            if (!platform_io_wait_events(vm, io_ctx, VM_INPUT_WAIT_MS)) {
+                vm->running = false;
+                break;
+            }
             continue;
         }
         
+        // Process platform events periodically
+        if (poll_countdown-- == 0) {
+            poll_countdown = VM_EVENT_POLL_INTERVAL - 1;
+            if (!platform_io_process_events(vm, io_ctx)) {
+                vm->running = false;
+                break;
+            }
+        }
+        
         // Check program counter bounds
         if (vm->pc >= VM_MEMORY_SIZE) {
             vm->error = VM_ERROR_INVALID_ADDRESS;
@@ -118,6 +130,7 @@ vm_error_t run_vm(vm_t* vm, void* platform_ctx) {
         }
         
         // Fetch and execute instruction
+        uint16_t insn_pc = vm->pc;
         uint8_t opcode = vm->memory[vm->pc++];
         
         switch (opcode) {
@@ -371,6 +384,36 @@ vm_error_t run_vm(vm_t* vm, void* platform_ctx) {
                 break;
             }
             
+            case OP_JMPS: {
+                int8_t offset = (int8_t)vm->memory[vm->pc++];
+                vm->pc = (uint16_t)(vm->pc + offset);
+                break;
+            }
+            
+            case OP_JZS: {
+                int8_t offset = (int8_t)vm->memory[vm->pc++];
+                if (vm_pop(vm) == 0) {
+                    vm->pc = (uint16_t)(vm->pc + offset);
+                }
+                break;
+            }
+            
+            case OP_JNZS: {
+                int8_t offset = (int8_t)vm->memory[vm->pc++];
+                if (vm_pop(vm) != 0) {
+                    vm->pc = (uint16_t)(vm->pc + offset);
+                }
+                break;
+            }
+            
+            case OP_CALLS: {
+                int8_t offset = (int8_t)vm->memory[vm->pc++];
+                vm_push(vm, vm->pc & 0xFF);
+                vm_push(vm, (vm->pc >> 8) & 0xFF);
+                vm->pc = (uint16_t)(vm->pc + offset);
+                break;
+            }
+            
             case OP_RET: {
                 uint16_t addr = vm_pop(vm) << 8;
                 addr |= vm_pop(vm);
@@ -401,19 +444,77 @@ vm_error_t run_vm(vm_t* vm, void* platform_ctx) {
         
         // Break on error (except normal halt)
         if (vm->error != VM_OK && vm->error != VM_ERROR_HALT) {
+            vm->fault_pc = insn_pc;
             break;
         }
     }
     
+    platform_io_flush(io_ctx);
     return vm->error;
 }
 
+/**
+ * Load debug info for a program: the named file, or the program's .dbg if
+ * there is one. Debug info written for a different image is ignored.
+ * @param info: Debug info to fill in
+ * @param vm: VM with the program loaded and not yet run
+ * @param program_file: Program image path
+ * @param debug_file: Debug info path from the command line, or NULL
+ * @return: true if debug info was loaded
+ */
+static bool load_debug_info(kxd_info_t* info, const vm_t* vm, const char* program_file, const char* debug_file) {
+    char path[1024];
+    if (!debug_file) {
+        FILE* probe;
+        if (!kxd_path(program_file, path, sizeof(path)) || !(probe = fopen(path, "rb"))) {
+            kxd_init(info);
+            return false;
+        }
+        fclose(probe);
+        debug_file = path;
+    }
+    
+    const char* problem = kxd_load(info, debug_file);
+    if (!problem && !kxd_matches_image(info, vm->memory, vm->program_size)) {
+        problem = "written for a different build of the program";
+    }
+    if (problem) {
+        printf("Ignoring debug info %s: %s\n", debug_file, problem);
+        kxd_free(info);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Describe where an error happened: the code symbol and source line of pc
+ * @param info: Loaded debug info
+ * @param pc: Address of the failing instruction
+ */
+static void print_location(const kxd_info_t* info, uint16_t pc) {
+    const kxd_symbol_t* symbol = kxd_symbol_at(info, pc);
+    uint32_t line = kxd_line_at(info, pc);
+    if (!symbol && !line) {
+        return;
+    }
+    
+    printf(" (");
+    if (symbol) {
+        printf("%s+%u%s", symbol->name, (unsigned)(pc - symbol->address), line ? ", " : "");
+    }
+    if (line) {
+        printf("%s:%u", info->source[0] ? info->source : "line", line);
+    }
+    printf(")");
+}
+
 /**
  * Main entry point
  */
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        printf("Usage: %s <program_file>\n", argv[0]);
+    if (argc != 2 && argc != 3) {
+        printf("Usage: %s <program_file> [debug_file]\n", argv[0]);
+        printf("  debug_file defaults to the program's .dbg from tinyc -g or kxasm -g, if present\n");
         return 1;
     }
     
@@ -442,17 +543,25 @@ int main(int argc, char* argv[]) {
         return 1;
     }
     
+    kxd_info_t debug_info;
+    bool has_debug_info = load_debug_info(&debug_info, &vm, argv[1], argc == 3 ? argv[2] : NULL);
+    
     printf("Running VM...\n");
-    error = run_vm(&vm, io_ctx);
+    error = platform_io_run(&vm, io_ctx);
     
     // Report execution result
     if (error == VM_ERROR_HALT) {
         printf("VM halted normally\n");
     } else if (error != VM_OK) {
-        printf("VM error: %d\n", error);
+        printf("VM error: %d at 0x%04X", error, vm.fault_pc);
+        if (has_debug_info) {
+            print_location(&debug_info, vm.fault_pc);
+        }
+        printf("\n");
     }
     
     // Cleanup
+    kxd_free(&debug_info);
     platform_io_cleanup(io_ctx);
     cleanup_vm(&vm);
     return 0;
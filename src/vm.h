@@ -9,53 +9,87 @@
 #define VM_DISPLAY_WIDTH 320
 #define VM_DISPLAY_HEIGHT 240
 
-// Opcodes - General
-#define OP_NOP    0x00  // Do nothing
-#define OP_HALT   0x01  // Stop execution
+// Event handling cadence
+#define VM_EVENT_POLL_INTERVAL 1024  // Instructions between checks for a quit request
+#define VM_INPUT_WAIT_MS 100         // Max time parked per wait while blocked on input
 
-// Opcodes - Stack Operations
-#define OP_PUSH   0x02  // Push 8-bit immediate value
-#define OP_POP    0x03  // Pop top value
-#define OP_DUP    0x04  // Duplicate top value
-#define OP_SWAP   0x05  // Swap top 2 values
+// Instruction set: X(name, value, mnemonic, operand) for each opcode. This
+// list defines the OP_* constants and is expanded by the tools into their
+// opcode tables, so a new instruction is added here and nowhere else.
+#define VM_OPCODES(X) \
+    /* General */ \
+    X(NOP,       0x00, "NOP",       VM_OPERAND_NONE)   /* Do nothing */ \
+    X(HALT,      0x01, "HALT",      VM_OPERAND_NONE)   /* Stop execution */ \
+    /* Stack operations */ \
+    X(PUSH,      0x02, "PUSH",      VM_OPERAND_IMM8)   /* Push 8-bit immediate value */ \
+    X(POP,       0x03, "POP",       VM_OPERAND_NONE)   /* Pop top value */ \
+    X(DUP,       0x04, "DUP",       VM_OPERAND_NONE)   /* Duplicate top value */ \
+    X(SWAP,      0x05, "SWAP",      VM_OPERAND_NONE)   /* Swap top 2 values */ \
+    /* Arithmetic */ \
+    X(ADD,       0x06, "ADD",       VM_OPERAND_NONE)   /* Pop 2, push a + b */ \
+    X(SUB,       0x07, "SUB",       VM_OPERAND_NONE)   /* Pop 2, push a - b */ \
+    X(MUL,       0x08, "MUL",       VM_OPERAND_NONE)   /* Pop 2, push a * b */ \
+    X(DIV,       0x09, "DIV",       VM_OPERAND_NONE)   /* Pop 2, push a / b */ \
+    X(MOD,       0x0A, "MOD",       VM_OPERAND_NONE)   /* Pop 2, push a % b */ \
+    X(NEG,       0x0B, "NEG",       VM_OPERAND_NONE)   /* Pop 1, push -a */ \
+    /* Logic & comparison */ \
+    X(AND,       0x0C, "AND",       VM_OPERAND_NONE)   /* Pop 2, push a & b */ \
+    X(OR,        0x0D, "OR",        VM_OPERAND_NONE)   /* Pop 2, push a | b */ \
+    X(XOR,       0x0E, "XOR",       VM_OPERAND_NONE)   /* Pop 2, push a ^ b */ \
+    X(NOT,       0x0F, "NOT",       VM_OPERAND_NONE)   /* Pop 1, push ~a */ \
+    X(SHL,       0x10, "SHL",       VM_OPERAND_NONE)   /* Pop 2, push a << b */ \
+    X(SHR,       0x11, "SHR",       VM_OPERAND_NONE)   /* Pop 2, push a >> b */ \
+    X(EQ,        0x12, "EQ",        VM_OPERAND_NONE)   /* Pop 2, push 1 if equal else 0 */ \
+    X(NEQ,       0x13, "NEQ",       VM_OPERAND_NONE)   /* Pop 2, push 1 if not equal */ \
+    X(GT,        0x14, "GT",        VM_OPERAND_NONE)   /* Pop 2, push 1 if a > b */ \
+    X(LT,        0x15, "LT",        VM_OPERAND_NONE)   /* Pop 2, push 1 if a < b */ \
+    X(GTE,       0x16, "GTE",       VM_OPERAND_NONE)   /* Pop 2, push 1 if a >= b */ \
+    X(LTE,       0x17, "LTE",       VM_OPERAND_NONE)   /* Pop 2, push 1 if a <= b */ \
+    /* Memory */ \
+    X(LOAD,      0x18, "LOAD",      VM_OPERAND_ADDR16) /* Push value at addr */ \
+    X(STORE,     0x19, "STORE",     VM_OPERAND_ADDR16) /* Pop value store to addr */ \
+    X(LOAD_IND,  0x1A, "LOAD_IND",  VM_OPERAND_NONE)   /* Pop addr push value at addr */ \
+    X(STORE_IND, 0x1B, "STORE_IND", VM_OPERAND_NONE)   /* Pop addr, pop val, store val to addr */ \
+    /* Control flow */ \
+    X(JMP,       0x1C, "JMP",       VM_OPERAND_ADDR16) /* Jump unconditionally */ \
+    X(JZ,        0x1D, "JZ",        VM_OPERAND_ADDR16) /* Pop if zero, jump */ \
+    X(JNZ,       0x1E, "JNZ",       VM_OPERAND_ADDR16) /* Pop if not zero, jump */ \
+    X(CALL,      0x1F, "CALL",      VM_OPERAND_ADDR16) /* Call subroutine */ \
+    X(RET,       0x20, "RET",       VM_OPERAND_NONE)   /* Return from subroutine */ \
+    /* Platform I/O (formerly OP_SYS, still written SYS) */ \
+    X(IO,        0x21, "SYS",       VM_OPERAND_IMM8)   /* Perform platform I/O operation with ID imm8 */ \
+    /* Short control flow, offset from the next instruction */ \
+    X(JMPS,      0x22, "JMPS",      VM_OPERAND_REL8)   /* Jump by offset */ \
+    X(JZS,       0x23, "JZS",       VM_OPERAND_REL8)   /* Pop if zero, jump by offset */ \
+    X(JNZS,      0x24, "JNZS",      VM_OPERAND_REL8)   /* Pop if not zero, jump by offset */ \
+    X(CALLS,     0x25, "CALLS",     VM_OPERAND_REL8)   /* Call subroutine at offset */
 
-// Opcodes - Arithmetic
-#define OP_ADD    0x06  // Pop 2, push a + b
-#define OP_SUB    0x07  // Pop 2, push a - b
-#define OP_MUL    0x08  // Pop 2, push a * b
-#define OP_DIV    0x09  // Pop 2, push a / b
-#define OP_MOD    0x0A  // Pop 2, push a % b
-#define OP_NEG    0x0B  // Pop 1, push -a
-
-// Opcodes - Logic & Comparison
-#define OP_AND    0x0C  // Pop 2, push a & b
-#define OP_OR     0x0D  // Pop 2, push a | b
-#define OP_XOR    0x0E  // Pop 2, push a ^ b
-#define OP_NOT    0x0F  // Pop 1, push ~a
-#define OP_SHL    0x10  // Pop 2, push a << b
-#define OP_SHR    0x11  // Pop 2, push a >> b
-#define OP_EQ     0x12  // Pop 2, push 1 if equal else 0
-#define OP_NEQ    0x13  // Pop 2, push 1 if not equal
-#define OP_GT     0x14  // Pop 2, push 1 if a > b
-#define OP_LT     0x15  // Pop 2, push 1 if a < b
-#define OP_GTE    0x16  // Pop 2, push 1 if a >= b
-#define OP_LTE    0x17  // Pop 2, push 1 if a <= b
+// Operand that follows an opcode byte
+typedef enum {
+    VM_OPERAND_NONE,
+    VM_OPERAND_IMM8,    // One byte
+    VM_OPERAND_ADDR16,  // Little-endian address, two bytes
+    VM_OPERAND_REL8     // Signed offset from the next instruction, one byte
+} vm_operand_t;
 
-// Opcodes - Memory
-#define OP_LOAD     0x18  // Push value at addr
-#define OP_STORE    0x19  // Pop value store to addr
-#define OP_LOAD_IND 0x1A  // Pop addr push value at addr
-#define OP_STORE_IND 0x1B // Pop addr, pop val \u2192 store val to addr
+// Opcodes
+enum {
+#define VM_OPCODE_ENUM(name, value, mnemonic, operand) OP_##name = value,
+    VM_OPCODES(VM_OPCODE_ENUM)
+#undef VM_OPCODE_ENUM
+};
 
-// Opcodes - Control Flow
-#define OP_JMP    0x1C  // Jump unconditionally
-#define OP_JZ     0x1D  // Pop if zero, jump
-#define OP_JNZ    0x1E  // Pop if not zero, jump
-#define OP_CALL   0x1F  // Call subroutine
-#define OP_RET    0x20  // Return from subroutine
+// JMPS..CALLS mirror JMP..CALL: add this to a long branch for its short form
+#define VM_SHORT_BRANCH_DELTA (OP_JMPS - OP_JMP)
+#define VM_SHORT_BRANCH_MIN   (-128)
+#define VM_SHORT_BRANCH_MAX   127
 
-// Opcodes - Platform I/O (renamed from OP_SYS)
-#define OP_IO     0x21  // Perform platform I/O operation with ID imm8
+// One row of an opcode table built from VM_OPCODES
+typedef struct {
+    const char* mnemonic;
+    uint8_t opcode;
+    uint8_t operand;        // vm_operand_t
+} vm_opcode_info_t;
 
 // VM Error codes
 typedef enum {
@@ -77,6 +111,8 @@ typedef struct vm_t {
     uint16_t bp;                     // Base pointer
     bool running;                    // VM execution state
     vm_error_t error;               // Last error code
+    uint16_t fault_pc;               // Instruction that raised the error
+    uint32_t program_size;           // Bytes read by load_program
 } vm_t;
 
 // VM Core Functions